@@ -0,0 +1,63 @@
+#include "bake.h"
+
+#include <glm/glm.hpp>
+
+#include <cfloat>
+#include <map>
+#include <utility>
+
+std::vector<BakedBatch> bake_static(const std::vector<BakeSource>& sources)
+{
+	std::vector<BakedBatch> batches;
+	// Batch being filled for each material and texture
+	std::map<std::pair<std::uint32_t, GLuint>, std::size_t> open;
+
+	for (const auto& source : sources) {
+		const auto& node = *source.node;
+		const auto& gltf = *node.gltf;
+		for (const auto& meshnode : gltf.meshnodes) {
+			auto transform = node.transform * meshnode.transform;
+			auto instances = std::max<std::size_t>(1, meshnode.instances.size());
+			for (std::size_t i = 0; i < instances; ++i) {
+				auto model = meshnode.instances.empty() ? transform : transform * meshnode.instances[i];
+				auto normal_matrix = glm::transpose(glm::inverse(glm::mat3(model)));
+				for (const auto& prim : gltf.meshes[meshnode.mesh_idx].primitives) {
+					auto material = static_cast<std::uint32_t>(source.first_material + prim.material_idx);
+					GLuint texture = 0;
+					if (prim.texture_idx < gltf.textures.size()) {
+						texture = gltf.textures[prim.texture_idx].id;
+					}
+
+					auto key = std::make_pair(material, texture);
+					auto search = open.find(key);
+					if (search == open.end()
+					    || batches[search->second].vertices.size() + prim.vertex_count > max_baked_vertices) {
+						batches.push_back(BakedBatch {
+							.vertices = {},
+							.indices = {},
+							.material = material,
+							.texture = texture,
+							.bounds = Bounds { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) },
+						});
+						search = open.insert_or_assign(key, batches.size() - 1).first;
+					}
+
+					auto& batch = batches[search->second];
+					auto first_vertex = static_cast<std::uint32_t>(batch.vertices.size());
+					for (auto v = prim.base_vertex; v < prim.base_vertex + prim.vertex_count; ++v) {
+						auto vertex = gltf.vertices[v];
+						vertex.pos = glm::vec3(model * glm::vec4(vertex.pos, 1.0f));
+						vertex.normal = glm::normalize(normal_matrix * vertex.normal);
+						batch.bounds.min = glm::min(batch.bounds.min, vertex.pos);
+						batch.bounds.max = glm::max(batch.bounds.max, vertex.pos);
+						batch.vertices.push_back(vertex);
+					}
+					for (auto idx = prim.first_index; idx < prim.first_index + prim.index_count; ++idx) {
+						batch.indices.push_back(first_vertex + gltf.indices[idx]);
+					}
+				}
+			}
+		}
+	}
+	return batches;
+}
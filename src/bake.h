@@ -0,0 +1,45 @@
+#pragma once
+
+#include "gltf.h"
+#include "scene.h"
+
+#include <glad/gl.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Vertices of a baked batch, past which a new batch is started so batches
+// can still be culled.
+constexpr std::size_t max_baked_vertices = 65536;
+
+// Geometry of many primitives sharing a material and a texture, already in
+// world space so it is drawn with an identity transform.
+struct BakedBatch {
+	std::vector<Vertex> vertices;
+	std::vector<std::uint32_t> indices;	// relative to the first vertex
+	std::uint32_t material;			// index into the material table
+	GLuint texture;
+	Bounds bounds;				// in world space
+};
+
+// A node to bake, with where the materials of its glTF start in the
+// material table.
+struct BakeSource {
+	const Node* node;
+	std::size_t first_material;
+};
+
+/// Pre-transforms every primitive of the nodes into world space and merges
+/// those with the same material and texture into batches.
+///
+/// Every node transform, meshnode transform and instance of
+/// EXT_mesh_gpu_instancing is applied to a copy of the vertices, so each
+/// placement of a primitive costs its vertices again. In exchange a batch
+/// replaces all of their commands with a single one. Batches are filled in
+/// the order of the nodes and closed at `max_baked_vertices`, so nodes close
+/// in the scene should be close in the list for the batches to stay compact.
+///
+/// Only the first level of detail is baked, and the vertices and indices of
+/// every glTF must be on the CPU.
+std::vector<BakedBatch> bake_static(const std::vector<BakeSource>& sources);
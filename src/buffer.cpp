@@ -1,39 +1,234 @@
 #include "buffer.h"
 
+#include <glm/gtc/packing.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
 #include <iterator>
 
+MeshBuffer::MeshBuffer(GLuint vbo, GLuint ebo, GLuint mbo, PositionFormat position_format)
+	: vertices(Buffer<Vertex>(vbo, "mesh.vertices")),
+	  indices(Buffer<uint32_t>(ebo, "mesh.indices")),
+	  materials(Buffer<Material>(mbo, "mesh.materials")),
+	  format(position_format)
+{
+	// In the order of `vertex_format` and `compact_format`
+	const VertexFormat formats[] = {
+		VertexFormat {
+			.stride = sizeof(Vertex) / sizeof(float),
+			.position = offsetof(Vertex, pos) / sizeof(float),
+			.normal = offsetof(Vertex, normal) / sizeof(float),
+			.texcoord = offsetof(Vertex, uv) / sizeof(float),
+		},
+		VertexFormat {
+			.stride = sizeof(CompactVertex) / sizeof(float),
+			.position = offsetof(CompactVertex, pos) / sizeof(float),
+			.normal = offsetof(CompactVertex, normal) / sizeof(float),
+			.texcoord = VertexFormat::none,
+		},
+	};
+	glCreateBuffers(1, &format_buffer);
+	glNamedBufferStorage(format_buffer, sizeof(formats), formats, 0);
+	create_position_stream();
+}
+
+void MeshBuffer::create_position_stream()
+{
+	GLuint pbo;
+	if (format == PositionFormat::FLOAT) {
+		glCreateBuffers(1, &pbo);
+		positions = Buffer<glm::vec3>(pbo, "mesh.positions");
+	} else if (format == PositionFormat::HALF) {
+		glCreateBuffers(1, &pbo);
+		half_positions = Buffer<HalfPosition>(pbo, "mesh.positions");
+	}
+}
+
+bool MeshBuffer::set_position_format(PositionFormat position_format)
+{
+	if (position_format == format) {
+		return true;
+	}
+	if (vertices.stats().allocations > 0) {
+		return false;
+	}
+	positions.delete_buffer();
+	half_positions.delete_buffer();
+	positions = Buffer<glm::vec3>();
+	half_positions = Buffer<HalfPosition>();
+	format = position_format;
+	create_position_stream();
+	return true;
+}
+
 void MeshBuffer::bind_buffer(GLuint vao)
 {
 	glVertexArrayVertexBuffer(vao, 0, vertices.id(), 0, sizeof(Vertex));
 	glVertexArrayElementBuffer(vao, indices.id());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, materials.id());
+}
+
+void MeshBuffer::bind_position_buffer(GLuint vao)
+{
+	if (format == PositionFormat::FLOAT) {
+		glVertexArrayVertexBuffer(vao, 0, positions.id(), 0, sizeof(glm::vec3));
+	} else if (format == PositionFormat::HALF) {
+		glVertexArrayVertexBuffer(vao, 0, half_positions.id(), 0, sizeof(HalfPosition));
+	}
+	glVertexArrayElementBuffer(vao, indices.id());
+}
+
+void MeshBuffer::bind_pulling_buffers(GLuint vao)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, vertices.id());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, format_buffer);
+	glVertexArrayElementBuffer(vao, indices.id());
 }
 
 void MeshBuffer::delete_buffer()
 {
 	vertices.delete_buffer();
 	indices.delete_buffer();
+	materials.delete_buffer();
+	glDeleteBuffers(1, &format_buffer);
+	positions.delete_buffer();
+	half_positions.delete_buffer();
+}
+
+// Allocates the position stream of a mesh at the same place as its
+// vertices. Both see the same allocations, so they hand out the same ranges.
+template <typename T>
+static Header allocate_positions(Buffer<T>& positions, Header vheader)
+{
+	auto header = positions.allocate(vheader.size);
+	if (!(header == vheader)) {
+		std::cerr << "Position stream out of step with the vertices\n";
+	}
+	return header;
+}
+
+template <typename T>
+static void add_positions(Buffer<T>& positions, Header vheader, const std::vector<T>& data)
+{
+	positions.update(allocate_positions(positions, vheader), data);
+}
+
+static bool has_texcoords(const LoadedGLTF& gltf)
+{
+	return std::any_of(gltf.vertices.begin(), gltf.vertices.end(), [](const Vertex& vertex) {
+		return vertex.uv.x != 0.0f || vertex.uv.y != 0.0f;
+	});
+}
+
+Header MeshBuffer::add_vertices(const std::vector<Vertex>& data)
+{
+	Header vheader = vertices.allocate(data.size());
+	vertices.update(vheader, data);
+
+	if (format == PositionFormat::FLOAT) {
+		std::vector<glm::vec3> stream;
+		stream.reserve(data.size());
+		for (const auto& vertex : data) {
+			stream.push_back(vertex.pos);
+		}
+		add_positions(positions, vheader, stream);
+	} else if (format == PositionFormat::HALF) {
+		std::vector<HalfPosition> stream;
+		stream.reserve(data.size());
+		for (const auto& vertex : data) {
+			stream.push_back(HalfPosition{ glm::packHalf1x16(vertex.pos.x), glm::packHalf1x16(vertex.pos.y),
+						       glm::packHalf1x16(vertex.pos.z), 0 });
+		}
+		add_positions(half_positions, vheader, stream);
+	}
+	return vheader;
+}
+
+// A mesh of n compact vertices takes n * stride floats, plus up to
+// stride - 1 more to start at a multiple of the stride, rounded up to whole
+// `Vertex` slots.
+std::uint32_t MeshBuffer::add_compact_vertices(const std::vector<Vertex>& data, Header& vheader)
+{
+	constexpr std::size_t slot = sizeof(Vertex) / sizeof(float);
+	constexpr std::size_t stride = sizeof(CompactVertex) / sizeof(float);
+	auto floats = data.size() * stride + stride - 1;
+	vheader = vertices.allocate((floats + slot - 1) / slot);
+	if (format == PositionFormat::FLOAT) {
+		allocate_positions(positions, vheader);
+	} else if (format == PositionFormat::HALF) {
+		allocate_positions(half_positions, vheader);
+	}
+
+	auto base_vertex = (vheader.start * slot + stride - 1) / stride;
+	std::vector<CompactVertex> compact;
+	compact.reserve(data.size());
+	for (const auto& vertex : data) {
+		compact.push_back(CompactVertex{ vertex.pos, vertex.normal });
+	}
+	vertices.write(base_vertex * sizeof(CompactVertex), compact.size() * sizeof(CompactVertex), compact.data());
+	return static_cast<std::uint32_t>(base_vertex);
 }
 
 void MeshBuffer::add_mesh(LoadedGLTF& gltf)
 {
 	if (loaded_meshes.find(gltf.path) == loaded_meshes.end()) {
-		Header vheader = vertices.allocate(gltf.vertices.size());
-		vertices.update(vheader, gltf.vertices);
+		MeshAllocation allocation;
+		if (compact_layouts && !has_texcoords(gltf)) {
+			allocation.base_vertex = add_compact_vertices(gltf.vertices, allocation.vertex_header);
+			allocation.vertex_format = compact_format;
+			++compact_meshes;
+		} else {
+			allocation.vertex_header = add_vertices(gltf.vertices);
+			allocation.base_vertex = static_cast<std::uint32_t>(allocation.vertex_header.start);
+		}
+
+		allocation.index_header = indices.allocate(gltf.indices.size());
+		indices.update(allocation.index_header, gltf.indices);
 
-		Header iheader = indices.allocate(gltf.indices.size());
-		indices.update(iheader, gltf.indices);
+		allocation.material_header = materials.allocate(gltf.materials.size());
+		materials.update(allocation.material_header, gltf.materials);
 
-		loaded_meshes[gltf.path] = MeshAllocation(vheader, iheader);
+		loaded_meshes[gltf.path] = allocation;
 	}
 }
 
+MeshAllocation MeshBuffer::add_geometry(const std::string& name, const std::vector<Vertex>& new_vertices,
+					const std::vector<std::uint32_t>& new_indices)
+{
+	remove_geometry(name);
+	Header vheader = add_vertices(new_vertices);
+	Header iheader = indices.allocate(new_indices.size());
+	indices.update(iheader, new_indices);
+	// Never allocated, so never freed either
+	Header mheader = Header { .start = 0, .size = 0 };
+
+	auto allocation = MeshAllocation(vheader, iheader, mheader);
+	loaded_meshes[name] = allocation;
+	return allocation;
+}
+
 void MeshBuffer::remove_mesh(LoadedGLTF& gltf)
 {
-	auto search = loaded_meshes.find(gltf.path);
+	remove_geometry(gltf.path);
+}
+
+void MeshBuffer::remove_geometry(const std::string& name)
+{
+	auto search = loaded_meshes.find(name);
 	if (search != loaded_meshes.end()) {
 		MeshAllocation allocation = search->second;
 		vertices.deallocate(allocation.vertex_header);
+		if (format == PositionFormat::FLOAT) {
+			positions.deallocate(allocation.vertex_header);
+		} else if (format == PositionFormat::HALF) {
+			half_positions.deallocate(allocation.vertex_header);
+		}
 		indices.deallocate(allocation.index_header);
+		materials.deallocate(allocation.material_header);
+		if (allocation.vertex_format == compact_format) {
+			--compact_meshes;
+		}
 		loaded_meshes.erase(search);
 	}
 }
@@ -44,45 +239,251 @@ MeshAllocation MeshBuffer::get_header(LoadedGLTF& gltf)
 	return loaded_meshes[gltf.path];
 }
 
+void MeshBuffer::set_compact_layouts(bool enabled)
+{
+	compact_layouts = enabled;
+}
+
+bool MeshBuffer::has_compact_meshes() const
+{
+	return compact_meshes > 0;
+}
+
+void MeshBuffer::collect_stats(stats::Report& report) const
+{
+	report.buffers["mesh.vertices"] = vertices.stats();
+	report.buffers["mesh.indices"] = indices.stats();
+	report.buffers["mesh.materials"] = materials.stats();
+	if (format == PositionFormat::FLOAT) {
+		report.buffers["mesh.positions"] = positions.stats();
+	} else if (format == PositionFormat::HALF) {
+		report.buffers["mesh.positions"] = half_positions.stats();
+	}
+}
+
 void CommandBuffer::bind_buffer()
 {
-	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect.id());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, draw_data.id(), static_cast<GLintptr>(draw_data.offset()),
+			  static_cast<GLsizeiptr>(draw_data.region_size()));
 }
 
 void CommandBuffer::delete_buffer()
 {
-	glDeleteBuffers(1, &buffer);
+	indirect.delete_buffer();
+	draw_data.delete_buffer();
+}
+
+void CommandBuffer::add_commands(std::uint32_t owner, const std::vector<Draw>& new_draws)
+{
+	auto header = Header { .start = commands.size(), .size = new_draws.size() };
+	for (const auto& draw : new_draws) {
+		auto command = draw.command;
+		command.base_instance = static_cast<std::uint32_t>(commands.size());
+		commands.push_back(command);
+		draws.push_back(draw.data);
+		textures.push_back(draw.texture);
+		bounds.push_back(draw.bounds);
+		lods.push_back(draw.lods);
+		meshlets.push_back(draw.meshlets);
+	}
+	ranges[owner] = header;
+	mark_dirty(header);
 }
 
-void CommandBuffer::record_commands(std::vector<DrawCommand> new_commands)
+void CommandBuffer::allocate_commands(const std::vector<std::uint32_t>& owners, const std::vector<std::size_t>& offsets)
 {
-	if (commands.capacity() < commands.size() + new_commands.size()) {
-		needs_resize = true;
+	clear_commands();
+	auto total = offsets.empty() ? 0 : offsets.back();
+	commands.resize(total);
+	draws.resize(total);
+	textures.resize(total);
+	bounds.resize(total);
+	lods.resize(total);
+	meshlets.resize(total);
+	for (std::size_t i = 0; i < owners.size(); ++i) {
+		ranges[owners[i]] = Header { .start = offsets[i], .size = offsets[i + 1] - offsets[i] };
+	}
+	mark_dirty(Header { .start = 0, .size = total });
+}
+
+void CommandBuffer::set_commands(std::size_t start, const std::vector<Draw>& new_draws)
+{
+	for (std::size_t i = 0; i < new_draws.size(); ++i) {
+		const auto& draw = new_draws[i];
+		auto index = start + i;
+		commands[index] = draw.command;
+		commands[index].base_instance = static_cast<std::uint32_t>(index);
+		draws[index] = draw.data;
+		textures[index] = draw.texture;
+		bounds[index] = draw.bounds;
+		lods[index] = draw.lods;
+		meshlets[index] = draw.meshlets;
+	}
+}
+
+void CommandBuffer::remove_commands(std::uint32_t owner)
+{
+	auto search = ranges.find(owner);
+	if (search == ranges.end()) {
+		return;
+	}
+	auto header = search->second;
+	ranges.erase(search);
+
+	// Ranges at the end can just be dropped, anything else is zeroed so
+	// the GPU skips it and the other ranges stay where they are.
+	if (header.start + header.size == commands.size()) {
+		commands.resize(header.start);
+		draws.resize(header.start);
+		textures.resize(header.start);
+		bounds.resize(header.start);
+		lods.resize(header.start);
+		meshlets.resize(header.start);
+	} else {
+		std::fill_n(commands.begin() + header.start, header.size, DrawCommand{});
+		std::fill_n(textures.begin() + header.start, header.size, 0);
+		tombstones += header.size;
+		mark_dirty(header);
+	}
+
+	if (tombstones > commands.size() / 2) {
+		compact();
 	}
-	commands.insert(commands.end(),
-			std::make_move_iterator(new_commands.begin()),
-			std::make_move_iterator(new_commands.end()));
 }
 
-void CommandBuffer::delete_commands(std::size_t start, std::size_t end)
+Header CommandBuffer::get_range(std::uint32_t owner) const
 {
-	commands.erase(commands.begin() + start, commands.begin() + start + end);
+	// TODO: error handling
+	return ranges.at(owner);
 }
 
 void CommandBuffer::clear_commands()
 {
 	commands.clear();
+	draws.clear();
+	textures.clear();
+	bounds.clear();
+	lods.clear();
+	meshlets.clear();
+	ranges.clear();
+	tombstones = 0;
+}
+
+bool CommandBuffer::is_dirty() const
+{
+	auto next = (indirect.current_region() + 1) % regions;
+	return dirty[next].size != 0 || commands.size() > indirect.region_capacity();
 }
 
 void CommandBuffer::upload_commands()
 {
-	if (needs_resize) {
-		GLuint resized;
-		glCreateBuffers(1, &resized);
-		glNamedBufferStorage(resized, commands.capacity()*sizeof(DrawCommand), nullptr, GL_DYNAMIC_STORAGE_BIT);
-		glDeleteBuffers(1, &buffer);
-		buffer = resized;
-		needs_resize = false;
+	auto capacity = indirect.region_capacity();
+	indirect.next(commands.size());
+	draw_data.next(commands.size());
+	// Every region of a new buffer is empty
+	if (indirect.region_capacity() != capacity) {
+		for (auto& header : dirty) {
+			header = Header { .start = 0, .size = commands.size() };
+		}
 	}
-	glNamedBufferSubData(buffer, 0, commands.size() * sizeof(DrawCommand), commands.data());
+
+	auto& header = dirty[indirect.current_region()];
+	auto start = std::min(header.start, commands.size());
+	auto end = std::min(header.start + header.size, commands.size());
+	std::copy(commands.begin() + start, commands.begin() + end, indirect.current() + start);
+	std::copy(draws.begin() + start, draws.begin() + end, draw_data.current() + start);
+	stats::record_upload((end - start) * (sizeof(DrawCommand) + sizeof(DrawData)));
+	header = Header {};
+}
+
+const std::vector<DrawCommand>& CommandBuffer::get_commands() const
+{
+	return commands;
+}
+
+const std::vector<DrawData>& CommandBuffer::get_draws() const
+{
+	return draws;
+}
+
+const std::vector<GLuint>& CommandBuffer::get_textures() const
+{
+	return textures;
+}
+
+const std::vector<Bounds>& CommandBuffer::get_bounds() const
+{
+	return bounds;
+}
+
+const std::vector<LodChain>& CommandBuffer::get_lods() const
+{
+	return lods;
+}
+
+const std::vector<MeshletRange>& CommandBuffer::get_meshlets() const
+{
+	return meshlets;
+}
+
+void CommandBuffer::fence()
+{
+	indirect.fence();
+	draw_data.fence();
+}
+
+std::size_t CommandBuffer::offset() const
+{
+	return indirect.offset();
+}
+
+void CommandBuffer::mark_dirty(Header header)
+{
+	for (auto& region_header : dirty) {
+		if (region_header.size == 0) {
+			region_header = header;
+		} else {
+			auto start = std::min(region_header.start, header.start);
+			auto end = std::max(region_header.start + region_header.size, header.start + header.size);
+			region_header = Header { .start = start, .size = end - start };
+		}
+	}
+}
+
+void CommandBuffer::compact()
+{
+	std::vector<std::pair<std::uint32_t, Header>> sorted(ranges.begin(), ranges.end());
+	std::sort(sorted.begin(), sorted.end(), [](auto& a, auto& b) { return a.second.start < b.second.start; });
+
+	// Ranges only ever move towards the front, so copying in order never
+	// overwrites a range before it is moved.
+	size_t end = 0;
+	for (auto& [owner, header] : sorted) {
+		std::copy_n(commands.begin() + header.start, header.size, commands.begin() + end);
+		std::copy_n(draws.begin() + header.start, header.size, draws.begin() + end);
+		std::copy_n(textures.begin() + header.start, header.size, textures.begin() + end);
+		std::copy_n(bounds.begin() + header.start, header.size, bounds.begin() + end);
+		std::copy_n(lods.begin() + header.start, header.size, lods.begin() + end);
+		std::copy_n(meshlets.begin() + header.start, header.size, meshlets.begin() + end);
+		ranges[owner].start = end;
+		end += header.size;
+	}
+	commands.resize(end);
+	draws.resize(end);
+	textures.resize(end);
+	bounds.resize(end);
+	lods.resize(end);
+	meshlets.resize(end);
+	for (size_t i = 0; i < end; ++i) {
+		commands[i].base_instance = static_cast<std::uint32_t>(i);
+	}
+	tombstones = 0;
+	mark_dirty(Header { .start = 0, .size = end });
+}
+
+void CommandBuffer::collect_stats(stats::Report& report) const
+{
+	report.buffers["commands"] = indirect.stats();
+	report.buffers["draws"] = draw_data.stats();
 }
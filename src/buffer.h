@@ -1,10 +1,12 @@
 #pragma once
 
 #include "gltf.h"
+#include "stats.h"
 
 #include <glad/gl.h>
 
 #include <algorithm>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
@@ -36,7 +38,7 @@ template <typename T>
 class Buffer {
 public:
 	Buffer() {}
-	Buffer(GLuint id) : buffer(id) {
+	Buffer(GLuint id, std::string name) : buffer(id), name(std::move(name)) {
 		element_size = sizeof(T);
 		glNamedBufferStorage(id, capacity*element_size, nullptr, GL_DYNAMIC_STORAGE_BIT);
 	}
@@ -46,7 +48,7 @@ public:
 
 	Header allocate(size_t data_size) {
 		// Try using a free sector
-		auto it = std::remove_if(free_list.begin(), free_list.end(), [data_size](Header h) { return h.size < data_size; });
+		auto it = std::find_if(free_list.begin(), free_list.end(), [data_size](Header h) { return h.size >= data_size; });
 		if (it != free_list.end()) {
 			auto header = *it;
 			auto start = header.start;
@@ -56,6 +58,8 @@ public:
 			auto free_header = Header { .start = mid, .size = header.size - data_size };
 
 			used_list.push_back(used_header);
+			++allocations;
+			stats::record_event(stats::EventType::ALLOCATE, name, data_size * element_size);
 			// Keeps the free lsit ordered
 			if (free_header.size != 0) {
 				auto index = std::distance(free_list.begin(), it);
@@ -80,11 +84,15 @@ public:
 			glCopyNamedBufferSubData(buffer, resized, 0, 0, size * element_size);
 			glDeleteBuffers(1, &buffer);
 			buffer = resized;
+			++resizes;
+			stats::record_event(stats::EventType::RESIZE, name, capacity * element_size);
 		}
 
 		auto used_header = Header { .start = size, .size = data_size };
 		size += data_size;
 		used_list.push_back(used_header);
+		++allocations;
+		stats::record_event(stats::EventType::ALLOCATE, name, data_size * element_size);
 
 		return used_header;
 	};
@@ -92,73 +100,359 @@ public:
 	void deallocate(Header header) {
 		auto used_header = std::find(used_list.begin(), used_list.end(), header);
 		// TODO: This should probably error or panic otherwise.
-		if (used_header != used_list.end()) {
-			auto found = std::find_if(free_list.begin(), free_list.end(), [header](auto& h) { return header.start < h.start; });
-			// No need to handle not found, since we just add it at the end anyways
-			auto index = std::distance(free_list.begin(), found);
+		if (used_header == used_list.end()) {
+			return;
+		}
+		used_list.erase(used_header);
+		++deallocations;
+		stats::record_event(stats::EventType::DEALLOCATE, name, header.size * element_size);
 
-			// See if we can merge some sectors
-			auto start = header.start;
-			auto size = header.size;
-			if (index > 0) {
-				auto prev = free_list[index - 1];
-				if (prev.start + prev.size == header.start) {
-					start = prev.start;
-					free_list.erase(free_list.begin() + index - 1);
-					--index;
-				}
+		auto found = std::find_if(free_list.begin(), free_list.end(), [header](auto& h) { return header.start < h.start; });
+		// No need to handle not found, since we just add it at the end anyways
+		auto index = static_cast<size_t>(std::distance(free_list.begin(), found));
+
+		// See if we can merge some sectors
+		auto start = header.start;
+		auto end = header.start + header.size;
+		if (index > 0) {
+			auto prev = free_list[index - 1];
+			if (prev.start + prev.size == start) {
+				start = prev.start;
+				free_list.erase(free_list.begin() + index - 1);
+				--index;
 			}
-			// TODO: handle this better by decrementing size instead
-			if (index < size)  {
-				auto next = free_list[index];
-				if (next.start == header.start + header.size) {
-					size = header.size + next.size;
-					free_list.erase(free_list.begin() + index);
-				}
+		}
+		if (index < free_list.size()) {
+			auto next = free_list[index];
+			if (next.start == end) {
+				end = next.start + next.size;
+				free_list.erase(free_list.begin() + index);
 			}
-			free_list.insert(free_list.begin() + index, Header { .start = start, .size = size });
 		}
-		used_list.erase(used_header);
+
+		// Sectors at the end are given back to the unused tail
+		if (end == size) {
+			size = start;
+		} else {
+			free_list.insert(free_list.begin() + index, Header { .start = start, .size = end - start });
+		}
 	}
 
-	void update(Header header, std::vector<T> data) {
+	void update(Header header, const std::vector<T>& data) {
 		glNamedBufferSubData(buffer, header.start * element_size, header.size * element_size, data.data());
+		stats::record_upload(header.size * element_size);
+	}
+
+	// Uploads `bytes` at `offset` in bytes, for data in another layout than
+	// `T` within an allocation.
+	void write(std::size_t offset, std::size_t bytes, const void* data) {
+		glNamedBufferSubData(buffer, static_cast<GLintptr>(offset), static_cast<GLsizeiptr>(bytes), data);
+		stats::record_upload(bytes);
+	}
+
+	/// Reports occupancy in bytes. Space past the last allocation counts as
+	/// a free block since it can be handed out without resizing.
+	stats::BufferStats stats() const {
+		size_t used = 0;
+		for (const auto& header : used_list) {
+			used += header.size;
+		}
+		size_t largest_free = capacity - size;
+		for (const auto& header : free_list) {
+			largest_free = std::max(largest_free, header.size);
+		}
+		return stats::BufferStats {
+			.capacity = capacity * element_size,
+			.used = used * element_size,
+			.free = (capacity - used) * element_size,
+			.largest_free = largest_free * element_size,
+			.allocations = allocations,
+			.deallocations = deallocations,
+			.resizes = resizes,
+		};
 	}
 private:
-	GLuint buffer;
+	GLuint buffer {0};
+	std::string name;
 	size_t element_size;
 	size_t size {0};
 	size_t capacity {256};
 
+	size_t allocations {0};
+	size_t deallocations {0};
+	size_t resizes {0};
+
 	std::vector<Header> used_list;
 	std::vector<Header> free_list;
 };
 
-/// A MeshAllocation stores where the indices and vertices of a mesh is located
-/// in the buffer.
+/// A persistently mapped buffer for data which is rewritten every frame, such
+/// as the sorted or culled commands. The buffer is split into `regions` and
+/// every call to `map` moves on to the next one, so the CPU writes one region
+/// while the GPU may still read the previous ones. A fence must be placed with
+/// `fence` after the last GL call reading the region, `map` only waits on the
+/// fence of the region it is about to hand out.
+///
+/// When more elements are mapped than fit, the buffer grows. The old buffer is
+/// kept until its fence signals since frames in flight might still read it.
+/// Reads must offset into the buffer by `offset()`.
+template <typename T>
+class StreamBuffer {
+public:
+	static constexpr std::size_t regions = 3;
+
+	StreamBuffer() {}
+	StreamBuffer(std::string name) : name(std::move(name)) {
+		create_storage();
+	}
+
+	GLuint id() const { return buffer; }
+	// Offset in bytes to the current region.
+	std::size_t offset() const { return region * capacity * sizeof(T); }
+	// Size in bytes of a region.
+	std::size_t region_size() const { return capacity * sizeof(T); }
+	// Elements a region holds, which only changes when the buffer grows.
+	std::size_t region_capacity() const { return capacity; }
+	std::size_t current_region() const { return region; }
+	// The current region, for data which is only partly rewritten since
+	// each region keeps what was last written to it until the buffer grows.
+	T* current() { return mapped + region * capacity; }
+
+	T* map(std::size_t count) {
+		next(count);
+		stats::record_upload(count * sizeof(T));
+		return mapped + region * capacity;
+	}
+
+	// Moves on to the next region like `map`, for regions which are
+	// written by the GPU instead.
+	void next(std::size_t count) {
+		if (count > capacity) {
+			retired.emplace_back(buffer, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+			for (auto& sync : fences) {
+				if (sync) {
+					glDeleteSync(sync);
+					sync = nullptr;
+				}
+			}
+			while (capacity < count) {
+				capacity *= 2;
+			}
+			create_storage();
+			region = regions - 1;
+			++resizes;
+			stats::record_event(stats::EventType::RESIZE, name, regions * capacity * sizeof(T));
+		}
+
+		region = (region + 1) % regions;
+		wait(fences[region]);
+		release_retired();
+		used = count;
+	}
+
+	void fence() {
+		if (fences[region]) {
+			glDeleteSync(fences[region]);
+		}
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+
+	void delete_buffer() {
+		for (auto& sync : fences) {
+			wait(sync);
+		}
+		for (auto& [id, sync] : retired) {
+			wait(sync);
+			glDeleteBuffers(1, &id);
+		}
+		retired.clear();
+		glUnmapNamedBuffer(buffer);
+		glDeleteBuffers(1, &buffer);
+	}
+
+	stats::BufferStats stats() const {
+		auto bytes = regions * capacity * sizeof(T);
+		auto used_bytes = used * sizeof(T);
+		return stats::BufferStats {
+			.capacity = bytes,
+			.used = used_bytes,
+			.free = bytes - used_bytes,
+			.largest_free = (capacity - used) * sizeof(T),
+			.allocations = 0,
+			.deallocations = 0,
+			.resizes = resizes,
+		};
+	}
+private:
+	void create_storage() {
+		constexpr GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		auto bytes = static_cast<GLsizeiptr>(regions * capacity * sizeof(T));
+		glCreateBuffers(1, &buffer);
+		glNamedBufferStorage(buffer, bytes, nullptr, flags);
+		mapped = static_cast<T*>(glMapNamedBufferRange(buffer, 0, bytes, flags));
+	}
+
+	static void wait(GLsync& sync) {
+		if (!sync) {
+			return;
+		}
+		GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+		while (glClientWaitSync(sync, flags, 1000000) == GL_TIMEOUT_EXPIRED) {
+			flags = 0;
+		}
+		glDeleteSync(sync);
+		sync = nullptr;
+	}
+
+	void release_retired() {
+		auto it = std::remove_if(retired.begin(), retired.end(), [](auto& pair) {
+			auto status = glClientWaitSync(pair.second, 0, 0);
+			if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+				glDeleteSync(pair.second);
+				glDeleteBuffers(1, &pair.first);
+				return true;
+			}
+			return false;
+		});
+		retired.erase(it, retired.end());
+	}
+
+	GLuint buffer {0};
+	std::string name;
+	T* mapped {nullptr};
+	size_t capacity {256};		// in elements, per region
+	size_t region {0};
+	size_t used {0};
+	size_t resizes {0};
+	GLsync fences[regions] {};
+	std::vector<std::pair<GLuint, GLsync>> retired;
+};
+
+/// A MeshAllocation stores where the indices, vertices and materials of a mesh
+/// is located in the buffer. The vertex header is in `Vertex` slots, while
+/// `base_vertex` counts vertices of the layout of the mesh.
 struct MeshAllocation {
 	MeshAllocation() {}
-	MeshAllocation(Header vheader, Header iheader) : vertex_header(vheader), index_header(iheader) {}
-	Header vertex_header, index_header;
+	MeshAllocation(Header vheader, Header iheader, Header mheader) : vertex_header(vheader), index_header(iheader), material_header(mheader),
+		base_vertex(static_cast<std::uint32_t>(vheader.start)) {}
+	Header vertex_header, index_header, material_header;
+	std::uint32_t base_vertex {0};
+	std::uint32_t vertex_format {0};	// index into the vertex format table
+};
+
+// How the position-only stream of a MeshBuffer is stored.
+enum class PositionFormat {
+	NONE,		// no position stream
+	FLOAT,		// exact copies of the positions, 12 bytes each
+	HALF,		// half floats padded to 8 bytes, not exact
+};
+
+// Where the attributes of a vertex layout are, in floats from the start of
+// a vertex, for the vertex pulling shader. Laid out for std430.
+struct VertexFormat {
+	// For attributes the layout does not have, which read as zero
+	static constexpr std::uint32_t none = static_cast<std::uint32_t>(-1);
+
+	std::uint32_t stride;
+	std::uint32_t position;
+	std::uint32_t normal;
+	std::uint32_t texcoord;
+};
+
+// The layout of meshes without texture coordinates, a quarter smaller than
+// `Vertex`. Only the vertex pulling shaders read it.
+struct CompactVertex {
+	glm::vec3 pos;
+	glm::vec3 normal;
+};
+
+// A position as half floats, the padding keeps each one 4 byte aligned.
+struct HalfPosition {
+	std::uint16_t x, y, z;
+	std::uint16_t padding;
 };
 
 /// Handles allocated meshes. Internally this is made up of vertices and
-/// indicies of the mesh. For every mesh, a MeshAllocation is mapped which
-/// stores where the data is located.
+/// indicies of the mesh, and a global table of materials which shaders index
+/// into through the draw data. For every mesh, a MeshAllocation is mapped
+/// which stores where the data is located. Materials are uploaded once with
+/// the mesh, so a material index is `material_header.start + material_idx`.
+///
+/// Passes which only write depth, such as the depth prepass, do not need the
+/// texture coordinates interleaved with the positions of `Vertex` but would
+/// still fetch them. The buffer can keep a second copy of the positions,
+/// tightly packed, for those passes to read through their own vertex array.
+/// It is allocated in lockstep with the vertices, so the base vertex of a
+/// command is valid in both. Half floats save another third of the fetch, but
+/// the depth they give is not the one of the shading pass, so they are only
+/// for passes which do not have to match it, like shadows.
+///
+/// The vertices can also be read as an SSBO of floats by a vertex shader
+/// which pulls its attributes itself, using a table of VertexFormats picked
+/// per draw. Draws with different layouts can then go into the same
+/// multi-draw without switching vertex arrays. With `set_compact_layouts`,
+/// meshes without texture coordinates are stored as CompactVertex. They are
+/// allocated in whole `Vertex` slots like any other mesh, but the shaders
+/// multiply gl_VertexID by the stride of the layout, so their first vertex
+/// is moved up to a multiple of that stride, which is their `base_vertex`.
+/// The position stream keeps the same allocations in lockstep but has no
+/// data for them, so they can only be drawn by passes which pull too.
 class MeshBuffer {
 public:
+	// Index of the layout of `Vertex` in the format table.
+	static constexpr std::uint32_t vertex_format = 0;
+	// Index of the layout of `CompactVertex`.
+	static constexpr std::uint32_t compact_format = 1;
+
 	MeshBuffer() {}
-	MeshBuffer(GLuint vbo, GLuint ebo) : vertices(Buffer<Vertex>(vbo)), indices(Buffer<uint32_t>(ebo)) {}
+	MeshBuffer(GLuint vbo, GLuint ebo, GLuint mbo, PositionFormat position_format = PositionFormat::NONE);
 	void bind_buffer(GLuint vao);
+	// Binds the position stream and the indices to a vertex array for
+	// depth-only passes, attribute 0 must read binding 0 in the format of
+	// `position_format()`.
+	void bind_position_buffer(GLuint vao);
+	// Binds the vertices and the format table as SSBOs for vertex pulling,
+	// and the indices to `vao`.
+	void bind_pulling_buffers(GLuint vao);
+	PositionFormat position_format() const { return format; }
+	// Replaces the position stream, which only works before any vertex
+	// was allocated since it must allocate in lockstep with them. Returns
+	// whether the stream is now in `position_format`.
+	bool set_position_format(PositionFormat position_format);
 	void delete_buffer();
 	void add_mesh(LoadedGLTF& gltf);
 	void remove_mesh(LoadedGLTF& gltf);
+	// Geometry which does not come from a glTF, such as baked batches, and
+	// uses the materials of other meshes. Replaces any geometry of the
+	// same name.
+	MeshAllocation add_geometry(const std::string& name, const std::vector<Vertex>& new_vertices,
+				    const std::vector<std::uint32_t>& new_indices);
+	void remove_geometry(const std::string& name);
 	MeshAllocation get_header(LoadedGLTF& gltf);
+	// Stores the meshes without texture coordinates added from now on as
+	// CompactVertex, which only vertex pulling can draw.
+	void set_compact_layouts(bool enabled);
+	bool has_compact_meshes() const;
+	void collect_stats(stats::Report& report) const;
 private:
+	void create_position_stream();
+	// Uploads the vertices, and their positions to the position stream.
+	Header add_vertices(const std::vector<Vertex>& data);
+	// Uploads the vertices as CompactVertex, and returns their base vertex.
+	std::uint32_t add_compact_vertices(const std::vector<Vertex>& data, Header& vheader);
+
 	Buffer<Vertex> vertices;
 	Buffer<uint32_t> indices;
+	Buffer<Material> materials;
+	GLuint format_buffer {0};
+	// Only the one matching the format is created
+	PositionFormat format {PositionFormat::NONE};
+	Buffer<glm::vec3> positions;
+	Buffer<HalfPosition> half_positions;
 
 	std::unordered_map<std::string, MeshAllocation> loaded_meshes;
+	bool compact_layouts {false};
+	std::size_t compact_meshes {0};
 };
 
 // A OpenGL struct which species a draw command for MultiDrawElements.
@@ -170,35 +464,116 @@ struct DrawCommand {
 	std::uint32_t base_instance;	// offset for when drawing multiple instances
 };
 
-/// Stores DrawCommands to be uploaded to the GPU. This does not internally use
-/// a Buffer because this must map up with nodes in Scene. In other words,
-/// 	node 1, prim 1 will have command at 1
-/// 	node 1, prim 2 will have command at 2
-/// 	node 1, prim 3 will have command at 3
-/// 	node 2, prim 1 will have command at 4
-/// 	node 2, prim 2 will have command at 5
-/// And so on. This keeps the rendering simple and negate the need for a
-/// mapping of primitive to command, which would add more coupling between the
-/// data and rendering code. In most cases, command buffers are regenerated
-/// each frame rather than reused. Before drawing, upload_commands() must be
-/// called.
+// Per draw data read by the shaders from an SSBO, laid out for std430.
+struct DrawData {
+	glm::mat4 model;
+	std::uint32_t material;		// index into the material table
+	std::uint32_t vertex_format;	// index into the vertex format table
+	std::uint32_t padding[2];
+	// Inverse transpose of the model matrix, which keeps normals perpendicular
+	// to the surface under non-uniform scales. Stored as three vec4 columns,
+	// the std430 layout of a mat3.
+	glm::mat3x4 normal_matrix;
+};
+
+// Everything needed for a single draw. CommandBuffer splits it up into the
+// command, which goes into the indirect buffer, the data, which goes into the
+// draw SSBO, and the texture which is bound by the CPU. The bounds are in the
+// space of the mesh and are only used on the CPU for culling, and the levels
+// of detail to pick which indices to draw. Their first index is already
+// offset like the one of the command.
+struct Draw {
+	DrawCommand command;
+	DrawData data;
+	GLuint texture;
+	Bounds bounds;
+	LodChain lods;
+	MeshletRange meshlets;
+};
+
+/// Stores DrawCommands to be uploaded to the GPU. Commands are grouped into
+/// a contiguous range per node in Scene, and within that range ordered by
+/// meshnode then primitive. In other words, if node 1 was added before node 2,
+/// 	node 1, meshnode 1, prim 1 will have command at 1
+/// 	node 1, meshnode 1, prim 2 will have command at 2
+/// 	node 1, meshnode 2, prim 1 will have command at 3
+/// 	node 2, meshnode 1, prim 1 will have command at 4
+/// 	node 2, meshnode 1, prim 2 will have command at 5
+/// And so on. The range of a node is found with `get_range`.
+///
+/// Each command has a DrawData at the same index in the draw SSBO, and the
+/// buffer keeps the `base_instance` of the command equal to that index. The
+/// commands are not drawn as they are: the RenderList draws instanced copies
+/// of them, with a buffer of the DrawData index of each instance which the
+/// shaders read through the draw id attribute.
+///
+/// Adding a node appends its commands and removing one tombstones its range
+/// by zeroing the commands, so nothing else moves. Once more than half of the
+/// commands are tombstones, the live ranges are compacted. Only the commands
+/// which changed since the last upload are written on `upload_commands()`,
+/// which must be called before drawing. A texture, bounds, levels of detail
+/// and meshlets are kept for each command as well, they are not uploaded but
+/// are needed to compile the RenderList.
+///
+/// The commands and DrawData are uploaded to a StreamBuffer each. Every
+/// upload moves both to their next region, so the GPU can keep reading the
+/// commands of a previous frame while new ones are written, and `fence()`
+/// must be called after the last draw of a frame. Since regions are written
+/// in turn and keep their contents, each one keeps its own dirty range, and
+/// all of them are dirty after the buffers grow. Draws must offset into the
+/// indirect buffer by `offset()`.
 class CommandBuffer {
 public:
+	static constexpr std::size_t regions = StreamBuffer<DrawCommand>::regions;
+
 	CommandBuffer() {}
-	CommandBuffer(GLuint id) : buffer(id) {
-		commands.reserve(256);
-		glNamedBufferStorage(buffer, 256*sizeof(DrawCommand), nullptr, GL_DYNAMIC_STORAGE_BIT);
-	}
+	// `name` is given to the buffer of commands in the stats, the DrawData
+	// is reported as "draws".
+	CommandBuffer(const std::string& name) : indirect(name), draw_data("draws") {}
 
+	// Binds the indirect buffer and the draw SSBO.
 	void bind_buffer();
 	void delete_buffer();
-	// `commands` will be in an intdeterminate state and unusable after this.
-	void record_commands(std::vector<DrawCommand> new_commands);
-	void delete_commands(std::size_t start, std::size_t end);
+	void add_commands(std::uint32_t owner, const std::vector<Draw>& new_draws);
+	// Replaces every command with a range for each owner, from `offsets[i]`
+	// to `offsets[i + 1]`. The commands are then filled in with
+	// `set_commands`, which can be called from several threads as long as
+	// they write different commands.
+	void allocate_commands(const std::vector<std::uint32_t>& owners, const std::vector<std::size_t>& offsets);
+	void set_commands(std::size_t start, const std::vector<Draw>& new_draws);
+	void remove_commands(std::uint32_t owner);
+	Header get_range(std::uint32_t owner) const;
 	void clear_commands();
+	bool is_dirty() const;
 	void upload_commands();
+	const std::vector<DrawCommand>& get_commands() const;
+	const std::vector<DrawData>& get_draws() const;
+	const std::vector<GLuint>& get_textures() const;
+	const std::vector<Bounds>& get_bounds() const;
+	const std::vector<LodChain>& get_lods() const;
+	const std::vector<MeshletRange>& get_meshlets() const;
+	// Call after the last draw which reads the current commands.
+	void fence();
+	// Offset in bytes to the current commands in the bound buffer.
+	std::size_t offset() const;
+	void collect_stats(stats::Report& report) const;
 private:
+	void mark_dirty(Header header);
+	void compact();
+
+	// These are parallel arrays, indexed by command
 	std::vector<DrawCommand> commands;
-	size_t needs_resize = false;
-	GLuint buffer;
+	std::vector<DrawData> draws;
+	std::vector<GLuint> textures;
+	std::vector<Bounds> bounds;
+	std::vector<LodChain> lods;
+	std::vector<MeshletRange> meshlets;
+
+	std::unordered_map<std::uint32_t, Header> ranges;
+	size_t tombstones {0};
+	// Dirty commands of each region, an empty header means it is clean.
+	Header dirty[regions] {};
+
+	StreamBuffer<DrawCommand> indirect;
+	StreamBuffer<DrawData> draw_data;
 };
@@ -0,0 +1,407 @@
+#include "bvh.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cfloat>
+
+static constexpr std::size_t bins = 16;
+
+static Bounds empty_bounds()
+{
+	return Bounds { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+}
+
+static Bounds merge(const Bounds& a, const Bounds& b)
+{
+	return Bounds { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+}
+
+// Half the surface area, which is all the heuristic needs.
+static float area(const Bounds& bounds)
+{
+	auto size = glm::max(bounds.max - bounds.min, glm::vec3(0.0f));
+	return size.x * size.y + size.y * size.z + size.z * size.x;
+}
+
+static bool overlaps(const Bounds& a, const Bounds& b)
+{
+	return a.min.x <= b.max.x && a.max.x >= b.min.x
+		&& a.min.y <= b.max.y && a.max.y >= b.min.y
+		&& a.min.z <= b.max.z && a.max.z >= b.min.z;
+}
+
+// Distance along the ray to where it enters the bounds, or a negative value
+// if it misses them.
+static float intersect(const Bounds& bounds, const glm::vec3& origin, const glm::vec3& inverse_direction,
+		       float max_distance)
+{
+	auto t0 = (bounds.min - origin) * inverse_direction;
+	auto t1 = (bounds.max - origin) * inverse_direction;
+	auto lower = glm::min(t0, t1);
+	auto upper = glm::max(t0, t1);
+	auto enter = std::max({ lower.x, lower.y, lower.z, 0.0f });
+	auto exit = std::min({ upper.x, upper.y, upper.z, max_distance });
+	return enter <= exit ? enter : -1.0f;
+}
+
+std::int32_t Bvh::allocate_node()
+{
+	if (!free_nodes.empty()) {
+		auto node = free_nodes.back();
+		free_nodes.pop_back();
+		return node;
+	}
+	nodes.push_back(Node{});
+	return static_cast<std::int32_t>(nodes.size() - 1);
+}
+
+void Bvh::free_node(std::int32_t node)
+{
+	free_nodes.push_back(node);
+}
+
+void Bvh::clear()
+{
+	nodes.clear();
+	free_nodes.clear();
+	leaves.clear();
+	root = null_node;
+}
+
+void Bvh::build(const std::vector<std::pair<std::uint32_t, Bounds>>& items)
+{
+	clear();
+	if (items.empty()) {
+		return;
+	}
+
+	std::vector<BuildItem> build_items;
+	build_items.reserve(items.size());
+	for (const auto& [item, bounds] : items) {
+		build_items.push_back(BuildItem{ item, bounds, (bounds.min + bounds.max) * 0.5f });
+	}
+	nodes.reserve(items.size() * 2 - 1);
+	root = build_range(build_items, 0, build_items.size(), null_node);
+}
+
+std::int32_t Bvh::build_range(std::vector<BuildItem>& items, std::size_t begin, std::size_t end, std::int32_t parent)
+{
+	auto node = allocate_node();
+	nodes[node].parent = parent;
+
+	if (end - begin == 1) {
+		nodes[node].bounds = items[begin].bounds;
+		nodes[node].left = null_node;
+		nodes[node].right = null_node;
+		nodes[node].item = items[begin].item;
+		leaves[items[begin].item] = node;
+		return node;
+	}
+
+	auto bounds = empty_bounds();
+	auto centroids = empty_bounds();
+	for (auto i = begin; i < end; ++i) {
+		bounds = merge(bounds, items[i].bounds);
+		centroids = merge(centroids, Bounds{ items[i].centroid, items[i].centroid });
+	}
+	nodes[node].bounds = bounds;
+
+	auto extent = centroids.max - centroids.min;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+	// Bin the centroids along the axis, then sweep the bins from both sides
+	// to find the split with the lowest cost, the area of each side times
+	// the number of items in it.
+	auto mid = begin + (end - begin) / 2;
+	if (extent[axis] > 0.0f) {
+		std::array<Bounds, bins> bin_bounds;
+		std::array<std::size_t, bins> bin_counts {};
+		bin_bounds.fill(empty_bounds());
+		auto scale = static_cast<float>(bins) / extent[axis];
+		auto bin_of = [&](const BuildItem& item) {
+			auto bin = static_cast<std::size_t>((item.centroid[axis] - centroids.min[axis]) * scale);
+			return std::min(bin, bins - 1);
+		};
+		for (auto i = begin; i < end; ++i) {
+			auto bin = bin_of(items[i]);
+			bin_bounds[bin] = merge(bin_bounds[bin], items[i].bounds);
+			++bin_counts[bin];
+		}
+
+		std::array<float, bins - 1> right_costs;
+		auto right = empty_bounds();
+		std::size_t right_count = 0;
+		for (auto bin = bins - 1; bin > 0; --bin) {
+			right = merge(right, bin_bounds[bin]);
+			right_count += bin_counts[bin];
+			right_costs[bin - 1] = area(right) * static_cast<float>(right_count);
+		}
+
+		auto best_cost = FLT_MAX;
+		std::size_t best_split = 0;
+		auto left = empty_bounds();
+		std::size_t left_count = 0;
+		for (std::size_t bin = 0; bin < bins - 1; ++bin) {
+			left = merge(left, bin_bounds[bin]);
+			left_count += bin_counts[bin];
+			auto cost = area(left) * static_cast<float>(left_count) + right_costs[bin];
+			if (left_count > 0 && left_count < end - begin && cost < best_cost) {
+				best_cost = cost;
+				best_split = bin;
+			}
+		}
+
+		if (best_cost < FLT_MAX) {
+			auto split = std::partition(items.begin() + begin, items.begin() + end, [&](const BuildItem& item) {
+				return bin_of(item) <= best_split;
+			});
+			mid = static_cast<std::size_t>(split - items.begin());
+		}
+	}
+	// Every centroid is in the same place, or in the same bin, so any
+	// split is as good as another.
+	if (mid == begin || mid == end) {
+		mid = begin + (end - begin) / 2;
+	}
+
+	// Children are built first since building can grow the array.
+	auto left = build_range(items, begin, mid, node);
+	auto right = build_range(items, mid, end, node);
+	nodes[node].left = left;
+	nodes[node].right = right;
+	return node;
+}
+
+void Bvh::refit(std::int32_t node)
+{
+	while (node != null_node) {
+		auto& current = nodes[node];
+		current.bounds = merge(nodes[current.left].bounds, nodes[current.right].bounds);
+		node = current.parent;
+	}
+}
+
+void Bvh::insert(std::uint32_t item, const Bounds& bounds)
+{
+	auto leaf = allocate_node();
+	nodes[leaf] = Node{ bounds, null_node, null_node, null_node, item };
+	leaves[item] = leaf;
+	if (root == null_node) {
+		root = leaf;
+		return;
+	}
+
+	// Descend towards the child whose area grows the least, stopping when
+	// pairing with the current node is cheaper than going further down.
+	// Every ancestor grows to hold the leaf either way, which is the
+	// inherited cost.
+	auto sibling = root;
+	while (nodes[sibling].left != null_node) {
+		const auto& current = nodes[sibling];
+		auto combined = area(merge(current.bounds, bounds));
+		auto pair_cost = 2.0f * combined;
+		auto inherited = 2.0f * (combined - area(current.bounds));
+
+		auto child_cost = [&](std::int32_t child) {
+			auto merged = area(merge(nodes[child].bounds, bounds));
+			if (nodes[child].left == null_node) {
+				return merged + inherited;
+			}
+			return merged - area(nodes[child].bounds) + inherited;
+		};
+		auto left_cost = child_cost(current.left);
+		auto right_cost = child_cost(current.right);
+		if (pair_cost < left_cost && pair_cost < right_cost) {
+			break;
+		}
+		sibling = left_cost < right_cost ? current.left : current.right;
+	}
+
+	auto old_parent = nodes[sibling].parent;
+	auto parent = allocate_node();
+	nodes[parent] = Node{ merge(nodes[sibling].bounds, bounds), old_parent, sibling, leaf, 0 };
+	nodes[sibling].parent = parent;
+	nodes[leaf].parent = parent;
+	if (old_parent == null_node) {
+		root = parent;
+	} else {
+		auto& children = nodes[old_parent];
+		(children.left == sibling ? children.left : children.right) = parent;
+		refit(old_parent);
+	}
+}
+
+void Bvh::remove(std::uint32_t item)
+{
+	auto search = leaves.find(item);
+	if (search == leaves.end()) {
+		return;
+	}
+	auto leaf = search->second;
+	leaves.erase(search);
+	free_node(leaf);
+
+	auto parent = nodes[leaf].parent;
+	if (parent == null_node) {
+		root = null_node;
+		return;
+	}
+
+	// The sibling takes the place of the parent
+	auto sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+	auto grandparent = nodes[parent].parent;
+	nodes[sibling].parent = grandparent;
+	free_node(parent);
+	if (grandparent == null_node) {
+		root = sibling;
+	} else {
+		auto& children = nodes[grandparent];
+		(children.left == parent ? children.left : children.right) = sibling;
+		refit(grandparent);
+	}
+}
+
+void Bvh::update(std::uint32_t item, const Bounds& bounds)
+{
+	auto search = leaves.find(item);
+	if (search == leaves.end()) {
+		insert(item, bounds);
+		return;
+	}
+	auto leaf = search->second;
+	nodes[leaf].bounds = bounds;
+	refit(nodes[leaf].parent);
+}
+
+void Bvh::cull(const Frustum& frustum, std::vector<std::uint32_t>& items) const
+{
+	if (root == null_node) {
+		return;
+	}
+
+	// Each entry carries the planes its bounds might still cross, the
+	// children of a node entirely in front of a plane are too.
+	constexpr std::uint8_t all_planes = 0x3f;
+	std::vector<std::pair<std::int32_t, std::uint8_t>> stack;
+	stack.emplace_back(root, all_planes);
+	while (!stack.empty()) {
+		auto [index, planes] = stack.back();
+		stack.pop_back();
+		const auto& node = nodes[index];
+
+		bool outside = false;
+		for (int i = 0; i < 6 && !outside; ++i) {
+			if (!(planes & (1 << i))) {
+				continue;
+			}
+			const auto& plane = frustum.planes[i];
+			glm::vec3 normal(plane);
+			// The corners furthest along and against the normal
+			glm::vec3 positive, negative;
+			for (int k = 0; k < 3; ++k) {
+				positive[k] = normal[k] > 0.0f ? node.bounds.max[k] : node.bounds.min[k];
+				negative[k] = normal[k] > 0.0f ? node.bounds.min[k] : node.bounds.max[k];
+			}
+			if (glm::dot(normal, positive) + plane.w < 0.0f) {
+				outside = true;
+			} else if (glm::dot(normal, negative) + plane.w >= 0.0f) {
+				planes &= static_cast<std::uint8_t>(~(1 << i));
+			}
+		}
+		if (outside) {
+			continue;
+		}
+
+		if (node.left == null_node) {
+			items.push_back(node.item);
+		} else if (planes == 0) {
+			append_items(index, items);
+		} else {
+			stack.emplace_back(node.left, planes);
+			stack.emplace_back(node.right, planes);
+		}
+	}
+}
+
+void Bvh::append_items(std::int32_t node, std::vector<std::uint32_t>& items) const
+{
+	std::vector<std::int32_t> stack { node };
+	while (!stack.empty()) {
+		const auto& current = nodes[stack.back()];
+		stack.pop_back();
+		if (current.left == null_node) {
+			items.push_back(current.item);
+		} else {
+			stack.push_back(current.left);
+			stack.push_back(current.right);
+		}
+	}
+}
+
+void Bvh::query_box(const Bounds& bounds, std::vector<std::uint32_t>& items) const
+{
+	if (root == null_node) {
+		return;
+	}
+
+	std::vector<std::int32_t> stack { root };
+	while (!stack.empty()) {
+		const auto& node = nodes[stack.back()];
+		stack.pop_back();
+		if (!overlaps(node.bounds, bounds)) {
+			continue;
+		}
+		if (node.left == null_node) {
+			items.push_back(node.item);
+		} else {
+			stack.push_back(node.left);
+			stack.push_back(node.right);
+		}
+	}
+}
+
+std::vector<BvhHit> Bvh::query_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const
+{
+	std::vector<BvhHit> hits;
+	if (root == null_node) {
+		return hits;
+	}
+
+	// Division by zero gives infinities, which the slab test handles.
+	auto inverse_direction = 1.0f / direction;
+	std::vector<std::int32_t> stack { root };
+	while (!stack.empty()) {
+		const auto& node = nodes[stack.back()];
+		stack.pop_back();
+		auto distance = intersect(node.bounds, origin, inverse_direction, max_distance);
+		if (distance < 0.0f) {
+			continue;
+		}
+		if (node.left == null_node) {
+			hits.push_back(BvhHit{ node.item, distance });
+		} else {
+			stack.push_back(node.left);
+			stack.push_back(node.right);
+		}
+	}
+
+	std::sort(hits.begin(), hits.end(), [](auto& a, auto& b) { return a.distance < b.distance; });
+	return hits;
+}
+
+Bounds Bvh::bounds() const
+{
+	return nodes[root].bounds;
+}
+
+bool Bvh::empty() const
+{
+	return root == null_node;
+}
+
+std::size_t Bvh::size() const
+{
+	return leaves.size();
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include "culling.h"
+#include "gltf.h"
+
+#include <glm/vec3.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct BvhHit {
+	std::uint32_t item;
+	float distance;		// along the ray to where it enters the bounds
+};
+
+/// A bounding volume hierarchy over items identified by an id, each with
+/// its own world bounds, such as the nodes of a Scene or the instances of a
+/// RenderList.
+///
+/// `build` creates the whole tree at once, top down, splitting each range of
+/// items where the surface area heuristic says tracing through it is
+/// cheapest, with the candidate splits binned along the longest axis of the
+/// centroids. This gives the best tree and is meant for when everything
+/// changes at once.
+///
+/// The tree can also change one item at a time. `insert` walks down from the
+/// root towards the sibling which grows the total area of the tree the least
+/// and pairs the new leaf with it, `remove` replaces the parent of the leaf by
+/// its sibling, and `update` moves a leaf and refits its ancestors. These keep
+/// the tree valid but slowly degrade it, so a rebuild is worth it after a lot
+/// of changes. Nodes are kept in a single array and reused through a free
+/// list, so changing the tree rarely allocates.
+///
+/// Every leaf holds a single item. Queries walk the tree from the root and
+/// skip every subtree whose bounds miss, so they cost about the log of the
+/// number of items for small queries instead of a test per item.
+class Bvh {
+public:
+	void build(const std::vector<std::pair<std::uint32_t, Bounds>>& items);
+	void insert(std::uint32_t item, const Bounds& bounds);
+	void remove(std::uint32_t item);
+	void update(std::uint32_t item, const Bounds& bounds);
+	void clear();
+
+	// Appends the items at least partly inside the frustum. Subtrees
+	// entirely inside are added without testing their items.
+	void cull(const Frustum& frustum, std::vector<std::uint32_t>& items) const;
+	// Appends the items whose bounds overlap `bounds`.
+	void query_box(const Bounds& bounds, std::vector<std::uint32_t>& items) const;
+	// Returns the items whose bounds the ray goes through within
+	// `max_distance`, closest first. `direction` does not need to be
+	// normalized, distances are in multiples of it.
+	std::vector<BvhHit> query_ray(const glm::vec3& origin, const glm::vec3& direction, float max_distance) const;
+	// Bounds of every item, only valid when not empty.
+	Bounds bounds() const;
+	bool empty() const;
+	std::size_t size() const;
+private:
+	static constexpr std::int32_t null_node = -1;
+
+	struct Node {
+		Bounds bounds;
+		std::int32_t parent;
+		std::int32_t left;	// null_node for leaves
+		std::int32_t right;
+		std::uint32_t item;	// leaves only
+	};
+	struct BuildItem {
+		std::uint32_t item;
+		Bounds bounds;
+		glm::vec3 centroid;
+	};
+
+	std::int32_t allocate_node();
+	void free_node(std::int32_t node);
+	std::int32_t build_range(std::vector<BuildItem>& items, std::size_t begin, std::size_t end, std::int32_t parent);
+	void refit(std::int32_t node);
+	// Appends every item under `node`, without testing anything.
+	void append_items(std::int32_t node, std::vector<std::uint32_t>& items) const;
+
+	std::vector<Node> nodes;
+	std::vector<std::int32_t> free_nodes;
+	std::int32_t root {null_node};
+	std::unordered_map<std::uint32_t, std::int32_t> leaves;	// leaf of each item
+};
@@ -0,0 +1,217 @@
+#include "cache.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <system_error>
+
+namespace cache {
+
+static constexpr char magic[8] = { 'G', 'L', 'T', 'F', 'S', 'N', 'A', 'P' };
+// 2: indices include the levels of detail
+// 3: meshlets, and the levels of detail of each primitive
+static constexpr std::uint32_t version = 4;
+
+struct Header {
+	char magic[8];
+	std::uint32_t version;
+	std::int64_t source_time;
+	std::uint64_t vertex_count;
+	std::uint64_t index_count;
+	std::uint64_t texture_count;
+	std::uint64_t primitive_count;
+	std::uint64_t meshlet_count;
+};
+
+// What processing a primitive adds to it, in the order of the meshes.
+struct PrimitiveEntry {
+	LodChain lods;
+	std::uint64_t first_meshlet;
+	std::uint64_t meshlet_count;
+};
+
+static std::int64_t source_time(const std::filesystem::path& source)
+{
+	std::error_code error;
+	auto time = std::filesystem::last_write_time(source, error);
+	if (error) {
+		return 0;
+	}
+	return static_cast<std::int64_t>(time.time_since_epoch().count());
+}
+
+template <typename T>
+static void write_vector(std::ofstream& file, const std::vector<T>& data)
+{
+	file.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size() * sizeof(T)));
+}
+
+template <typename T>
+static void skip_vector(std::ifstream& file, std::size_t count)
+{
+	file.seekg(static_cast<std::streamoff>(count * sizeof(T)), std::ios::cur);
+}
+
+template <typename T>
+static void read_vector(std::ifstream& file, std::vector<T>& data, std::size_t count)
+{
+	data.resize(count);
+	file.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(count * sizeof(T)));
+}
+
+std::filesystem::path entry_path(const std::filesystem::path& source)
+{
+	std::error_code error;
+	auto absolute = std::filesystem::absolute(source, error);
+	auto key = std::hash<std::string>{}((error ? source : absolute).string());
+
+	std::ostringstream name;
+	name << std::hex << key << ".bin";
+	return std::filesystem::temp_directory_path() / "gltfsnap" / name.str();
+}
+
+bool write(const LoadedGLTF& gltf)
+{
+	auto path = entry_path(gltf.path);
+	std::error_code error;
+	std::filesystem::create_directories(path.parent_path(), error);
+	if (error) {
+		return false;
+	}
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		return false;
+	}
+
+	Header header;
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.source_time = source_time(gltf.path);
+	header.vertex_count = gltf.vertices.size();
+	header.index_count = gltf.indices.size();
+	header.texture_count = gltf.textures.size();
+	header.primitive_count = gltf.primitive_count;
+	header.meshlet_count = gltf.meshlets.size();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	std::vector<PrimitiveEntry> primitives;
+	for (const auto& mesh : gltf.meshes) {
+		for (const auto& primitive : mesh.primitives) {
+			primitives.push_back(PrimitiveEntry{ primitive.lods, primitive.first_meshlet, primitive.meshlet_count });
+		}
+	}
+
+	write_vector(file, gltf.vertices);
+	write_vector(file, gltf.indices);
+	write_vector(file, gltf.meshlets);
+	write_vector(file, primitives);
+	for (const auto& texture : gltf.textures) {
+		std::int32_t size[2] = { texture.width, texture.height };
+		std::uint64_t bytes = texture.pixels.size();
+		file.write(reinterpret_cast<const char*>(size), sizeof(size));
+		file.write(reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+		write_vector(file, texture.pixels);
+	}
+	return static_cast<bool>(file);
+}
+
+// Checks the entry belongs to the current version of the source file, the
+// index count is only known once the glTF has been processed.
+static bool read_header(std::ifstream& file, const LoadedGLTF& gltf, Header& header, bool processed = true)
+{
+	file.read(reinterpret_cast<char*>(&header), sizeof(header));
+	return file
+	    && std::memcmp(header.magic, magic, sizeof(magic)) == 0
+	    && header.version == version
+	    && header.source_time == source_time(gltf.path)
+	    && header.vertex_count == gltf.vertex_count
+	    && (!processed || header.index_count == gltf.index_count)
+	    && (!processed || header.meshlet_count == gltf.meshlets.size())
+	    && header.texture_count == gltf.textures.size()
+	    && header.primitive_count == gltf.primitive_count;
+}
+
+bool is_valid(const LoadedGLTF& gltf)
+{
+	std::ifstream file(entry_path(gltf.path), std::ios::binary);
+	Header header;
+	return file && read_header(file, gltf, header);
+}
+
+bool read(LoadedGLTF& gltf)
+{
+	std::ifstream file(entry_path(gltf.path), std::ios::binary);
+	Header header;
+	if (!file || !read_header(file, gltf, header)) {
+		return false;
+	}
+
+	std::vector<Vertex> vertices;
+	std::vector<std::uint32_t> indices;
+	read_vector(file, vertices, header.vertex_count);
+	read_vector(file, indices, header.index_count);
+	skip_vector<Meshlet>(file, header.meshlet_count);
+	skip_vector<PrimitiveEntry>(file, header.primitive_count);
+
+	std::vector<std::vector<unsigned char>> pixels(header.texture_count);
+	for (std::size_t i = 0; i < header.texture_count; ++i) {
+		std::int32_t size[2];
+		std::uint64_t bytes;
+		file.read(reinterpret_cast<char*>(size), sizeof(size));
+		file.read(reinterpret_cast<char*>(&bytes), sizeof(bytes));
+		auto& texture = gltf.textures[i];
+		auto expected = static_cast<std::uint64_t>(texture.width) * texture.height * 4;
+		if (!file || size[0] != texture.width || size[1] != texture.height || (bytes != 0 && bytes != expected)) {
+			return false;
+		}
+		read_vector(file, pixels[i], bytes);
+	}
+	if (!file) {
+		return false;
+	}
+
+	gltf.vertices = std::move(vertices);
+	gltf.indices = std::move(indices);
+	for (std::size_t i = 0; i < header.texture_count; ++i) {
+		gltf.textures[i].pixels = std::move(pixels[i]);
+	}
+	return true;
+}
+
+bool read_clusters(LoadedGLTF& gltf)
+{
+	std::ifstream file(entry_path(gltf.path), std::ios::binary);
+	Header header;
+	if (!file || !read_header(file, gltf, header, false)) {
+		return false;
+	}
+
+	std::vector<std::uint32_t> indices;
+	std::vector<Meshlet> meshlets;
+	std::vector<PrimitiveEntry> primitives;
+	skip_vector<Vertex>(file, header.vertex_count);
+	read_vector(file, indices, header.index_count);
+	read_vector(file, meshlets, header.meshlet_count);
+	read_vector(file, primitives, header.primitive_count);
+	if (!file) {
+		return false;
+	}
+
+	gltf.indices = std::move(indices);
+	gltf.meshlets = std::move(meshlets);
+	std::size_t i = 0;
+	for (auto& mesh : gltf.meshes) {
+		for (auto& primitive : mesh.primitives) {
+			primitive.lods = primitives[i].lods;
+			primitive.first_meshlet = primitives[i].first_meshlet;
+			primitive.meshlet_count = primitives[i].meshlet_count;
+			++i;
+		}
+	}
+	return true;
+}
+
+} // end namespace cache
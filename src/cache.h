@@ -0,0 +1,35 @@
+#pragma once
+
+#include "gltf.h"
+
+#include <filesystem>
+
+/// Cache
+///
+/// An on-disk copy of the data in a LoadedGLTF which is expensive to produce
+/// but cheap to read back: geometry, meshlets, levels of detail and decoded
+/// pixels. Reading the cache is a handful of large reads, while loading from
+/// the source file means parsing the glTF, decoding every image and
+/// processing the meshes again.
+///
+/// Meshlets and levels of detail are built once, when the source is first
+/// loaded, which writes the entry. Later loads still parse the source, but
+/// read them back with `read_clusters`.
+///
+/// Entries are keyed by the absolute path of the source file and are only
+/// valid while the source file is unchanged, which is checked with its last
+/// write time. A stale or corrupt entry simply fails to read and the caller
+/// falls back to the source file.
+
+namespace cache {
+
+std::filesystem::path entry_path(const std::filesystem::path& source);
+bool is_valid(const LoadedGLTF& gltf);
+bool write(const LoadedGLTF& gltf);
+// Fills in the geometry and pixels of an already loaded glTF.
+bool read(LoadedGLTF& gltf);
+// Fills in the indices, meshlets and levels of detail of a glTF freshly
+// parsed from its source, whose indices are not processed yet.
+bool read_clusters(LoadedGLTF& gltf);
+
+} // end namespace cache
@@ -0,0 +1,133 @@
+#include "culling.h"
+
+#include <glm/vec3.hpp>
+
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define CULLING_SSE
+#endif
+
+Frustum make_frustum(const glm::mat4& view_proj)
+{
+	auto row = [&](int i) {
+		return glm::vec4(view_proj[0][i], view_proj[1][i], view_proj[2][i], view_proj[3][i]);
+	};
+	return Frustum { {
+		row(3) + row(0),	// left
+		row(3) - row(0),	// right
+		row(3) + row(1),	// bottom
+		row(3) - row(1),	// top
+		row(3) + row(2),	// near
+		row(3) - row(2),	// far
+	} };
+}
+
+void BoundsArray::clear()
+{
+	resize(0);
+}
+
+void BoundsArray::resize(std::size_t count)
+{
+	for (auto* array : { &min_x, &min_y, &min_z, &max_x, &max_y, &max_z }) {
+		array->resize(count);
+	}
+}
+
+void BoundsArray::set(std::size_t index, const Bounds& bounds)
+{
+	min_x[index] = bounds.min.x;
+	min_y[index] = bounds.min.y;
+	min_z[index] = bounds.min.z;
+	max_x[index] = bounds.max.x;
+	max_y[index] = bounds.max.y;
+	max_z[index] = bounds.max.z;
+}
+
+std::size_t BoundsArray::size() const
+{
+	return min_x.size();
+}
+
+// Transforms the center and projects the extent onto the new axes, which is
+// the same as transforming all 8 corners but much cheaper.
+Bounds transform_bounds(const Bounds& bounds, const glm::mat4& transform)
+{
+	auto center = (bounds.min + bounds.max) * 0.5f;
+	auto extent = (bounds.max - bounds.min) * 0.5f;
+
+	auto world_center = glm::vec3(transform * glm::vec4(center, 1.0f));
+	glm::vec3 world_extent;
+	for (int i = 0; i < 3; ++i) {
+		world_extent[i] = std::abs(transform[0][i]) * extent.x
+			+ std::abs(transform[1][i]) * extent.y
+			+ std::abs(transform[2][i]) * extent.z;
+	}
+	return Bounds { world_center - world_extent, world_center + world_extent };
+}
+
+static bool is_visible(const Frustum& frustum, const BoundsArray& bounds, std::size_t i)
+{
+	for (const auto& plane : frustum.planes) {
+		auto x = plane.x > 0.0f ? bounds.max_x[i] : bounds.min_x[i];
+		auto y = plane.y > 0.0f ? bounds.max_y[i] : bounds.min_y[i];
+		auto z = plane.z > 0.0f ? bounds.max_z[i] : bounds.min_z[i];
+		if (plane.x * x + plane.y * y + plane.z * z + plane.w < 0.0f) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::size_t cull_frustum(const Frustum& frustum, const BoundsArray& bounds, std::uint8_t* visible)
+{
+	std::size_t count = bounds.size();
+	std::size_t visible_count = 0;
+	std::size_t i = 0;
+
+#ifdef CULLING_SSE
+	// The corner to test only depends on the plane, so each plane picks its
+	// arrays once and then tests 4 boxes at a time.
+	struct Plane {
+		const float* x;
+		const float* y;
+		const float* z;
+		__m128 a, b, c, d;
+	};
+	Plane planes[6];
+	for (int p = 0; p < 6; ++p) {
+		const auto& plane = frustum.planes[p];
+		planes[p] = Plane {
+			plane.x > 0.0f ? bounds.max_x.data() : bounds.min_x.data(),
+			plane.y > 0.0f ? bounds.max_y.data() : bounds.min_y.data(),
+			plane.z > 0.0f ? bounds.max_z.data() : bounds.min_z.data(),
+			_mm_set1_ps(plane.x), _mm_set1_ps(plane.y), _mm_set1_ps(plane.z), _mm_set1_ps(plane.w),
+		};
+	}
+
+	const __m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4) {
+		__m128 outside = zero;
+		for (const auto& plane : planes) {
+			__m128 distance = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(plane.a, _mm_loadu_ps(plane.x + i)),
+					   _mm_mul_ps(plane.b, _mm_loadu_ps(plane.y + i))),
+				_mm_add_ps(_mm_mul_ps(plane.c, _mm_loadu_ps(plane.z + i)), plane.d));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, zero));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int lane = 0; lane < 4; ++lane) {
+			visible[i + lane] = ((mask >> lane) & 1) ? 0 : 1;
+			visible_count += visible[i + lane];
+		}
+	}
+#endif
+
+	for (; i < count; ++i) {
+		visible[i] = is_visible(frustum, bounds, i) ? 1 : 0;
+		visible_count += visible[i];
+	}
+	return visible_count;
+}
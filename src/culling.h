@@ -0,0 +1,47 @@
+#pragma once
+
+#include "gltf.h"
+
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Culling
+///
+/// Bounds are kept as a structure of arrays, one array per component, so the
+/// frustum test can load the same component of several boxes at once and test
+/// them with a single instruction. With SSE this tests 4 boxes at a time,
+/// without it the same test runs on one box at a time.
+///
+/// A box is tested against each plane with its corner furthest along the
+/// plane normal, if that corner is behind any plane the box is outside. This
+/// keeps some boxes near the corners of the frustum which are actually
+/// outside, but is exact for anything else and needs no branches.
+
+// Planes point inwards, a point is inside when dot(plane, vec4(point, 1)) >= 0.
+struct Frustum {
+	glm::vec4 planes[6];
+};
+
+// Extracts the planes of the frustum from a view projection matrix.
+Frustum make_frustum(const glm::mat4& view_proj);
+
+struct BoundsArray {
+	std::vector<float> min_x, min_y, min_z;
+	std::vector<float> max_x, max_y, max_z;
+
+	void clear();
+	void resize(std::size_t count);
+	void set(std::size_t index, const Bounds& bounds);
+	std::size_t size() const;
+};
+
+// Bounds enclosing `bounds` after it is transformed.
+Bounds transform_bounds(const Bounds& bounds, const glm::mat4& transform);
+
+// Sets `visible` to 1 for each box at least partly inside the frustum and to
+// 0 otherwise, returns how many are visible.
+std::size_t cull_frustum(const Frustum& frustum, const BoundsArray& bounds, std::uint8_t* visible);
@@ -0,0 +1,62 @@
+#include "depth_pyramid.h"
+
+#include <algorithm>
+#include <cmath>
+
+static constexpr GLuint workgroup_size = 8;
+
+DepthPyramid::DepthPyramid(GLuint program) : program(program)
+{
+	source_level_uniform = glGetUniformLocation(program, "source_level");
+	scale_uniform = glGetUniformLocation(program, "scale");
+}
+
+void DepthPyramid::resize(int new_width, int new_height)
+{
+	if (new_width == width && new_height == height && pyramid != 0) {
+		return;
+	}
+	delete_texture();
+
+	width = std::max(1, new_width);
+	height = std::max(1, new_height);
+	levels = static_cast<int>(1 + std::floor(std::log2(std::max(width, height))));
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &pyramid);
+	glTextureStorage2D(pyramid, levels, GL_R32F, width, height);
+	glTextureParameteri(pyramid, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTextureParameteri(pyramid, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTextureParameteri(pyramid, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(pyramid, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+void DepthPyramid::build(GLuint depth_texture)
+{
+	glUseProgram(program);
+	for (int level = 0; level < levels; ++level) {
+		auto level_width = static_cast<GLuint>(std::max(1, width >> level));
+		auto level_height = static_cast<GLuint>(std::max(1, height >> level));
+
+		glBindTextureUnit(0, level == 0 ? depth_texture : pyramid);
+		glProgramUniform1i(program, source_level_uniform, level == 0 ? 0 : level - 1);
+		glProgramUniform1i(program, scale_uniform, level == 0 ? 1 : 2);
+		glBindImageTexture(0, pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+		glDispatchCompute((level_width + workgroup_size - 1) / workgroup_size,
+				  (level_height + workgroup_size - 1) / workgroup_size, 1);
+		// The next level reads this one
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+}
+
+GLuint DepthPyramid::texture() const
+{
+	return pyramid;
+}
+
+void DepthPyramid::delete_texture()
+{
+	if (pyramid != 0) {
+		glDeleteTextures(1, &pyramid);
+		pyramid = 0;
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <glad/gl.h>
+
+/// A mip chain of the depth buffer where each texel holds the furthest depth
+/// of the area it covers, for occlusion culling. Bounds which are behind the
+/// furthest depth of every texel they cover are hidden. The chain lets the
+/// test read only a few texels whatever the size of the bounds on screen.
+///
+/// Levels are built with a compute shader, the first level is a copy of the
+/// depth buffer and each following one reduces the previous one by half.
+class DepthPyramid {
+public:
+	DepthPyramid() {}
+	DepthPyramid(GLuint program);
+
+	// Recreates the pyramid for a depth buffer of this size.
+	void resize(int new_width, int new_height);
+	// Rebuilds every level from `depth_texture`, which must not have a
+	// mipmapping min filter. Leaves the reduce program in use.
+	void build(GLuint depth_texture);
+	GLuint texture() const;
+	void delete_texture();
+private:
+	GLuint program {0};
+	GLint source_level_uniform {-1};
+	GLint scale_uniform {-1};
+
+	GLuint pyramid {0};
+	int width {0};
+	int height {0};
+	int levels {0};
+};
@@ -1,9 +1,15 @@
 #include "gltf.h"
+#include "cache.h"
+#include "meshlet.h"
+#include "simplify.h"
+#include "stats.h"
 
 #include <fastgltf/glm_element_traits.hpp>
 #include <fastgltf/core.hpp>
 #include <fastgltf/tools.hpp>
 
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/vec4.hpp>
@@ -12,6 +18,11 @@
 
 #include <stb_image.h>
 
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+
 // Most of the code here is from fastgltf's gltf viewer example.
 
 static GLsizei level_count(int width, int height)
@@ -19,10 +30,106 @@ static GLsizei level_count(int width, int height)
 	return static_cast<GLsizei>(1 + floor(log2(width > height ? width : height)));
 }
 
+static void store_pixels(Texture& texture, int width, int height, unsigned char* data)
+{
+	if (data) {
+		texture.width = width;
+		texture.height = height;
+		texture.pixels.assign(data, data + static_cast<std::size_t>(width) * height * 4);
+	}
+}
+
+void upload_texture(Texture& texture)
+{
+	if (texture.id != 0 || texture.pixels.empty()) {
+		return;
+	}
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &texture.id);
+	glTextureStorage2D(texture.id, level_count(texture.width, texture.height), GL_RGBA8, texture.width, texture.height);
+	glTextureSubImage2D(texture.id, 0, 0, 0, texture.width, texture.height, GL_RGBA, GL_UNSIGNED_BYTE, texture.pixels.data());
+	// TODO: samplers
+	glGenerateTextureMipmap(texture.id);
+
+	stats::record_texture(GL_RGBA8, texture_bytes(texture));
+	stats::record_upload(texture.pixels.size());
+}
+
+void release_texture(Texture& texture)
+{
+	if (texture.id == 0) {
+		return;
+	}
+	glDeleteTextures(1, &texture.id);
+	texture.id = 0;
+	stats::release_texture(GL_RGBA8, texture_bytes(texture));
+}
+
+std::size_t texture_bytes(const Texture& texture)
+{
+	if (texture.width == 0 || texture.height == 0) {
+		return 0;
+	}
+	std::size_t bytes = 0;
+	for (GLsizei level = 0; level < level_count(texture.width, texture.height); ++level) {
+		std::size_t level_width = std::max(1, texture.width >> level);
+		std::size_t level_height = std::max(1, texture.height >> level);
+		bytes += level_width * level_height * 4;
+	}
+	return bytes;
+}
+
+std::size_t mesh_bytes(const LoadedGLTF& gltf)
+{
+	return gltf.vertex_count * sizeof(Vertex)
+		+ gltf.index_count * sizeof(std::uint32_t)
+		+ gltf.materials.size() * sizeof(Material);
+}
+
+void release_cpu_data(LoadedGLTF& gltf)
+{
+	// Keep a copy around so reloading does not need to parse the source
+	if (!cache::is_valid(gltf)) {
+		cache::write(gltf);
+	}
+
+	std::vector<Vertex>().swap(gltf.vertices);
+	std::vector<std::uint32_t>().swap(gltf.indices);
+	for (auto& texture : gltf.textures) {
+		std::vector<unsigned char>().swap(texture.pixels);
+	}
+}
+
+bool has_cpu_data(const LoadedGLTF& gltf)
+{
+	return gltf.vertices.size() == gltf.vertex_count && gltf.indices.size() == gltf.index_count;
+}
+
+bool reload_cpu_data(LoadedGLTF& gltf)
+{
+	if (has_cpu_data(gltf) || cache::read(gltf)) {
+		return true;
+	}
+
+	auto source = load_gltf(gltf.path);
+	if (source.vertex_count != gltf.vertex_count
+	    || source.index_count != gltf.index_count
+	    || source.textures.size() != gltf.textures.size()) {
+		std::cerr << "Failed to reload " << gltf.path << ", the file has changed since it was loaded\n";
+		return false;
+	}
+
+	gltf.vertices = std::move(source.vertices);
+	gltf.indices = std::move(source.indices);
+	for (std::size_t i = 0; i < gltf.textures.size(); ++i) {
+		gltf.textures[i].pixels = std::move(source.textures[i].pixels);
+	}
+	return true;
+}
+
 static void load_texture(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Image& image)
 {
 	Texture texture;
-	glCreateTextures(GL_TEXTURE_2D, 1, &texture.id);
 
 	std::visit(fastgltf::visitor {
 		[](auto& arg) {},
@@ -34,15 +141,13 @@ static void load_texture(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Ima
 
 			const std::string path(filePath.uri.path().begin(), filePath.uri.path().end());
 			unsigned char *data = stbi_load(path.c_str(), &width, &height, &nrChannels, 4);
-			glTextureStorage2D(texture.id, level_count(width, height), GL_RGBA8, width, height);
-			glTextureSubImage2D(texture.id, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			store_pixels(texture, width, height, data);
 			stbi_image_free(data);
 		},
 		[&](fastgltf::sources::Array& vector) {
 			int width, height, nrChannels;
 			unsigned char *data = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(vector.bytes.data()), static_cast<int>(vector.bytes.size()), &width, &height, &nrChannels, 4);
-			glTextureStorage2D(texture.id, level_count(width, height), GL_RGBA8, width, height);
-			glTextureSubImage2D(texture.id, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+			store_pixels(texture, width, height, data);
 			stbi_image_free(data);
 		},
 		[&](fastgltf::sources::BufferView& view) {
@@ -57,17 +162,14 @@ static void load_texture(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Ima
 					int width, height, nrChannels;
 					unsigned char* data = stbi_load_from_memory(reinterpret_cast<const stbi_uc*>(vector.bytes.data() + buffer_view.byteOffset),
 						 static_cast<int>(buffer_view.byteLength), &width, &height, &nrChannels, 4);
-					glTextureStorage2D(texture.id, level_count(width, height), GL_RGBA8, width, height);
-					glTextureSubImage2D(texture.id, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, data);
+					store_pixels(texture, width, height, data);
 					stbi_image_free(data);
 				}
 			}, buffer.data);
 	      }
 	}, image.data);
 
-	// TODO: samplers
-	glGenerateTextureMipmap(texture.id);
-	gltf.textures.push_back(texture);
+	gltf.textures.push_back(std::move(texture));
 }
 
 static void load_material(LoadedGLTF& gltf, fastgltf::Material& material)
@@ -76,9 +178,121 @@ static void load_material(LoadedGLTF& gltf, fastgltf::Material& material)
 		glm::make_vec4(material.pbrData.baseColorFactor.data()),
 		material.pbrData.metallicFactor,
 		material.pbrData.roughnessFactor,
+		{},
 	});
 }
 
+// Levels with fewer indices than this are not worth a draw of their own.
+static constexpr std::size_t min_lod_indices = 3 * 64;
+
+// Each level is simplified from the previous one and aims for half of its
+// triangles. The chain stops early once simplifying stops paying off. The
+// simplified indices are appended to the indices of the glTF.
+static void generate_lods(LoadedGLTF& gltf, Primitive& primitive)
+{
+	auto& lods = primitive.lods;
+	lods.levels[0] = Lod {
+		static_cast<std::uint32_t>(primitive.first_index),
+		static_cast<std::uint32_t>(primitive.index_count),
+		0.0f,
+	};
+	lods.count = 1;
+
+	auto first = gltf.indices.begin() + primitive.first_index;
+	std::vector<std::uint32_t> source(first, first + primitive.index_count);
+	float error = 0.0f;
+	while (lods.count < max_lods) {
+		auto target = source.size() / 2 / 3 * 3;
+		if (target < min_lod_indices) {
+			break;
+		}
+
+		float level_error;
+		auto simplified = simplify(&gltf.vertices[primitive.base_vertex], primitive.vertex_count,
+					   source.data(), source.size(), target, level_error);
+		if (simplified.size() * 10 > source.size() * 9) {
+			break;
+		}
+
+		// Each level is simplified from the previous one, so the errors
+		// add up.
+		error += level_error;
+		lods.levels[lods.count++] = Lod {
+			static_cast<std::uint32_t>(gltf.indices.size()),
+			static_cast<std::uint32_t>(simplified.size()),
+			error,
+		};
+		gltf.indices.insert(gltf.indices.end(), simplified.begin(), simplified.end());
+		source = std::move(simplified);
+	}
+}
+
+// Meshlets are only built for the first level, the others are meant to be
+// drawn far enough away that culling parts of them is not worth it. They are
+// built first, so the other levels are simplified from the reordered indices.
+static void build_clusters(LoadedGLTF& gltf, Primitive& primitive)
+{
+	primitive.first_meshlet = gltf.meshlets.size();
+	primitive.meshlet_count = 0;
+	if (primitive.index_count > max_meshlet_triangles * 3) {
+		auto meshlets = build_meshlets(&gltf.vertices[primitive.base_vertex], primitive.vertex_count,
+					       &gltf.indices[primitive.first_index], primitive.index_count);
+		if (primitive.double_sided) {
+			for (auto& meshlet : meshlets) {
+				meshlet.cone_cutoff = 1.0f;
+			}
+		}
+		primitive.meshlet_count = meshlets.size();
+		gltf.meshlets.insert(gltf.meshlets.end(), meshlets.begin(), meshlets.end());
+	}
+	generate_lods(gltf, primitive);
+}
+
+// Smooth normals for primitives without any, the sum of the normals of the
+// triangles around each vertex weighted by their area.
+static void compute_normals(LoadedGLTF& gltf, const Primitive& primitive)
+{
+	auto* vertices = &gltf.vertices[primitive.base_vertex];
+	for (auto i = primitive.first_index; i + 2 < primitive.first_index + primitive.index_count; i += 3) {
+		auto& v0 = vertices[gltf.indices[i]];
+		auto& v1 = vertices[gltf.indices[i + 1]];
+		auto& v2 = vertices[gltf.indices[i + 2]];
+		auto normal = glm::cross(v1.pos - v0.pos, v2.pos - v0.pos);
+		v0.normal += normal;
+		v1.normal += normal;
+		v2.normal += normal;
+	}
+	for (std::size_t v = 0; v < primitive.vertex_count; ++v) {
+		auto length = glm::length(vertices[v].normal);
+		vertices[v].normal = length > 0.0f ? vertices[v].normal / length : glm::vec3(0.0f, 0.0f, 1.0f);
+	}
+}
+
+static void load_light(LoadedGLTF& gltf, const fastgltf::Light& light, const glm::mat4& transform)
+{
+	Light loaded {};
+	loaded.position = glm::vec3(transform[3]);
+	loaded.direction = glm::normalize(glm::vec3(transform * glm::vec4(0.0f, 0.0f, -1.0f, 0.0f)));
+	loaded.color = glm::vec3(light.color.x(), light.color.y(), light.color.z());
+	loaded.intensity = light.intensity;
+	loaded.range = light.range.value_or(0.0f);
+	switch (light.type) {
+	case fastgltf::LightType::Directional:
+		loaded.type = LightType::DIRECTIONAL;
+		break;
+	case fastgltf::LightType::Point:
+		loaded.type = LightType::POINT;
+		break;
+	case fastgltf::LightType::Spot:
+		loaded.type = LightType::SPOT;
+		loaded.inner_cone = std::cos(light.innerConeAngle.value_or(0.0f));
+		// The default outer angle is a quarter of pi
+		loaded.outer_cone = std::cos(light.outerConeAngle.value_or(0.7853982f));
+		break;
+	}
+	gltf.lights.push_back(loaded);
+}
+
 static bool load_mesh(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Mesh& gltf_mesh)
 {
 	Mesh mesh;
@@ -90,11 +304,23 @@ static bool load_mesh(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Mesh&
 		auto* pos = it.findAttribute("POSITION");
 		auto& pos_accessor = asset.accessors[pos->accessorIndex];
 		gltf.vertices.reserve(vertices_start + pos_accessor.count);
+		primitive.bounds = Bounds{ glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
 		fastgltf::iterateAccessor<glm::vec3>(asset, pos_accessor, [&](glm::vec3 pos) {
-			gltf.vertices.push_back(Vertex{ pos, glm::vec2() });
+			gltf.vertices.push_back(Vertex{ pos, glm::vec3(0.0f), glm::vec2() });
+			primitive.bounds.min = glm::min(primitive.bounds.min, pos);
+			primitive.bounds.max = glm::max(primitive.bounds.max, pos);
 		});
 		size_t vertices_size = gltf.vertices.size() - vertices_start;
 
+		auto* normal = it.findAttribute("NORMAL");
+		bool has_normals = normal != it.attributes.end();
+		if (has_normals) {
+			auto& normal_accessor = asset.accessors[normal->accessorIndex];
+			fastgltf::iterateAccessorWithIndex<glm::vec3>(asset, normal_accessor, [&](glm::vec3 normal, size_t index) {
+				gltf.vertices[vertices_start + index].normal = normal;
+			});
+		}
+
 		// uv
 		//
 		// There might be more than one texture and thus more than one
@@ -109,8 +335,11 @@ static bool load_mesh(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Mesh&
 
 		// materials and textures
 		primitive.material_idx = 0;
+		primitive.texture_idx = no_texture;
+		primitive.double_sided = false;
 		if (it.materialIndex.has_value()) {
 			primitive.material_idx = it.materialIndex.value() + 1; // adjust for default material
+			primitive.double_sided = asset.materials[it.materialIndex.value()].doubleSided;
 			auto& base_texture = asset.materials[it.materialIndex.value()].pbrData.baseColorTexture;
 			if (base_texture.has_value()) {
 				auto& texture = asset.textures[base_texture->textureIndex];
@@ -137,10 +366,14 @@ static bool load_mesh(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Mesh&
 		primitive.base_vertex = static_cast<std::size_t>(vertices_start);
 		primitive.first_index = static_cast<std::size_t>(gltf.indices.size());
 		primitive.index_count = static_cast<std::size_t>(index_accessor.count);
+		primitive.vertex_count = vertices_size;
 
 		fastgltf::iterateAccessor<std::uint32_t>(asset, index_accessor, [&](std::uint32_t idx) {
 			gltf.indices.push_back(idx);
 		});
+		if (!has_normals) {
+			compute_normals(gltf, primitive);
+		}
 
 		mesh.primitives.push_back(primitive);
 		++gltf.primitive_count;
@@ -150,12 +383,54 @@ static bool load_mesh(LoadedGLTF& gltf, fastgltf::Asset& asset, fastgltf::Mesh&
 	return true;
 }
 
+// EXT_mesh_gpu_instancing gives a translation, rotation and scale per
+// instance, each in its own accessor. Missing ones default to the identity.
+static void load_instances(MeshNode& meshnode, fastgltf::Asset& asset, fastgltf::Node& node)
+{
+	std::size_t count = 0;
+	for (auto& attribute : node.instancingAttributes) {
+		count = std::max(count, asset.accessors[attribute.accessorIndex].count);
+	}
+	if (count == 0) {
+		return;
+	}
+
+	std::vector<glm::vec3> translations(count, glm::vec3(0.0f));
+	std::vector<glm::quat> rotations(count, glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+	std::vector<glm::vec3> scales(count, glm::vec3(1.0f));
+	for (auto& attribute : node.instancingAttributes) {
+		auto& accessor = asset.accessors[attribute.accessorIndex];
+		if (attribute.name == "TRANSLATION") {
+			fastgltf::iterateAccessorWithIndex<glm::vec3>(asset, accessor, [&](glm::vec3 translation, size_t index) {
+				translations[index] = translation;
+			});
+		} else if (attribute.name == "ROTATION") {
+			fastgltf::iterateAccessorWithIndex<glm::vec4>(asset, accessor, [&](glm::vec4 rotation, size_t index) {
+				rotations[index] = glm::quat(rotation.w, rotation.x, rotation.y, rotation.z);
+			});
+		} else if (attribute.name == "SCALE") {
+			fastgltf::iterateAccessorWithIndex<glm::vec3>(asset, accessor, [&](glm::vec3 scale, size_t index) {
+				scales[index] = scale;
+			});
+		}
+	}
+
+	meshnode.instances.reserve(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		meshnode.instances.push_back(glm::translate(glm::mat4(1.0f), translations[i])
+					     * glm::mat4_cast(rotations[i])
+					     * glm::scale(glm::mat4(1.0f), scales[i]));
+	}
+}
+
 LoadedGLTF load_gltf(std::filesystem::path path)
 {
 	LoadedGLTF loaded_gltf;
 	constexpr auto extensions = fastgltf::Extensions::KHR_mesh_quantization
 		| fastgltf::Extensions::KHR_texture_transform
-		| fastgltf::Extensions::KHR_materials_variants;
+		| fastgltf::Extensions::KHR_materials_variants
+		| fastgltf::Extensions::KHR_lights_punctual
+		| fastgltf::Extensions::EXT_mesh_gpu_instancing;
 
 	constexpr auto options = fastgltf::Options::DontRequireValidAssetMember
 		| fastgltf::Options::AllowDouble
@@ -177,7 +452,7 @@ LoadedGLTF load_gltf(std::filesystem::path path)
 
 	loaded_gltf.path = path;
 	// default material
-	loaded_gltf.materials.push_back(Material{ glm::vec4(1.0f), 1.0f, 1.0f });
+	loaded_gltf.materials.push_back(Material{ glm::vec4(1.0f), 1.0f, 1.0f, {} });
 	for (auto& material : asset.materials) {
 		load_material(loaded_gltf, material);
 	}
@@ -186,12 +461,33 @@ LoadedGLTF load_gltf(std::filesystem::path path)
 		load_mesh(loaded_gltf, asset, mesh);
 	}
 
+	// Meshlets and levels of detail are slow to build, so they are read
+	// back from the cache when it has them, and written to it right away
+	// otherwise.
+	loaded_gltf.vertex_count = loaded_gltf.vertices.size();
+	if (!cache::read_clusters(loaded_gltf)) {
+		for (auto& mesh : loaded_gltf.meshes) {
+			for (auto& primitive : mesh.primitives) {
+				build_clusters(loaded_gltf, primitive);
+			}
+		}
+		loaded_gltf.index_count = loaded_gltf.indices.size();
+		cache::write(loaded_gltf);
+	}
+
 	fastgltf::iterateSceneNodes(asset, 0, fastgltf::math::fmat4x4(),
 	    [&](fastgltf::Node& node, fastgltf::math::fmat4x4 transform) {
 		    if (node.meshIndex.has_value()) {
-			     loaded_gltf.meshnodes.push_back(MeshNode { glm::make_mat4(transform.data()), *node.meshIndex });
+			     MeshNode meshnode { glm::make_mat4(transform.data()), *node.meshIndex, {} };
+			     load_instances(meshnode, asset, node);
+			     loaded_gltf.meshnodes.push_back(std::move(meshnode));
+		    }
+		    if (node.lightIndex.has_value()) {
+			     load_light(loaded_gltf, asset.lights[*node.lightIndex], glm::make_mat4(transform.data()));
 		    }
 	});
 
+	loaded_gltf.index_count = loaded_gltf.indices.size();
+
 	return loaded_gltf;
 }
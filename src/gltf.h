@@ -4,40 +4,130 @@
 #include <glm/mat4x4.hpp>
 #include <glm/vec4.hpp>
 
+#include <array>
+#include <cstdint>
 #include <filesystem>
 #include <vector>
 #include <string>
 
+// The pixels are kept around so the texture can be uploaded again after it
+// has been evicted from the GPU, an `id` of 0 means it is not resident. The
+// size is kept even when the pixels are released.
 struct Texture {
-	GLuint id;
+	GLuint id {0};
+	int width {0};
+	int height {0};
+	std::vector<unsigned char> pixels;	// RGBA8
 };
 
 // TODO: it might make more sense to store texture inside material
+//
+// Materials are uploaded as is into the material table, the padding rounds
+// the size up to the std430 array stride.
 struct Material {
 	glm::vec4 base_color;
 	float metallic;
 	float roughness;
+	float padding[2];
 };
 
-// Texture and position coordinates, the data is interleaved.
+// Position, normal and texture coordinates, the data is interleaved.
 struct Vertex {
 	glm::vec3 pos;
+	glm::vec3 normal;
 	glm::vec2 uv;
 };
 
+enum class LightType : std::uint32_t { DIRECTIONAL, POINT, SPOT };
+
+// A light of KHR_lights_punctual, in the space of the glTF. Lights point
+// down their local -Z axis.
+struct Light {
+	LightType type;
+	glm::vec3 position;
+	glm::vec3 direction;
+	glm::vec3 color;
+	float intensity;	// candela, or lux for directional lights
+	float range;		// 0 when unbounded
+	// Cosines of the cone angles of spot lights
+	float inner_cone;
+	float outer_cone;
+};
+
+// Axis aligned bounding box.
+struct Bounds {
+	glm::vec3 min;
+	glm::vec3 max;
+};
+
+constexpr std::size_t max_lods = 4;
+
+// A level of detail, a simplified version of the indices of a primitive which
+// uses the same vertices. `error` is the furthest the simplified surface is
+// from the original one, in the space of the mesh.
+struct Lod {
+	std::uint32_t first_index;
+	std::uint32_t index_count;
+	float error;
+};
+
+// The first level is the primitive itself, each following one has about half
+// the triangles of the previous one.
+struct LodChain {
+	std::array<Lod, max_lods> levels;
+	std::uint32_t count;
+};
+
+// A cluster of neighbouring triangles of a primitive, culled as a whole.
+// Meshlets are stored in `LoadedGLTF::meshlets` and their indices are
+// contiguous in the first level of detail, `first_index` is relative to the
+// first index of the primitive. The normal cone holds every normal of the
+// triangles, with `cone_cutoff` the sine of its half angle, or 1 when it is
+// too wide for the meshlet to ever be entirely back facing.
+struct Meshlet {
+	glm::vec3 center;	// bounding sphere, in the space of the mesh
+	float radius;
+	glm::vec3 cone_axis;
+	float cone_cutoff;
+	std::uint32_t first_index;
+	std::uint32_t index_count;
+};
+
+struct LoadedGLTF;
+
+// The meshlets of a primitive, `first_meshlet` indexes the meshlets of its
+// glTF. An index stays valid when the meshlets are loaded again.
+struct MeshletRange {
+	const LoadedGLTF* gltf;
+	std::uint32_t first_meshlet;
+	std::uint32_t count;
+};
+
+constexpr std::size_t no_texture = static_cast<std::size_t>(-1);
+
 struct Primitive {
 	// We could just store the GLuint handle to the texture, but that would
 	// be inconsistent with how materials is handled. So both these variables
 	// are indices to the actual values in the material and texture arrays.
+	// Primitives without a texture have a `texture_idx` of `no_texture`.
 	std::size_t material_idx;
 	std::size_t texture_idx;
-	// Eventually we want to sort primitives based on something like
-	// material so there is less binding. In that case we need the index to
-	// the command since the order is no longer the same.
+	// Both sides can be seen, so meshlets are never culled as back facing.
+	bool double_sided;
+	// Position of the primitive's command among the commands of the glTF.
+	// Draws are sorted by state in the RenderList, which keeps its own map
+	// back to the CommandBuffer, so this is not the submission order.
 	std::size_t command_idx;
 
 	// These are needed to generate draw commands.
 	std::size_t base_vertex, first_index, index_count;
+	// Only needed to process the indices when loading, and to bake.
+	std::size_t vertex_count;
+	// In the space of the mesh, used for culling.
+	Bounds bounds;
+	LodChain lods;
+	// Primitives too small to be worth splitting have no meshlets.
+	std::size_t first_meshlet, meshlet_count;
 
 	// TODO: see if these are neccessary, it might be possible to always
 	// assume drawing triangles and an uint32_t as the index type
@@ -52,21 +142,45 @@ struct Mesh {
 struct MeshNode {
 	glm::mat4 transform;
 	std::size_t mesh_idx;
+	// Transforms of EXT_mesh_gpu_instancing, relative to `transform`. The
+	// mesh is drawn once per instance, or once if there are none.
+	std::vector<glm::mat4> instances;
 };
 
 // Contains all information needed to render a GLTF. Meshes depend on materials
 // which depend on textures.
+//
+// The vertices, indices and pixels are only needed to upload to the GPU and
+// can be released afterwards with `release_cpu_data`, everything else is
+// needed to draw. The counts stay valid after a release.
 struct LoadedGLTF {
 	std::string path;
 	std::vector<Vertex> vertices;
 	std::vector<std::uint32_t> indices;
+	std::size_t vertex_count {0};
+	std::size_t index_count {0};
 
 	std::vector<Texture> textures;
 	std::vector<Material> materials;
 	std::vector<Mesh> meshes;
 	size_t primitive_count {0};
+	// Kept after a release, they are needed to cull.
+	std::vector<Meshlet> meshlets;
 
 	std::vector<MeshNode> meshnodes;
+	std::vector<Light> lights;
 };
 
 LoadedGLTF load_gltf(std::filesystem::path path);
+
+void release_cpu_data(LoadedGLTF& gltf);
+bool has_cpu_data(const LoadedGLTF& gltf);
+// Brings back released data from the cache, or the source file otherwise.
+bool reload_cpu_data(LoadedGLTF& gltf);
+
+// Creates the GL texture from its pixels, does nothing if already resident.
+void upload_texture(Texture& texture);
+void release_texture(Texture& texture);
+// Sizes of the GPU resources, textures include their mip chain.
+std::size_t texture_bytes(const Texture& texture);
+std::size_t mesh_bytes(const LoadedGLTF& gltf);
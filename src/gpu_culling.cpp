@@ -0,0 +1,129 @@
+#include "gpu_culling.h"
+
+#include <algorithm>
+
+static constexpr GLuint workgroup_size = 64;
+
+GpuCulling::GpuCulling(GLuint program) : program(program)
+{
+	planes_uniform = glGetUniformLocation(program, "planes");
+	count_uniform = glGetUniformLocation(program, "instance_count");
+	group_count_uniform = glGetUniformLocation(program, "group_count");
+	pass_uniform = glGetUniformLocation(program, "pass");
+	view_proj_uniform = glGetUniformLocation(program, "view_proj");
+	positions = StreamBuffer<std::uint32_t>("culling.positions");
+	counters = StreamBuffer<std::uint32_t>("culling.counters");
+	instances = StreamBuffer<Instance>("culling.instances");
+	visibility = StreamBuffer<std::uint32_t>("culling.visibility");
+}
+
+void GpuCulling::update(const RenderList& render_list)
+{
+	count = render_list.instances.size();
+	auto* written = instances.map(count);
+	const auto& bounds = render_list.bounds;
+	for (std::size_t group = 0; group < render_list.size(); ++group) {
+		auto first = render_list.first_instance[group];
+		for (auto i = first; i < first + render_list.instance_count[group]; ++i) {
+			*written++ = Instance {
+				.bounds_min = glm::vec4(bounds.min_x[i], bounds.min_y[i], bounds.min_z[i], 0.0f),
+				.bounds_max = glm::vec4(bounds.max_x[i], bounds.max_y[i], bounds.max_z[i], 0.0f),
+				.draw_id = render_list.instances[i],
+				.group = static_cast<std::uint32_t>(group),
+				.padding = {},
+			};
+		}
+	}
+
+	// Nothing is known about the new instances, so they all start visible
+	// and the first frame does not cull anything by occlusion.
+	std::fill_n(visibility.map(count), count, 1u);
+}
+
+std::uint32_t* GpuCulling::begin_frame(std::size_t new_groups)
+{
+	groups = new_groups;
+
+	// The region was last written `regions` frames ago, and mapping it
+	// waited for the GPU to be done with it.
+	auto* occlusion = counters.map(2);
+	if (frames >= decltype(counters)::regions) {
+		stats::record_occluded(occlusion[0], occlusion[1]);
+	}
+	occlusion[0] = 0;
+	occlusion[1] = 0;
+	++frames;
+
+	return positions.map(groups);
+}
+
+void GpuCulling::dispatch(CullPass pass, const glm::mat4& view_proj, const StreamBuffer<DrawCommand>& commands,
+			  const StreamBuffer<std::uint32_t>& draw_ids, GLuint depth_pyramid)
+{
+	if (count == 0) {
+		return;
+	}
+
+	auto frustum = make_frustum(view_proj);
+	glProgramUniform4fv(program, planes_uniform, 6, &frustum.planes[0].x);
+	glProgramUniform1ui(program, count_uniform, static_cast<GLuint>(count));
+	glProgramUniform1ui(program, group_count_uniform, static_cast<GLuint>(groups));
+	glProgramUniform1ui(program, pass_uniform, static_cast<GLuint>(pass));
+	glProgramUniformMatrix4fv(program, view_proj_uniform, 1, GL_FALSE, &view_proj[0][0]);
+
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, instances.id(),
+			  static_cast<GLintptr>(instances.offset()), static_cast<GLsizeiptr>(instances.region_size()));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, positions.id(),
+			  static_cast<GLintptr>(positions.offset()), static_cast<GLsizeiptr>(positions.region_size()));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 4, commands.id(),
+			  static_cast<GLintptr>(commands.offset()), static_cast<GLsizeiptr>(commands.region_size()));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 5, draw_ids.id(),
+			  static_cast<GLintptr>(draw_ids.offset()), static_cast<GLsizeiptr>(draw_ids.region_size()));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 6, visibility.id(),
+			  static_cast<GLintptr>(visibility.offset()), static_cast<GLsizeiptr>(visibility.region_size()));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 7, counters.id(),
+			  static_cast<GLintptr>(counters.offset()), static_cast<GLsizeiptr>(counters.region_size()));
+	glBindTextureUnit(1, depth_pyramid);
+
+	glUseProgram(program);
+	glDispatchCompute(static_cast<GLuint>((count + workgroup_size - 1) / workgroup_size), 1, 1);
+
+	// The results are read as indirect commands and vertex attributes, and
+	// the counters by the CPU through the mapping.
+	GLbitfield barriers = GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT;
+	if (pass == CullPass::OCCLUSION) {
+		barriers |= GL_SHADER_STORAGE_BARRIER_BIT | GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT;
+	}
+	glMemoryBarrier(barriers);
+}
+
+void GpuCulling::fence()
+{
+	positions.fence();
+	counters.fence();
+	instances.fence();
+	visibility.fence();
+}
+
+void GpuCulling::delete_buffer()
+{
+	positions.delete_buffer();
+	counters.delete_buffer();
+	instances.delete_buffer();
+	visibility.delete_buffer();
+}
+
+stats::BufferStats GpuCulling::stats() const
+{
+	auto bounds = instances.stats();
+	auto visible = visibility.stats();
+	return stats::BufferStats {
+		.capacity = bounds.capacity + visible.capacity,
+		.used = bounds.used + visible.used,
+		.free = bounds.free + visible.free,
+		.largest_free = std::max(bounds.largest_free, visible.largest_free),
+		.allocations = 0,
+		.deallocations = 0,
+		.resizes = bounds.resizes + visible.resizes,
+	};
+}
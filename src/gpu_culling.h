@@ -0,0 +1,95 @@
+#pragma once
+
+#include "buffer.h"
+#include "culling.h"
+#include "render_list.h"
+#include "stats.h"
+
+#include <glad/gl.h>
+#include <glm/mat4x4.hpp>
+#include <glm/vec4.hpp>
+
+#include <cstdint>
+
+enum class CullingMode { CPU, GPU, GPU_OCCLUSION };
+
+enum class CullPass : GLuint {
+	FRUSTUM = 0,		// frustum only, without occlusion culling
+	LAST_VISIBLE = 1,	// instances visible last frame
+	OCCLUSION = 2,		// everything else, against the depth pyramid
+};
+
+/// Culls the RenderList with a compute shader instead of on the CPU, which
+/// keeps the cost of culling off the CPU for scenes with a very large number
+/// of instances.
+///
+/// The bounds of every instance are uploaded with `update` whenever the render
+/// list is compiled, into the next region of a StreamBuffer so the dispatches
+/// of frames in flight keep reading theirs. What is visible for occlusion
+/// culling moves to a new region along with them. Each frame, the commands are written in sorted order with
+/// no instances through `RenderList::write_unculled`, along with where the
+/// command of each group ended up. `dispatch` then runs one invocation per
+/// instance, and each instance inside the frustum atomically increments the
+/// instance count of its command and writes the index of its DrawData into the
+/// next slot of the draw ids.
+///
+/// GL 4.5 has no glMultiDrawElementsIndirectCount, so culled commands are not
+/// compacted away but left with no instances, which the GPU skips. This also
+/// keeps the batches the CPU built valid. Since the results stay on the GPU,
+/// nothing is added to the culled stats.
+///
+/// Occlusion culling takes two passes over two copies of the commands. The
+/// first draws what was visible last frame, which is then used to build a
+/// DepthPyramid. The second tests the bounds of every instance against it,
+/// draws the ones which became visible and keeps track of what is visible for
+/// the next frame. The number of instances and triangles it removed is read
+/// back once the GPU is done with the frame, so the stats lag a few frames
+/// behind.
+class GpuCulling {
+public:
+	GpuCulling() {}
+	GpuCulling(GLuint program);
+
+	// Uploads the bounds of every instance of the render list, and marks
+	// them all as visible.
+	void update(const RenderList& render_list);
+	// Call once per frame before dispatching, returns where to write the
+	// command position of each group.
+	std::uint32_t* begin_frame(std::size_t groups);
+	// Fills in the instance counts of the current region of `commands` and
+	// the draw ids of the current region of `draw_ids`. Leaves the cull
+	// program in use.
+	void dispatch(CullPass pass, const glm::mat4& view_proj, const StreamBuffer<DrawCommand>& commands,
+		      const StreamBuffer<std::uint32_t>& draw_ids, GLuint depth_pyramid = 0);
+	// Call after the last draw which reads the results.
+	void fence();
+	void delete_buffer();
+	stats::BufferStats stats() const;
+private:
+	// Laid out for std430
+	struct Instance {
+		glm::vec4 bounds_min;
+		glm::vec4 bounds_max;
+		std::uint32_t draw_id;
+		std::uint32_t group;
+		std::uint32_t padding[2];
+	};
+
+	GLuint program {0};
+	GLint planes_uniform {-1};
+	GLint count_uniform {-1};
+	GLint group_count_uniform {-1};
+	GLint pass_uniform {-1};
+	GLint view_proj_uniform {-1};
+
+	// Only moved to their next region by `update`
+	StreamBuffer<Instance> instances;
+	StreamBuffer<std::uint32_t> visibility;
+	std::size_t count {0};
+	std::size_t groups {0};
+
+	StreamBuffer<std::uint32_t> positions;
+	// Occluded instances and triangles of each region
+	StreamBuffer<std::uint32_t> counters;
+	std::size_t frames {0};
+};
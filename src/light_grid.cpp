@@ -0,0 +1,134 @@
+#include "light_grid.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+static constexpr GLuint workgroup_size = 64;
+static constexpr std::size_t clusters = LightGrid::grid_x * LightGrid::grid_y * LightGrid::grid_z;
+
+LightGrid::LightGrid(GLuint program) : program(program)
+{
+	view_uniform = glGetUniformLocation(program, "view");
+	inverse_projection_uniform = glGetUniformLocation(program, "inverse_projection");
+	depth_range_uniform = glGetUniformLocation(program, "depth_range");
+	light_count_uniform = glGetUniformLocation(program, "light_count");
+
+	glCreateBuffers(1, &count_buffer);
+	glNamedBufferStorage(count_buffer, static_cast<GLsizeiptr>(clusters * sizeof(std::uint32_t)), nullptr, 0);
+	glCreateBuffers(1, &index_buffer);
+	glNamedBufferStorage(index_buffer, static_cast<GLsizeiptr>(clusters * max_cluster_lights * sizeof(std::uint32_t)),
+			     nullptr, 0);
+}
+
+float LightGrid::radius(const Light& light)
+{
+	// Where the intensity falls below the cutoff with the inverse square
+	// falloff, unless the light has a range of its own.
+	if (light.range > 0.0f) {
+		return light.range;
+	}
+	auto brightest = light.intensity * std::max({ light.color.x, light.color.y, light.color.z });
+	return std::sqrt(std::max(brightest, 0.0f) / cutoff);
+}
+
+void LightGrid::update(const std::vector<Light>& lights)
+{
+	std::vector<LightData> data;
+	data.reserve(lights.size());
+	for (const auto& light : lights) {
+		data.push_back(LightData {
+			.position_radius = glm::vec4(light.position, radius(light)),
+			.direction_range = glm::vec4(light.direction, light.range),
+			.color_intensity = glm::vec4(light.color, light.intensity),
+			.cone_type = glm::vec4(light.inner_cone, light.outer_cone, static_cast<float>(light.type), 0.0f),
+		});
+	}
+	count = data.size();
+
+	if (count > capacity || light_buffer == 0) {
+		if (light_buffer != 0) {
+			glDeleteBuffers(1, &light_buffer);
+			++resizes;
+		}
+		capacity = std::max<std::size_t>(64, capacity);
+		while (capacity < count) {
+			capacity *= 2;
+		}
+		glCreateBuffers(1, &light_buffer);
+		glNamedBufferStorage(light_buffer, static_cast<GLsizeiptr>(capacity * sizeof(LightData)), nullptr,
+				     GL_DYNAMIC_STORAGE_BIT);
+		stats::record_event(stats::EventType::RESIZE, "lights", capacity * sizeof(LightData));
+	}
+	if (count > 0) {
+		glNamedBufferSubData(light_buffer, 0, static_cast<GLsizeiptr>(count * sizeof(LightData)), data.data());
+		stats::record_upload(count * sizeof(LightData));
+	}
+}
+
+void LightGrid::build(const glm::mat4& view, const glm::mat4& projection, float z_near, float z_far)
+{
+	if (count == 0) {
+		return;
+	}
+
+	auto inverse_projection = glm::inverse(projection);
+	glProgramUniformMatrix4fv(program, view_uniform, 1, GL_FALSE, &view[0][0]);
+	glProgramUniformMatrix4fv(program, inverse_projection_uniform, 1, GL_FALSE, &inverse_projection[0][0]);
+	glProgramUniform2f(program, depth_range_uniform, z_near, z_far);
+	glProgramUniform1ui(program, light_count_uniform, static_cast<GLuint>(count));
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, light_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, count_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, index_buffer);
+
+	glUseProgram(program);
+	glDispatchCompute(static_cast<GLuint>((clusters + workgroup_size - 1) / workgroup_size), 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void LightGrid::bind(GLuint shading_program, const glm::vec3& camera, int width, int height, float z_near,
+		     float z_far) const
+{
+	// No lights leaves the shading unlit
+	glProgramUniform1ui(shading_program, 11, static_cast<GLuint>(count));
+	if (count == 0) {
+		return;
+	}
+	glProgramUniform3f(shading_program, 10, camera.x, camera.y, camera.z);
+	glProgramUniform2f(shading_program, 12, static_cast<float>(width), static_cast<float>(height));
+	glProgramUniform2f(shading_program, 13, z_near, z_far);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, light_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, count_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, index_buffer);
+}
+
+std::size_t LightGrid::size() const
+{
+	return count;
+}
+
+void LightGrid::delete_buffer()
+{
+	glDeleteBuffers(1, &light_buffer);
+	glDeleteBuffers(1, &count_buffer);
+	glDeleteBuffers(1, &index_buffer);
+}
+
+stats::BufferStats LightGrid::stats() const
+{
+	auto grid_bytes = clusters * (1 + max_cluster_lights) * sizeof(std::uint32_t);
+	auto bytes = capacity * sizeof(LightData) + grid_bytes;
+	auto used = count * sizeof(LightData) + grid_bytes;
+	return stats::BufferStats {
+		.capacity = bytes,
+		.used = used,
+		.free = bytes - used,
+		.largest_free = bytes - used,
+		.allocations = 0,
+		.deallocations = 0,
+		.resizes = resizes,
+	};
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "gltf.h"
+#include "stats.h"
+
+#include <glad/gl.h>
+#include <glm/mat4x4.hpp>
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Assigns the lights of the scene to clusters of the view frustum, so each
+/// fragment only shades the lights which can reach it instead of every light
+/// of the scene.
+///
+/// The frustum is split into `grid_x` by `grid_y` tiles on screen, and each
+/// tile into `grid_z` slices along the depth. Slices grow exponentially with
+/// the distance, which keeps clusters about as deep as they are wide. A
+/// compute shader runs one invocation per cluster every frame, builds the
+/// bounds of the cluster in view space and tests them against the sphere of
+/// influence of every light. Directional lights reach every cluster. Each
+/// cluster keeps up to `max_cluster_lights` lights, any more are dropped.
+///
+/// The lights are uploaded with `update` whenever they change, in world
+/// space. Lights without a range are given one where their intensity falls
+/// below `cutoff`, the glTF leaves it to the renderer.
+class LightGrid {
+public:
+	// These must match the fragment and cluster shaders
+	static constexpr std::uint32_t grid_x = 16;
+	static constexpr std::uint32_t grid_y = 9;
+	static constexpr std::uint32_t grid_z = 24;
+	static constexpr std::uint32_t max_cluster_lights = 128;
+	static constexpr float cutoff = 0.01f;
+
+	LightGrid() {}
+	LightGrid(GLuint program);
+
+	// Distance past which the light is too dim to matter.
+	static float radius(const Light& light);
+
+	void update(const std::vector<Light>& lights);
+	// Assigns the lights to the clusters of the view. Leaves the cluster
+	// program in use.
+	void build(const glm::mat4& view, const glm::mat4& projection, float z_near, float z_far);
+	// Binds the lights and clusters, and sets the uniforms the fragment
+	// shader needs to find its cluster on `shading_program`.
+	void bind(GLuint shading_program, const glm::vec3& camera, int width, int height, float z_near,
+		  float z_far) const;
+	std::size_t size() const;
+	void delete_buffer();
+	stats::BufferStats stats() const;
+private:
+	// Laid out for std430
+	struct LightData {
+		glm::vec4 position_radius;	// radius of influence, for culling
+		glm::vec4 direction_range;	// range is 0 when unbounded
+		glm::vec4 color_intensity;
+		glm::vec4 cone_type;		// cosines of the cone angles, and type
+	};
+
+	GLuint program {0};
+	GLint view_uniform {-1};
+	GLint inverse_projection_uniform {-1};
+	GLint depth_range_uniform {-1};
+	GLint light_count_uniform {-1};
+
+	GLuint light_buffer {0};
+	GLuint count_buffer {0};
+	GLuint index_buffer {0};
+	std::size_t capacity {0};	// in lights
+	std::size_t count {0};
+	std::size_t resizes {0};
+};
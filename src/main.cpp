@@ -4,6 +4,7 @@
 #include "renderer.h"
 #include "scene.h"
 #include "shaders.h"
+#include "stats.h"
 
 #include <glad/gl.h>
 #define GLFW_INCLUDE_NONE
@@ -85,15 +86,11 @@ int main(int argc, char** argv)
 	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
 	glDebugMessageCallback(opengl_error_callback, nullptr);
 
-	// add "./" in front of the path
-	auto file = std::string_view { argv[1] };
-	auto gltf = std::make_shared<LoadedGLTF>(load_gltf(file));
-	auto file2 = std::string_view { argv[2] };
-	auto gltf2 = std::make_shared<LoadedGLTF>(load_gltf(file2));
-
 	auto program = compile_program();
 	auto renderer = Renderer(*program);
 	renderer.update_window(640, 480);
+	// Geometry and pixels are only needed until they are on the GPU
+	renderer.set_cpu_residency(CpuResidency::RELEASE);
 
 	input::ActionSet main(
 		ActionSets::DEFAULT,
@@ -170,15 +167,25 @@ int main(int argc, char** argv)
 	glfwSetKeyCallback(window, key_callback);
 	glfwSetCursorPosCallback(window, mouse_callback);
 
-	auto scene = Scene();
-	glm::mat4 model = glm::mat4(1);
-	glm::vec3 scale = glm::vec3(0.001f, 0.001f, 0.001f);
-	Node node = Node(gltf, glm::scale(model, scale));
-	Node node2 = Node(gltf2, glm::translate(glm::mat4(1.0f), glm::vec3(5.0f, 5.0f, 5.0f)));
-	scene.nodes.push_back(node);
-	scene.nodes.push_back(node2);
-
-	renderer.update_scene(scene);
+	// The renderer keeps the glTFs alive through the nodes, there is no
+	// need to hold on to them here.
+	{
+		// add "./" in front of the path
+		auto file = std::string_view { argv[1] };
+		auto gltf = std::make_shared<LoadedGLTF>(load_gltf(file));
+		auto file2 = std::string_view { argv[2] };
+		auto gltf2 = std::make_shared<LoadedGLTF>(load_gltf(file2));
+
+		auto scene = Scene();
+		glm::mat4 model = glm::mat4(1);
+		glm::vec3 scale = glm::vec3(0.001f, 0.001f, 0.001f);
+		Node node = Node(gltf, glm::scale(model, scale));
+		Node node2 = Node(gltf2, glm::translate(glm::mat4(1.0f), glm::vec3(5.0f, 5.0f, 5.0f)));
+		scene.nodes.push_back(node);
+		scene.nodes.push_back(node2);
+
+		renderer.update_scene(scene);
+	}
 	// renderer.camera.set_position(glm::vec3(0.0f, -400.0f, 0.0f));
 
 	// TODO: could be better
@@ -209,6 +216,10 @@ int main(int argc, char** argv)
 	//                buffer + (width * 4 * (height - 1)),
 	//                -width * 4);
 
+	if (!stats::write_json("stats.json", renderer.collect_stats())) {
+		std::cerr << "Failed to write stats.json\n";
+	}
+
 	glDeleteProgram(*program);
 	glfwDestroyWindow(window);
 
@@ -0,0 +1,162 @@
+#include "meshlet.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+
+static constexpr std::uint32_t no_meshlet = static_cast<std::uint32_t>(-1);
+
+// Bounding sphere and normal cone of the triangles of a meshlet.
+static void compute_bounds(Meshlet& meshlet, const Vertex* vertices, const std::uint32_t* indices)
+{
+	glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+	for (auto i = meshlet.first_index; i < meshlet.first_index + meshlet.index_count; ++i) {
+		min = glm::min(min, vertices[indices[i]].pos);
+		max = glm::max(max, vertices[indices[i]].pos);
+	}
+	meshlet.center = (min + max) * 0.5f;
+	meshlet.radius = 0.0f;
+	for (auto i = meshlet.first_index; i < meshlet.first_index + meshlet.index_count; ++i) {
+		meshlet.radius = std::max(meshlet.radius, glm::length(vertices[indices[i]].pos - meshlet.center));
+	}
+
+	glm::vec3 normals[max_meshlet_triangles];
+	std::size_t count = 0;
+	glm::vec3 sum(0.0f);
+	for (auto i = meshlet.first_index; i < meshlet.first_index + meshlet.index_count; i += 3) {
+		const auto& p0 = vertices[indices[i]].pos;
+		auto normal = glm::cross(vertices[indices[i + 1]].pos - p0, vertices[indices[i + 2]].pos - p0);
+		auto length = glm::length(normal);
+		// Degenerate triangles cannot be seen either way
+		if (length > 0.0f) {
+			normals[count++] = normal / length;
+			sum += normal / length;
+		}
+	}
+
+	meshlet.cone_axis = glm::vec3(0.0f, 0.0f, 1.0f);
+	meshlet.cone_cutoff = 1.0f;
+	auto length = glm::length(sum);
+	if (count == 0 || length < 1e-6f) {
+		return;
+	}
+	meshlet.cone_axis = sum / length;
+	auto min_dot = 1.0f;
+	for (std::size_t i = 0; i < count; ++i) {
+		min_dot = std::min(min_dot, glm::dot(normals[i], meshlet.cone_axis));
+	}
+	// A cone of 90 degrees or more always has a triangle facing the camera
+	if (min_dot > 0.0f) {
+		meshlet.cone_cutoff = std::sqrt(1.0f - min_dot * min_dot);
+	}
+}
+
+std::vector<Meshlet> build_meshlets(const Vertex* vertices, std::size_t vertex_count,
+				    std::uint32_t* indices, std::size_t index_count)
+{
+	auto triangle_count = index_count / 3;
+
+	// Vertex to triangle adjacency, the triangles of each vertex are in
+	// the range given by its offset.
+	std::vector<std::uint32_t> offsets(vertex_count + 1, 0);
+	for (std::size_t i = 0; i < triangle_count * 3; ++i) {
+		++offsets[indices[i] + 1];
+	}
+	std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+	std::vector<std::uint32_t> adjacency(triangle_count * 3);
+	std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+	for (std::size_t i = 0; i < triangle_count * 3; ++i) {
+		adjacency[fill[indices[i]]++] = static_cast<std::uint32_t>(i / 3);
+	}
+
+	std::vector<Meshlet> meshlets;
+	std::vector<std::uint8_t> used(triangle_count, 0);
+	std::vector<std::uint32_t> meshlet_of(vertex_count, no_meshlet);
+	std::vector<std::uint32_t> order;	// triangles in meshlet order
+	order.reserve(triangle_count);
+	std::vector<std::uint32_t> queue;
+
+	for (std::size_t seed = 0; seed < triangle_count; ++seed) {
+		if (used[seed]) {
+			continue;
+		}
+		auto id = static_cast<std::uint32_t>(meshlets.size());
+		auto first = order.size();
+		std::size_t vertices_used = 0;
+
+		queue.clear();
+		queue.push_back(static_cast<std::uint32_t>(seed));
+		for (std::size_t head = 0; head < queue.size() && order.size() - first < max_meshlet_triangles; ++head) {
+			auto triangle = queue[head];
+			if (used[triangle]) {
+				continue;
+			}
+			const auto* corners = &indices[triangle * 3];
+			std::size_t added = 0;
+			for (int k = 0; k < 3; ++k) {
+				bool repeated = (k > 0 && corners[k] == corners[0]) || (k > 1 && corners[k] == corners[1]);
+				added += meshlet_of[corners[k]] != id && !repeated ? 1 : 0;
+			}
+			// Left for a later meshlet
+			if (vertices_used + added > max_meshlet_vertices) {
+				continue;
+			}
+
+			vertices_used += added;
+			used[triangle] = 1;
+			order.push_back(triangle);
+			for (int k = 0; k < 3; ++k) {
+				meshlet_of[corners[k]] = id;
+				for (auto i = offsets[corners[k]]; i < offsets[corners[k] + 1]; ++i) {
+					if (!used[adjacency[i]]) {
+						queue.push_back(adjacency[i]);
+					}
+				}
+			}
+		}
+
+		Meshlet meshlet {};
+		meshlet.first_index = static_cast<std::uint32_t>(first * 3);
+		meshlet.index_count = static_cast<std::uint32_t>((order.size() - first) * 3);
+		meshlets.push_back(meshlet);
+	}
+
+	std::vector<std::uint32_t> reordered;
+	reordered.reserve(triangle_count * 3);
+	for (auto triangle : order) {
+		reordered.insert(reordered.end(), indices + triangle * 3, indices + triangle * 3 + 3);
+	}
+	std::copy(reordered.begin(), reordered.end(), indices);
+
+	for (auto& meshlet : meshlets) {
+		compute_bounds(meshlet, vertices, indices);
+	}
+	return meshlets;
+}
+
+bool meshlet_visible(const Meshlet& meshlet, const glm::vec4* planes, const glm::vec3& camera, bool test_cone)
+{
+	// The planes are not normalized once moved into the space of the mesh
+	for (int i = 0; i < 6; ++i) {
+		auto normal = glm::vec3(planes[i]);
+		if (glm::dot(normal, meshlet.center) + planes[i].w < -meshlet.radius * glm::length(normal)) {
+			return false;
+		}
+	}
+
+	// Every triangle faces away when every direction from the camera to
+	// the sphere is within 90 degrees minus the half angle of the cone
+	// from its axis.
+	if (test_cone && meshlet.cone_cutoff < 1.0f) {
+		auto to_center = meshlet.center - camera;
+		auto distance = glm::length(to_center);
+		if (glm::dot(to_center, meshlet.cone_axis)
+		    >= distance * meshlet.cone_cutoff + meshlet.radius * (1.0f + meshlet.cone_cutoff)) {
+			return false;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "gltf.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+constexpr std::size_t max_meshlet_vertices = 64;
+constexpr std::size_t max_meshlet_triangles = 128;
+
+/// Splits an indexed triangle list into meshlets of up to
+/// `max_meshlet_triangles` triangles using up to `max_meshlet_vertices`
+/// vertices.
+///
+/// Each meshlet grows from the first triangle not in a meshlet yet, adding
+/// the triangles sharing a vertex with it breadth first, so it stays a
+/// compact patch of the surface. The triangles are reordered in `indices` so
+/// that the ones of each meshlet are contiguous, which keeps the first index
+/// of each meshlet relative to `indices`.
+std::vector<Meshlet> build_meshlets(const Vertex* vertices, std::size_t vertex_count,
+				    std::uint32_t* indices, std::size_t index_count);
+
+// Whether the meshlet is at least partly inside the frustum and has a
+// triangle facing the camera. Both must be in the space of the mesh, and the
+// cone test must be skipped for transforms which mirror the mesh.
+bool meshlet_visible(const Meshlet& meshlet, const glm::vec4* planes, const glm::vec3& camera, bool test_cone);
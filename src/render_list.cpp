@@ -0,0 +1,434 @@
+#include "render_list.h"
+#include "meshlet.h"
+
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+#include <glm/matrix.hpp>
+#include <glm/vec4.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+
+static constexpr int texture_bits = 20;
+static constexpr int material_bits = 16;
+static constexpr int depth_bits = 24;
+
+// Below this, testing every instance is faster than walking a tree.
+static constexpr std::size_t bvh_min_instances = 256;
+
+static constexpr int coarse_depth_bits = 8;
+
+static constexpr std::uint64_t depth_mask = (std::uint64_t{1} << depth_bits) - 1;
+
+// Everything but the depth, which changes with the camera. Values too large
+// for their field are wrapped, which only makes the sort less effective.
+static std::uint64_t state_key(GLuint texture, std::uint32_t material)
+{
+	auto field = [](std::uint64_t value, int bits) {
+		return value & ((std::uint64_t{1} << bits) - 1);
+	};
+	return (field(texture, texture_bits) << (material_bits + depth_bits))
+		| (field(material, material_bits) << depth_bits);
+}
+
+// Moves the top bits of the depth above the texture and material, see
+// DrawOrder::FRONT_TO_BACK.
+static std::uint64_t front_to_back_key(std::uint64_t state, std::uint64_t depth)
+{
+	constexpr int fine_bits = depth_bits - coarse_depth_bits;
+	constexpr int state_bits = texture_bits + material_bits;
+	auto texture_material = (state >> depth_bits) & ((std::uint64_t{1} << state_bits) - 1);
+	return ((depth >> fine_bits) << (state_bits + fine_bits))
+		| (texture_material << fine_bits)
+		| (depth & ((std::uint64_t{1} << fine_bits) - 1));
+}
+
+bool RenderList::GroupKey::operator==(const GroupKey& other) const
+{
+	return count == other.count && first_index == other.first_index
+		&& base_vertex == other.base_vertex && material == other.material
+		&& texture == other.texture;
+}
+
+std::size_t RenderList::GroupHash::operator()(const GroupKey& key) const
+{
+	std::size_t hash = 0;
+	for (std::size_t value : { key.count, key.first_index, key.base_vertex, key.material, key.texture }) {
+		hash ^= std::hash<std::size_t>{}(value) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+	}
+	return hash;
+}
+
+void RenderList::compile(const CommandBuffer& command_buffer)
+{
+	indirect.clear();
+	materials.clear();
+	textures.clear();
+	states.clear();
+	keys.clear();
+	first_instance.clear();
+	instance_count.clear();
+	visible_count.clear();
+	lods.clear();
+	scales.clear();
+	distances.clear();
+	selected_lod.clear();
+	meshlets.clear();
+	order.clear();
+	instances.clear();
+	transforms.clear();
+	bounds.clear();
+	caster_bounds.reset();
+	visible.clear();
+	batches.clear();
+	groups.clear();
+	group_of.clear();
+
+	const auto& all_commands = command_buffer.get_commands();
+	const auto& all_draws = command_buffer.get_draws();
+	const auto& all_textures = command_buffer.get_textures();
+	const auto& all_bounds = command_buffer.get_bounds();
+	const auto& all_lods = command_buffer.get_lods();
+	const auto& all_meshlets = command_buffer.get_meshlets();
+
+	// Find the group of every command and count the instances of each.
+	for (std::size_t i = 0; i < all_commands.size(); ++i) {
+		const auto& command = all_commands[i];
+		if (command.count == 0) {
+			continue;
+		}
+
+		auto texture = all_textures[i];
+		auto material = all_draws[i].material;
+		GroupKey key { command.count, command.first_index, command.base_vertex, material, texture };
+		auto [it, inserted] = groups.try_emplace(key, static_cast<std::uint32_t>(indirect.size()));
+		if (inserted) {
+			order.push_back(it->second);
+			indirect.push_back(command);
+			materials.push_back(material);
+			textures.push_back(texture);
+			states.push_back(state_key(texture, material));
+			keys.push_back(states.back());
+			instance_count.push_back(0);
+			lods.push_back(all_lods[i]);
+			meshlets.push_back(all_meshlets[i]);
+			scales.push_back(0.0f);
+		}
+		group_of.push_back(it->second);
+		++instance_count[it->second];
+	}
+
+	// Lay the instances of each group out contiguously.
+	std::uint32_t total = 0;
+	for (auto count : instance_count) {
+		first_instance.push_back(total);
+		total += count;
+	}
+	instances.resize(total);
+	transforms.resize(total);
+	bounds.resize(total);
+	std::fill(instance_count.begin(), instance_count.end(), 0);
+	std::size_t live = 0;
+	for (std::size_t i = 0; i < all_commands.size(); ++i) {
+		if (all_commands[i].count == 0) {
+			continue;
+		}
+		auto group = group_of[live++];
+		auto instance = first_instance[group] + instance_count[group]++;
+		instances[instance] = static_cast<std::uint32_t>(i);
+		transforms[instance] = all_draws[i].model;
+		auto world = transform_bounds(all_bounds[i], all_draws[i].model);
+		bounds.set(instance, world);
+		if (caster_bounds) {
+			caster_bounds->min = glm::min(caster_bounds->min, world.min);
+			caster_bounds->max = glm::max(caster_bounds->max, world.max);
+		} else {
+			caster_bounds = world;
+		}
+
+		const auto& model = all_draws[i].model;
+		auto scale = std::max({ glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[1])),
+					glm::length(glm::vec3(model[2])) });
+		scales[group] = std::max(scales[group], scale);
+	}
+	distances.assign(indirect.size(), 0.0f);
+	selected_lod.assign(indirect.size(), 0);
+	first_range.assign(indirect.size(), no_ranges);
+	range_count.assign(indirect.size(), 0);
+	ranges.clear();
+
+	bvh.clear();
+	if (total >= bvh_min_instances) {
+		std::vector<std::pair<std::uint32_t, Bounds>> items(total);
+		for (std::uint32_t i = 0; i < total; ++i) {
+			items[i] = { i, Bounds {
+				glm::vec3(bounds.min_x[i], bounds.min_y[i], bounds.min_z[i]),
+				glm::vec3(bounds.max_x[i], bounds.max_y[i], bounds.max_z[i]),
+			} };
+		}
+		bvh.build(items);
+	}
+
+	// Everything is visible until culled.
+	visible.assign(total, 1);
+	visible_count = instance_count;
+	visible_groups = indirect.size();
+	visible_instances = total;
+	visible_commands = visible_groups;
+}
+
+std::size_t RenderList::cull(const Frustum& frustum)
+{
+	if (bvh.empty()) {
+		visible_instances = cull_frustum(frustum, bounds, visible.data());
+	} else {
+		visible_items.clear();
+		bvh.cull(frustum, visible_items);
+		std::fill(visible.begin(), visible.end(), 0);
+		for (auto instance : visible_items) {
+			visible[instance] = 1;
+		}
+		visible_instances = visible_items.size();
+	}
+
+	visible_groups = 0;
+	for (std::size_t group = 0; group < indirect.size(); ++group) {
+		auto first = visible.begin() + first_instance[group];
+		visible_count[group] = static_cast<std::uint32_t>(std::count(first, first + instance_count[group], 1));
+		visible_groups += visible_count[group] > 0 ? 1 : 0;
+	}
+	// Meshlets are culled again after the levels are selected.
+	std::fill(first_range.begin(), first_range.end(), no_ranges);
+	visible_commands = visible_groups;
+	return instances.size() - visible_instances;
+}
+
+void RenderList::sort(const glm::mat4& view, float far, DrawOrder draw_order)
+{
+	// Depth of the origin of the transforms, which is cheap and good enough
+	// to order draws sharing the same state. Levels of detail need the
+	// closest point of the bounds instead, the origin of a large mesh can
+	// be far away while its surface is right in front of the camera.
+	auto camera = glm::vec3(glm::inverse(view)[3]);
+	for (std::size_t group = 0; group < keys.size(); ++group) {
+		auto nearest = std::numeric_limits<float>::max();
+		auto closest = std::numeric_limits<float>::max();
+		auto first = first_instance[group];
+		for (auto i = first; i < first + instance_count[group]; ++i) {
+			if (visible[i]) {
+				nearest = std::min(nearest, -(view * transforms[i][3]).z);
+				auto outside = glm::vec3(
+					std::max({ bounds.min_x[i] - camera.x, 0.0f, camera.x - bounds.max_x[i] }),
+					std::max({ bounds.min_y[i] - camera.y, 0.0f, camera.y - bounds.max_y[i] }),
+					std::max({ bounds.min_z[i] - camera.z, 0.0f, camera.z - bounds.max_z[i] }));
+				closest = std::min(closest, glm::dot(outside, outside));
+			}
+		}
+		distances[group] = std::sqrt(closest);
+		auto depth = std::clamp(nearest / far, 0.0f, 1.0f);
+		auto quantized = static_cast<std::uint64_t>(depth * static_cast<float>(depth_mask));
+		keys[group] = draw_order == DrawOrder::STATE ? states[group] | quantized
+			: front_to_back_key(states[group], quantized);
+	}
+
+	// Histograms of all digits are counted in a single pass over the keys.
+	constexpr int digits = sizeof(std::uint64_t);
+	std::array<std::array<std::uint32_t, 256>, digits> histograms {};
+	for (auto key : keys) {
+		for (int d = 0; d < digits; ++d) {
+			++histograms[d][(key >> (d * 8)) & 0xff];
+		}
+	}
+
+	scratch.resize(order.size());
+	for (int d = 0; d < digits; ++d) {
+		auto& histogram = histograms[d];
+		// Every key has the same digit, so the pass would not move anything.
+		if (std::find(histogram.begin(), histogram.end(), order.size()) != histogram.end()) {
+			continue;
+		}
+
+		std::uint32_t sum = 0;
+		for (auto& count : histogram) {
+			auto start = sum;
+			sum += count;
+			count = start;
+		}
+		for (auto group : order) {
+			scratch[histogram[(keys[group] >> (d * 8)) & 0xff]++] = group;
+		}
+		order.swap(scratch);
+	}
+
+	build_batches();
+}
+
+// Batches are over the commands which are written, so groups which were
+// culled entirely are skipped, and groups culled by meshlet span a command
+// per range.
+void RenderList::build_batches()
+{
+	batches.clear();
+	std::size_t position = 0;
+	for (auto group : order) {
+		if (visible_count[group] == 0) {
+			continue;
+		}
+		std::size_t count = first_range[group] == no_ranges ? 1 : range_count[group];
+		if (count == 0) {
+			continue;
+		}
+		auto texture = textures[group];
+		if (!batches.empty() && batches.back().texture == texture) {
+			batches.back().count += count;
+		} else {
+			batches.push_back(Batch{ texture, position, count });
+		}
+		position += count;
+	}
+}
+
+void RenderList::select_lods(float pixels_per_unit, float threshold)
+{
+	visible_triangles = 0;
+	for (std::size_t group = 0; group < indirect.size(); ++group) {
+		const auto& chain = lods[group];
+		// Anything around the camera keeps every detail
+		auto distance = distances[group];
+		std::uint8_t level = 0;
+		if (distance > 0.0f) {
+			auto pixels_per_error = scales[group] * pixels_per_unit / distance;
+			while (level + 1u < chain.count && chain.levels[level + 1].error * pixels_per_error <= threshold) {
+				++level;
+			}
+		}
+		selected_lod[group] = level;
+		visible_triangles += std::size_t{visible_count[group]} * chain.levels[level].index_count / 3;
+	}
+}
+
+std::size_t RenderList::cull_clusters(const Frustum& frustum, const glm::vec3& camera)
+{
+	ranges.clear();
+	std::size_t culled = 0;
+	for (std::size_t group = 0; group < indirect.size(); ++group) {
+		first_range[group] = no_ranges;
+		if (meshlets[group].count == 0 || visible_count[group] != 1 || selected_lod[group] != 0) {
+			continue;
+		}
+		auto first = first_instance[group];
+		auto instance = static_cast<std::uint32_t>(
+			std::find(visible.begin() + first, visible.begin() + first + instance_count[group], 1) - visible.begin());
+
+		// The meshlets are tested in the space of the mesh, the planes
+		// are moved there by the transpose of the transform.
+		const auto& model = transforms[instance];
+		auto transpose = glm::transpose(model);
+		glm::vec4 planes[6];
+		for (int i = 0; i < 6; ++i) {
+			planes[i] = transpose * frustum.planes[i];
+		}
+		auto local_camera = glm::vec3(glm::inverse(model) * glm::vec4(camera, 1.0f));
+		// A mirrored mesh has its triangles wound the other way.
+		bool test_cone = glm::determinant(glm::mat3(model)) > 0.0f;
+
+		visible_triangles -= indirect[group].count / 3;
+		first_range[group] = static_cast<std::uint32_t>(ranges.size());
+		range_count[group] = 0;
+		const auto& range = meshlets[group];
+		for (std::uint32_t i = 0; i < range.count; ++i) {
+			const auto& meshlet = range.gltf->meshlets[range.first_meshlet + i];
+			if (!meshlet_visible(meshlet, planes, local_camera, test_cone)) {
+				++culled;
+				continue;
+			}
+			auto first_index = indirect[group].first_index + meshlet.first_index;
+			if (range_count[group] > 0 && ranges.back().first_index + ranges.back().count == first_index) {
+				ranges.back().count += meshlet.index_count;
+			} else {
+				ranges.push_back(IndexRange{ first_index, meshlet.index_count });
+				++range_count[group];
+			}
+			visible_triangles += meshlet.index_count / 3;
+		}
+		// The ranges replace the single command of the group
+		visible_commands = visible_commands - 1 + range_count[group];
+	}
+
+	build_batches();
+	return culled;
+}
+
+// The command of a group with the indices of its selected level.
+static DrawCommand lod_command(DrawCommand command, const Lod& lod)
+{
+	command.first_index = lod.first_index;
+	command.count = lod.index_count;
+	return command;
+}
+
+void RenderList::write(DrawCommand* commands, std::uint32_t* draw_ids) const
+{
+	std::uint32_t written = 0;
+	for (auto group : order) {
+		if (visible_count[group] == 0) {
+			continue;
+		}
+		auto command = lod_command(indirect[group], lods[group].levels[selected_lod[group]]);
+		command.instance_count = visible_count[group];
+		command.base_instance = written;
+		if (first_range[group] == no_ranges) {
+			*commands++ = command;
+		} else {
+			for (auto i = first_range[group]; i < first_range[group] + range_count[group]; ++i) {
+				command.first_index = ranges[i].first_index;
+				command.count = ranges[i].count;
+				*commands++ = command;
+			}
+		}
+
+		auto first = first_instance[group];
+		for (auto i = first; i < first + instance_count[group]; ++i) {
+			if (visible[i]) {
+				*draw_ids++ = instances[i];
+			}
+		}
+		written += visible_count[group];
+	}
+}
+
+void RenderList::write_unculled(DrawCommand* commands, std::uint32_t* positions, std::size_t copies) const
+{
+	std::uint32_t written = 0;
+	for (std::size_t copy = 0; copy < copies; ++copy) {
+		std::uint32_t position = 0;
+		for (auto group : order) {
+			auto command = lod_command(indirect[group], lods[group].levels[selected_lod[group]]);
+			command.instance_count = 0;
+			command.base_instance = written;
+			*commands++ = command;
+			positions[group] = position++;
+			written += instance_count[group];
+		}
+	}
+}
+
+void RenderList::write_casters(DrawCommand* commands, std::uint32_t* draw_ids) const
+{
+	std::uint32_t written = 0;
+	for (std::size_t group = 0; group < indirect.size(); ++group) {
+		auto command = lod_command(indirect[group], lods[group].levels[0]);
+		command.instance_count = instance_count[group];
+		command.base_instance = written;
+		*commands++ = command;
+		written += instance_count[group];
+	}
+	std::copy(instances.begin(), instances.end(), draw_ids);
+}
+
+std::size_t RenderList::size() const
+{
+	return indirect.size();
+}
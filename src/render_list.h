@@ -0,0 +1,188 @@
+#pragma once
+
+#include "buffer.h"
+#include "bvh.h"
+#include "culling.h"
+#include "gltf.h"
+
+#include <glad/gl.h>
+#include <glm/mat4x4.hpp>
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Consecutive commands sharing a texture, drawn with one MultiDraw call.
+struct Batch {
+	GLuint texture;
+	std::size_t first;	// position of the first command in sorted order
+	std::size_t count;
+};
+
+enum class DrawOrder {
+	STATE,		// fewest state changes, front to back within a state
+	FRONT_TO_BACK,	// coarsely front to back first, for the least overdraw
+};
+
+// Indices of consecutive meshlets which passed culling, drawn as one command.
+struct IndexRange {
+	std::uint32_t first_index;
+	std::uint32_t count;
+};
+
+/// A flat list of everything to draw, compiled whenever the scene changes so
+/// that a frame never has to walk the scene, its glTFs and their meshes.
+///
+/// The CommandBuffer already holds a command for every primitive of every
+/// meshnode of every node, so compiling only streams over its arrays, skipping
+/// tombstones. Commands drawing the same indices with the same material and
+/// texture, such as many nodes of the same glTF or many meshnodes of the same
+/// mesh, only differ by their transform, so they are collapsed into a single
+/// group which is drawn as one instanced command.
+///
+/// The data is stored as parallel arrays, one per group and one per instance,
+/// so a pass which only needs part of it, such as sorting by key, only touches
+/// that part. The instances of a group are contiguous, starting at
+/// `first_instance`. `instances` maps an instance back to its command and
+/// DrawData in the CommandBuffer.
+///
+/// The world space bounds of every instance are computed when compiling, since
+/// transforms only change with the scene. Every frame, `cull` tests them
+/// against the view frustum, and instances outside of it are skipped from
+/// then on. Groups without any visible instance are not drawn at all. Large
+/// lists also build a Bvh over the instances, so culling walks it and skips
+/// whole regions of the scene at once, while small lists are cheaper to test
+/// one instance after another.
+///
+/// Then `sort` orders the groups by a 64-bit key built from the
+/// texture, material and view depth, from most to least significant:
+///
+///	| texture 20 | material 16 | depth 24 |
+///
+/// so draws sharing state end up next to each other, and within the same
+/// state they are drawn front to back to help early depth testing. The depth
+/// of a group is the depth of its closest visible instance. Sorting with
+/// `DrawOrder::FRONT_TO_BACK` moves the top bits of the depth up instead,
+///
+///	| depth 8 | texture 20 | material 16 | depth 16 |
+///
+/// which draws the scene front to back in coarse slices, still sorted by state
+/// within each slice. This costs more binds but less overdraw, which matters
+/// when shading is expensive and there is no depth prepass. The keys are radix sorted
+/// 8 bits at a time, and a pass is skipped when every key has the same digit,
+/// which is the case for the high bits most of the time.
+///
+/// Once sorted, `select_lods` picks the level of detail of each group, the
+/// coarsest one whose error projected on screen at the distance of the
+/// closest point of the bounds of its instances is still under a threshold
+/// in pixels. Groups share a level for all
+/// of their instances, which only ever picks a finer level than needed.
+///
+/// Groups with a single visible instance drawn at the first level, such as
+/// large unique parts, can also be culled one meshlet at a time with
+/// `cull_clusters`, which tests the meshlets against the frustum and their
+/// normal cones against the camera. Meshlets are contiguous in the index
+/// buffer, so the ones left are merged into as few ranges as possible and each
+/// range is written as its own command for the same instance. Groups with more
+/// instances keep a single instanced command, as splitting them would cost
+/// more commands than culling their meshlets saves.
+///
+/// The sorted commands are written with `write`, along with the index of the
+/// DrawData of each visible instance. A command's `base_instance` points at its first
+/// index, so the draw id attribute reads the DrawData of every instance in
+/// turn. Batches are the runs of sorted commands sharing a texture which can
+/// be drawn with a single glMultiDrawElementsIndirect, since it is the only
+/// state which changes between draws.
+///
+/// Arrays are cleared rather than freed when compiling, so once their capacity
+/// settles, neither compiling, culling nor sorting allocates.
+struct RenderList {
+	// per group
+	std::vector<DrawCommand> indirect;	// command without instancing
+	std::vector<std::uint32_t> materials;	// index into the material table
+	std::vector<GLuint> textures;
+	std::vector<std::uint64_t> states;	// sort keys without the depth
+	std::vector<std::uint64_t> keys;	// sort keys, set by `sort`
+	std::vector<std::uint32_t> first_instance;
+	std::vector<std::uint32_t> instance_count;
+	std::vector<std::uint32_t> visible_count;	// instances which passed culling
+	std::vector<LodChain> lods;
+	std::vector<float> scales;		// largest scale of the instances
+	std::vector<float> distances;		// from the camera to the closest visible bounds
+	std::vector<std::uint8_t> selected_lod;
+	std::vector<MeshletRange> meshlets;
+	// Ranges of the group after `cull_clusters`, `no_ranges` when it was
+	// not culled by meshlet.
+	std::vector<std::uint32_t> first_range;
+	std::vector<std::uint32_t> range_count;
+	std::vector<std::uint32_t> order;	// groups in sorted order
+
+	// per instance
+	std::vector<std::uint32_t> instances;	// index into CommandBuffer
+	std::vector<glm::mat4> transforms;	// world matrices
+	BoundsArray bounds;			// world bounds
+	std::vector<std::uint8_t> visible;
+	Bvh bvh;				// over instances, empty for small lists
+	// Union of the bounds of every instance, which is what `write_casters`
+	// draws. Empty when there are no instances.
+	std::optional<Bounds> caster_bounds;
+
+	std::vector<IndexRange> ranges;
+
+	// Totals of the last `cull`, which is what `write` writes.
+	std::size_t visible_groups {0};
+	std::size_t visible_instances {0};
+	// Commands `write` writes, one per visible group or per range.
+	std::size_t visible_commands {0};
+	// Triangles of the visible instances at their selected level.
+	std::size_t visible_triangles {0};
+
+	std::vector<Batch> batches;
+
+	void compile(const CommandBuffer& command_buffer);
+	// Returns the number of instances culled.
+	std::size_t cull(const Frustum& frustum);
+	// Sorts the groups by key, using the view to compute their depth.
+	void sort(const glm::mat4& view, float far, DrawOrder draw_order = DrawOrder::STATE);
+	// `pixels_per_unit` is the size in pixels of one unit at a depth of one.
+	void select_lods(float pixels_per_unit, float threshold);
+	// Returns the number of meshlets culled. `camera` is the position of
+	// the camera in world space.
+	std::size_t cull_clusters(const Frustum& frustum, const glm::vec3& camera);
+	// Writes `visible_commands` commands and `visible_instances` draw ids
+	// in sorted order.
+	void write(DrawCommand* commands, std::uint32_t* draw_ids) const;
+	// Writes every group in sorted order with no instances, but with room
+	// for all of them from `base_instance`, to be culled on the GPU.
+	// `positions` receives where the command of each group was written.
+	// Each of the `copies` follows the previous one with its own room.
+	void write_unculled(DrawCommand* commands, std::uint32_t* positions, std::size_t copies = 1) const;
+	// Writes every group with all of its instances at the finest level, in
+	// the order of the groups, for passes which draw the whole scene from
+	// elsewhere than the camera such as shadow maps. Writes `size()`
+	// commands and a draw id for every instance.
+	void write_casters(DrawCommand* commands, std::uint32_t* draw_ids) const;
+	// Number of groups.
+	std::size_t size() const;
+
+	static constexpr std::uint32_t no_ranges = static_cast<std::uint32_t>(-1);
+private:
+	void build_batches();
+
+	// What makes two commands instances of each other.
+	struct GroupKey {
+		std::uint32_t count, first_index, base_vertex, material;
+		GLuint texture;
+
+		bool operator==(const GroupKey& other) const;
+	};
+	struct GroupHash {
+		std::size_t operator()(const GroupKey& key) const;
+	};
+
+	std::unordered_map<GroupKey, std::uint32_t, GroupHash> groups;
+	std::vector<std::uint32_t> group_of;	// group of each live command
+	std::vector<std::uint32_t> scratch;
+	std::vector<std::uint32_t> visible_items;
+};
@@ -1,62 +1,425 @@
 #include "renderer.h"
 
+#include "bake.h"
 #include "gltf.h"
 #include "buffer.h"
+#include "render_list.h"
+#include "shaders.h"
 
 #include <glm/vec3.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
 
-Renderer::Renderer(GLuint program)
+static constexpr float near_plane = 0.1f;
+static constexpr float far_plane = 100.0f;
+static constexpr float fov = 70.0f;
+// Largest error on screen in pixels for a coarser level of detail to be used.
+static constexpr float lod_threshold = 1.0f;
+// Owner of the commands of the baked batches in the CommandBuffer, and
+// name of their geometry in the MeshBuffer.
+static constexpr std::uint32_t baked_owner = static_cast<std::uint32_t>(-1);
+static const std::string baked_geometry = "<baked>";
+// Texture slots the visibility resolve tells apart, the shaders give each
+// slot a material depth which is a multiple of 2^-24.
+static constexpr std::size_t max_material_slots = std::size_t(1) << 24;
+
+Renderer::Renderer(GLuint program) : program(program)
 {
 	glUseProgram(program);
         glCreateVertexArrays(1, &vao);
 
 	glEnableVertexArrayAttrib(vao, 0);
 	glEnableVertexArrayAttrib(vao, 1);
+	glEnableVertexArrayAttrib(vao, 2);
+	glEnableVertexArrayAttrib(vao, 3);
 
 	glVertexArrayAttribFormat(vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, pos));
 	glVertexArrayAttribFormat(vao, 1, 2, GL_FLOAT, GL_FALSE, offsetof(Vertex, uv));
+	glVertexArrayAttribIFormat(vao, 2, 1, GL_UNSIGNED_INT, 0);
+	glVertexArrayAttribFormat(vao, 3, 3, GL_FLOAT, GL_FALSE, offsetof(Vertex, normal));
 
 	glVertexArrayAttribBinding(vao, 0, 0);
 	glVertexArrayAttribBinding(vao, 1, 0);
+	glVertexArrayAttribBinding(vao, 2, 1);
+	glVertexArrayAttribBinding(vao, 3, 0);
+	// The draw id advances once per instance, starting at base_instance,
+	// so each instance of a command reads its own DrawData
+	glVertexArrayBindingDivisor(vao, 1, 1);
+
+	// Same draw id, but positions alone from their own stream, in the
+	// format set with `set_position_format`
+	glCreateVertexArrays(1, &depth_vao);
+	glEnableVertexArrayAttrib(depth_vao, 0);
+	glEnableVertexArrayAttrib(depth_vao, 2);
+	glVertexArrayAttribFormat(depth_vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribIFormat(depth_vao, 2, 1, GL_UNSIGNED_INT, 0);
+	glVertexArrayAttribBinding(depth_vao, 0, 0);
+	glVertexArrayAttribBinding(depth_vao, 2, 1);
+	glVertexArrayBindingDivisor(depth_vao, 1, 1);
+
+	// Only the draw id, the pulling shaders read the vertices themselves.
+	// Compact meshes do not fit the strides of the other two.
+	glCreateVertexArrays(1, &pulling_vao);
+	glEnableVertexArrayAttrib(pulling_vao, 2);
+	glVertexArrayAttribIFormat(pulling_vao, 2, 1, GL_UNSIGNED_INT, 0);
+	glVertexArrayAttribBinding(pulling_vao, 2, 1);
+	glVertexArrayBindingDivisor(pulling_vao, 1, 1);
 
 	glBindVertexArray(vao);
 
 	GLuint buffers[3];
 	glCreateBuffers(3, buffers);
-	mesh_buffer = MeshBuffer(buffers[0], buffers[1]);
-	command_buffer = CommandBuffer(buffers[2]);
+	mesh_buffer = MeshBuffer(buffers[0], buffers[1], buffers[2], PositionFormat::FLOAT);
+	command_buffer = CommandBuffer("commands");
+	indirect_buffer = StreamBuffer<DrawCommand>("indirect");
+	draw_id_buffer = StreamBuffer<std::uint32_t>("draw_ids");
+	if (auto cull_program = compile_cull_program()) {
+		gpu_culling = GpuCulling(*cull_program);
+	}
+	if (auto reduce_program = compile_depth_reduce_program()) {
+		depth_pyramid = DepthPyramid(*reduce_program);
+	}
+	if (auto cluster_program = compile_cluster_program()) {
+		light_grid = LightGrid(*cluster_program);
+	}
+	if (auto prepass_program = compile_depth_program()) {
+		depth_program = *prepass_program;
+		depth_view_proj_uniform = glGetUniformLocation(depth_program, "view_proj");
+	}
+	fragment_counter = StreamBuffer<std::uint32_t>("overdraw");
+	draw_slots = StreamBuffer<std::uint32_t>("visibility.slots");
+	auto visibility = compile_visibility_program();
+	auto classify = compile_classify_program();
+	auto resolve = compile_resolve_program();
+	if (visibility && classify && resolve) {
+		visibility_program = *visibility;
+		classify_program = *classify;
+		resolve_program = *resolve;
+	}
+
+	// Every pass pulls when vertex pulling is on, since some meshes are
+	// then only stored in layouts the position stream does not have.
+	auto pulling_shading = compile_pulling_program();
+	auto pulling_depth = compile_pulling_depth_program();
+	auto pulling_visibility = compile_pulling_visibility_program();
+	if (pulling_shading && pulling_depth && pulling_visibility) {
+		pulling_program = *pulling_shading;
+		pulling_view_proj_uniform = glGetUniformLocation(pulling_program, "view_proj");
+		pulling_count_fragments_uniform = glGetUniformLocation(pulling_program, "count_fragments");
+		pulling_depth_program = *pulling_depth;
+		pulling_depth_view_proj_uniform = glGetUniformLocation(pulling_depth_program, "view_proj");
+		pulling_visibility_program = *pulling_visibility;
+	}
+	if (depth_program != 0) {
+		shadow_maps = ShadowMaps(depth_program, pulling_depth_program);
+	}
 
-	model_uniform = glGetUniformLocation(program, "model");
 	view_proj_uniform = glGetUniformLocation(program, "view_proj");
-	glCreateBuffers(1, &material_ubo);
-	glNamedBufferStorage(material_ubo, static_cast<GLsizeiptr>(sizeof(Material)), nullptr, GL_DYNAMIC_STORAGE_BIT);
+	count_fragments_uniform = glGetUniformLocation(program, "count_fragments");
 
 	camera.set_position(glm::vec3{ 0.f, 0.f, 0.1f });
 
 	glEnable(GL_DEPTH_TEST);
 }
 
-void Renderer::update_scene(Scene scene)
+// World bounds of everything the node draws, whether resident or not. Only
+// meaningful when `command_count` is not 0.
+static Bounds node_bounds(const Node& node)
+{
+	Bounds bounds { glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX) };
+	for (const auto& meshnode : node.gltf->meshnodes) {
+		auto transform = node.transform * meshnode.transform;
+		auto instances = std::max<std::size_t>(1, meshnode.instances.size());
+		for (std::size_t i = 0; i < instances; ++i) {
+			auto model = meshnode.instances.empty() ? transform : transform * meshnode.instances[i];
+			for (const auto& prim : node.gltf->meshes[meshnode.mesh_idx].primitives) {
+				auto world = transform_bounds(prim.bounds, model);
+				bounds.min = glm::min(bounds.min, world.min);
+				bounds.max = glm::max(bounds.max, world.max);
+			}
+		}
+	}
+	return bounds;
+}
+
+// A command is generated for each primitive of each meshnode and each of its
+// instances, since they all need their own transform. This way the whole
+// command buffer can be submitted for drawing instead of issuing a draw per
+// primitive.
+static std::size_t command_count(const Node& node)
+{
+	std::size_t count = 0;
+	for (const auto& meshnode : node.gltf->meshnodes) {
+		auto instances = std::max<std::size_t>(1, meshnode.instances.size());
+		count += instances * node.gltf->meshes[meshnode.mesh_idx].primitives.size();
+	}
+	return count;
+}
+
+// Writes the `command_count` commands of the node to `draws`. Only reads the
+// glTF, so nodes can be written from several threads at once.
+static void write_commands(const Node& node, const MeshAllocation& allocation, Draw* draws)
+{
+	const auto& gltf = (*node.gltf);
+	for (const auto& meshnode : gltf.meshnodes) {
+		auto transform = node.transform * meshnode.transform;
+		// Each instance of EXT_mesh_gpu_instancing gets its own DrawData,
+		// the RenderList turns them back into a single instanced command.
+		auto instances = std::max<std::size_t>(1, meshnode.instances.size());
+		for (std::size_t i = 0; i < instances; ++i) {
+			auto model = meshnode.instances.empty() ? transform : transform * meshnode.instances[i];
+			auto normal_matrix = glm::mat3x4(glm::transpose(glm::inverse(glm::mat3(model))));
+			for (const auto& prim : gltf.meshes[meshnode.mesh_idx].primitives) {
+				DrawCommand cmd = {
+					.count = static_cast<std::uint32_t>(prim.index_count),
+					.instance_count = 1,
+					.first_index = static_cast<std::uint32_t>(prim.first_index + allocation.index_header.start),
+					.base_vertex = static_cast<std::uint32_t>(prim.base_vertex + allocation.base_vertex),
+					.base_instance = 0
+				};
+				GLuint texture = 0;
+				if (prim.texture_idx < gltf.textures.size()) {
+					texture = gltf.textures[prim.texture_idx].id;
+				}
+				auto lods = prim.lods;
+				for (std::uint32_t level = 0; level < lods.count; ++level) {
+					lods.levels[level].first_index += static_cast<std::uint32_t>(allocation.index_header.start);
+				}
+				*draws++ = Draw {
+					.command = cmd,
+					.data = DrawData {
+						.model = model,
+						.material = static_cast<std::uint32_t>(allocation.material_header.start + prim.material_idx),
+						.vertex_format = allocation.vertex_format,
+						.padding = {},
+						.normal_matrix = normal_matrix,
+					},
+					.texture = texture,
+					.bounds = prim.bounds,
+					.lods = lods,
+					.meshlets = MeshletRange {
+						&gltf,
+						static_cast<std::uint32_t>(prim.first_meshlet),
+						static_cast<std::uint32_t>(prim.meshlet_count),
+					},
+				};
+			}
+		}
+	}
+}
+
+std::vector<Draw> Renderer::generate_commands(Node& node)
+{
+	std::vector<Draw> draws(command_count(node));
+	write_commands(node, mesh_buffer.get_header(*node.gltf), draws.data());
+	return draws;
+}
+
+std::vector<Light> Renderer::scene_lights() const
+{
+	std::vector<Light> lights;
+	for (const auto& node : scene.nodes) {
+		for (auto light : node.gltf->lights) {
+			light.position = glm::vec3(node.transform * glm::vec4(light.position, 1.0f));
+			light.direction = glm::normalize(glm::vec3(node.transform * glm::vec4(light.direction, 0.0f)));
+			lights.push_back(light);
+		}
+	}
+	return lights;
+}
+
+// Nodes are split into one contiguous slice per worker, the calling thread
+// takes the first one. Small scenes are not worth starting threads for.
+template <typename F>
+static void for_each_slice(std::size_t count, std::size_t workers, const F& work)
 {
-	scene = std::move(scene);
+	std::vector<std::thread> threads;
+	for (std::size_t slice = 1; slice < workers; ++slice) {
+		threads.emplace_back(work, slice, count * slice / workers, count * (slice + 1) / workers);
+	}
+	work(0, 0, count / workers);
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+static std::size_t worker_count(std::size_t nodes)
+{
+	constexpr std::size_t min_nodes = 1024;
+	auto cores = std::max<std::size_t>(1, std::thread::hardware_concurrency());
+	return std::clamp<std::size_t>(nodes / min_nodes, 1, cores);
+}
+
+// Rebuilding every command is split in three passes over the nodes, spread
+// over the workers:
+//	1. each worker counts the commands of its nodes, and the offset of each
+//	   node from the start of its slice, and computes their bounds for the
+//	   Bvh of the scene,
+//	2. the totals of the slices are scanned, and each worker adds the offset
+//	   of its slice to the offsets of its nodes,
+//	3. the CommandBuffer is sized once for every command, and each worker
+//	   generates the commands of its nodes into its own buffer and copies
+//	   them in place.
+// Uploading touches GL and the residency, so it is done up front on this
+// thread, which also settles where every mesh lives before commands point
+// into the MeshBuffer.
+void Renderer::update_scene(Scene new_scene)
+{
+	release_bake();
+	dynamic_nodes.clear();
+	scene = std::move(new_scene);
 	scene_dirty = true;
+	casters_dirty = true;
+
+	node_gltfs.clear();
+	std::unordered_map<LoadedGLTF*, MeshAllocation> allocations;
+	for (const auto& node : scene.nodes) {
+		node_gltfs[node.id] = node.gltf;
+		if (allocations.count(node.gltf.get()) == 0) {
+			residency.retry(node.gltf->path);
+			residency.acquire(node.gltf, mesh_buffer);
+			allocations[node.gltf.get()] = MeshAllocation{};
+		}
+	}
+	for (auto& [gltf, allocation] : allocations) {
+		if (residency.is_resident(*gltf)) {
+			allocation = mesh_buffer.get_header(*gltf);
+		}
+	}
+
+	auto count = scene.nodes.size();
+	auto workers = worker_count(count);
+	std::vector<std::size_t> offsets(count + 1, 0);
+	std::vector<std::size_t> slice_offsets(workers + 1, 0);
+	std::vector<std::pair<std::uint32_t, Bounds>> items(count);
+	for_each_slice(count, workers, [&](std::size_t slice, std::size_t begin, std::size_t end) {
+		std::size_t total = 0;
+		for (auto i = begin; i < end; ++i) {
+			const auto& node = scene.nodes[i];
+			items[i] = { node.id, node_bounds(node) };
+			offsets[i] = total;
+			total += residency.is_resident(*node.gltf) ? command_count(node) : 0;
+		}
+		slice_offsets[slice + 1] = total;
+	});
+	std::partial_sum(slice_offsets.begin(), slice_offsets.end(), slice_offsets.begin());
+	offsets[count] = slice_offsets[workers];
+	for_each_slice(count, workers, [&](std::size_t slice, std::size_t begin, std::size_t end) {
+		for (auto i = begin; i < end; ++i) {
+			offsets[i] += slice_offsets[slice];
+		}
+	});
+
+	std::vector<std::uint32_t> owners(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		owners[i] = scene.nodes[i].id;
+	}
+	// Nodes drawing nothing, such as the ones holding only lights, have no
+	// bounds and stay out of the Bvh.
+	std::size_t kept = 0;
+	for (std::size_t i = 0; i < count; ++i) {
+		if (command_count(scene.nodes[i]) > 0) {
+			items[kept++] = items[i];
+		}
+	}
+	items.resize(kept);
+	node_bvh.build(items);
+	command_buffer.allocate_commands(owners, offsets);
+	for_each_slice(count, workers, [&](std::size_t, std::size_t begin, std::size_t end) {
+		std::vector<Draw> draws;
+		for (auto i = begin; i < end; ++i) {
+			const auto& node = scene.nodes[i];
+			if (offsets[i + 1] == offsets[i]) {
+				continue;
+			}
+			draws.resize(offsets[i + 1] - offsets[i]);
+			write_commands(node, allocations.at(node.gltf.get()), draws.data());
+			command_buffer.set_commands(offsets[i], draws);
+		}
+	});
 }
 
 void Renderer::add_node(Node node)
 {
 	scene_dirty = true;
+	casters_dirty |= !node.gltf->meshnodes.empty();
+	bake_dirty = static_baking;
 	scene.nodes.push_back(node);
-	mesh_buffer.add_mesh(*node.gltf);
+	node_gltfs[node.id] = node.gltf;
+	if (command_count(node) > 0) {
+		node_bvh.insert(node.id, node_bounds(node));
+	}
+	residency.retry(node.gltf->path);
+	if (residency.acquire(node.gltf, mesh_buffer)) {
+		refresh_commands(node.gltf->path);
+	} else if (residency.is_resident(*node.gltf)) {
+		command_buffer.add_commands(node.id, generate_commands(node));
+	}
 }
 
 void Renderer::remove_node(Node node)
 {
+	if (baked_nodes.count(node.id) > 0) {
+		unbake();
+	}
 	scene_dirty = true;
+	casters_dirty |= !node.gltf->meshnodes.empty();
 	scene.nodes.erase(std::find(scene.nodes.begin(), scene.nodes.end(), node));
-	mesh_buffer.remove_mesh(*node.gltf);
+	node_gltfs.erase(node.id);
+	node_bvh.remove(node.id);
+	// The mesh stays resident until the memory budget says otherwise, in
+	// case the node, or another one with the same mesh, is added back.
+	command_buffer.remove_commands(node.id);
+}
+
+void Renderer::set_transform(Node node, const glm::mat4& transform)
+{
+	auto search = std::find(scene.nodes.begin(), scene.nodes.end(), node);
+	if (search == scene.nodes.end()) {
+		return;
+	}
+	dynamic_nodes.insert(search->id);
+	if (baked_nodes.count(search->id) > 0) {
+		unbake();
+	}
+	scene_dirty = true;
+	// Nodes holding only lights move the shadows of their lights alone
+	casters_dirty |= !search->gltf->meshnodes.empty();
+	search->transform = transform;
+	if (residency.is_resident(*search->gltf)) {
+		command_buffer.remove_commands(search->id);
+		command_buffer.add_commands(search->id, generate_commands(*search));
+	}
+	if (command_count(*search) > 0) {
+		node_bvh.update(search->id, node_bounds(*search));
+	}
+}
+
+std::vector<BvhHit> Renderer::pick(const glm::vec3& origin, const glm::vec3& direction) const
+{
+	return node_bvh.query_ray(origin, direction, FLT_MAX);
+}
+
+std::vector<std::uint32_t> Renderer::nodes_in(const Bounds& bounds) const
+{
+	std::vector<std::uint32_t> nodes;
+	node_bvh.query_box(bounds, nodes);
+	return nodes;
+}
+
+std::optional<Bounds> Renderer::scene_bounds() const
+{
+	if (node_bvh.empty()) {
+		return std::nullopt;
+	}
+	return node_bvh.bounds();
 }
 
 void Renderer::update_window(int new_width, int new_height)
@@ -64,93 +427,739 @@ void Renderer::update_window(int new_width, int new_height)
 	width = new_width;
 	height = new_height;
 	glViewport(0, 0, width, height);
+	create_framebuffer();
+}
+
+void Renderer::create_framebuffer()
+{
+	if (framebuffer != 0) {
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteTextures(1, &color_texture);
+		glDeleteTextures(1, &depth_texture);
+	}
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &color_texture);
+	glTextureStorage2D(color_texture, 1, GL_RGBA8, width, height);
+	glCreateTextures(GL_TEXTURE_2D, 1, &depth_texture);
+	glTextureStorage2D(depth_texture, 1, GL_DEPTH_COMPONENT32F, width, height);
+	// Read with texelFetch when building the depth pyramid, which needs
+	// the texture to be complete without mipmaps.
+	glTextureParameteri(depth_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(depth_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	glCreateFramebuffers(1, &framebuffer);
+	glNamedFramebufferTexture(framebuffer, GL_COLOR_ATTACHMENT0, color_texture, 0);
+	glNamedFramebufferTexture(framebuffer, GL_DEPTH_ATTACHMENT, depth_texture, 0);
+	if (glCheckNamedFramebufferStatus(framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "Offscreen framebuffer is incomplete\n";
+	}
+
+	if (visibility_buffer) {
+		create_visibility_targets();
+	}
+}
+
+// Only allocated while the visibility buffer is used, at 20 bytes a pixel.
+void Renderer::create_visibility_targets()
+{
+	if (visibility_framebuffer != 0) {
+		glDeleteFramebuffers(1, &visibility_framebuffer);
+		glDeleteFramebuffers(1, &resolve_framebuffer);
+		glDeleteTextures(1, &visibility_texture);
+		glDeleteTextures(1, &material_depth_texture);
+	}
+
+	glCreateTextures(GL_TEXTURE_2D, 1, &visibility_texture);
+	glTextureStorage2D(visibility_texture, 1, GL_RGBA32UI, width, height);
+	glCreateTextures(GL_TEXTURE_2D, 1, &material_depth_texture);
+	glTextureStorage2D(material_depth_texture, 1, GL_DEPTH_COMPONENT32F, width, height);
+
+	glCreateFramebuffers(1, &visibility_framebuffer);
+	glNamedFramebufferTexture(visibility_framebuffer, GL_COLOR_ATTACHMENT0, visibility_texture, 0);
+	glNamedFramebufferTexture(visibility_framebuffer, GL_DEPTH_ATTACHMENT, depth_texture, 0);
+	glCreateFramebuffers(1, &resolve_framebuffer);
+	glNamedFramebufferTexture(resolve_framebuffer, GL_COLOR_ATTACHMENT0, color_texture, 0);
+	glNamedFramebufferTexture(resolve_framebuffer, GL_DEPTH_ATTACHMENT, material_depth_texture, 0);
+	if (glCheckNamedFramebufferStatus(visibility_framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE
+	    || glCheckNamedFramebufferStatus(resolve_framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "Visibility framebuffer is incomplete\n";
+	}
+}
+
+void Renderer::set_memory_budget(std::size_t bytes)
+{
+	residency.set_budget(bytes);
+}
+
+void Renderer::set_cpu_residency(CpuResidency policy)
+{
+	residency.set_cpu_residency(policy);
+}
+
+void Renderer::set_culling(CullingMode mode)
+{
+	if (mode == CullingMode::GPU_OCCLUSION && !depth_pyramid) {
+		std::cerr << "Occlusion culling is not available, culling on the GPU without it\n";
+		mode = CullingMode::GPU;
+	}
+	if (mode != CullingMode::CPU && !gpu_culling) {
+		std::cerr << "GPU culling is not available, culling on the CPU\n";
+		mode = CullingMode::CPU;
+	}
+	if (mode != CullingMode::CPU) {
+		std::cerr << "Meshlets are only culled on the CPU, culling on the GPU draws whole instances\n";
+	}
+	culling = mode;
+	// Compiling resets the visibility left over by the other mode.
+	scene_dirty = true;
+}
+
+void Renderer::set_depth_prepass(bool enabled)
+{
+	if (enabled && depth_program == 0) {
+		std::cerr << "The depth prepass is not available\n";
+		return;
+	}
+	depth_prepass = enabled;
+}
+
+void Renderer::set_draw_order(DrawOrder order)
+{
+	draw_order = order;
+}
+
+void Renderer::set_overdraw_stats(bool enabled)
+{
+	overdraw_stats = enabled;
+	// The counts left in the regions are stale
+	overdraw_frames = 0;
+	glProgramUniform1i(program, count_fragments_uniform, enabled ? 1 : 0);
+	if (pulling_program != 0) {
+		glProgramUniform1i(pulling_program, pulling_count_fragments_uniform, enabled ? 1 : 0);
+	}
+}
+
+void Renderer::set_vertex_pulling(bool enabled)
+{
+	if (enabled && pulling_program == 0) {
+		std::cerr << "Vertex pulling is not available\n";
+		return;
+	}
+	if (!enabled && mesh_buffer.has_compact_meshes()) {
+		std::cerr << "Vertex pulling stays on, some meshes are stored in layouts only it can draw\n";
+		return;
+	}
+	vertex_pulling = enabled;
+	mesh_buffer.set_compact_layouts(enabled);
+}
+
+void Renderer::set_position_format(PositionFormat format)
+{
+	if (!mesh_buffer.set_position_format(format)) {
+		std::cerr << "The position format can only be set before any mesh is uploaded\n";
+		return;
+	}
+	if (format != PositionFormat::NONE) {
+		auto type = format == PositionFormat::HALF ? GL_HALF_FLOAT : GL_FLOAT;
+		glVertexArrayAttribFormat(depth_vao, 0, 3, type, GL_FALSE, 0);
+	}
+}
+
+GLuint Renderer::shading_program() const
+{
+	return vertex_pulling ? pulling_program : program;
+}
+
+GLuint Renderer::depth_pass_program() const
+{
+	return vertex_pulling ? pulling_depth_program : depth_program;
+}
+
+GLuint Renderer::visibility_pass_program() const
+{
+	return vertex_pulling ? pulling_visibility_program : visibility_program;
+}
+
+GLuint Renderer::shading_vao() const
+{
+	return vertex_pulling ? pulling_vao : vao;
+}
+
+// The prepass must leave the depth of the shading pass behind, so it only
+// reads the position stream when it holds exact copies, and the positions
+// of the vertex stream otherwise. The depth program reads the first
+// attribute of either.
+GLuint Renderer::depth_pass_vao() const
+{
+	if (vertex_pulling) {
+		return pulling_vao;
+	}
+	return mesh_buffer.position_format() == PositionFormat::FLOAT ? depth_vao : vao;
+}
+
+GLuint Renderer::shadow_vao() const
+{
+	if (vertex_pulling) {
+		return pulling_vao;
+	}
+	return mesh_buffer.position_format() == PositionFormat::NONE ? vao : depth_vao;
 }
 
 void Renderer::update()
 {
-	// TODO: This is pretty expensive, could optimise later, or just leave it
-	// since updating the scene in this application is pretty rare.
 	camera.update();
+	auto view = camera.view_matrix();
+	auto frustum = make_frustum(projection_matrix() * view);
 
-	// Generate commands when the scene changes. This seems wasteful but
-	// this is generally parallelized and the alternative of tracking when
-	// a node is added or removed is not the best either.
-	//
-	// A command is generated for each primitive, in the future it might
-	// make sense to generate commands for each meshnode in gltf so we
-	// can just submit the whole command buffer for drawing instead of
-	// indexing it by a command_idx like we are doing now.
-	if (scene_dirty) {
-		command_buffer.clear_commands();
-		std::vector<DrawCommand> commands;
-		for (const auto& node : scene.nodes) {
-			auto& gltf = (*node.gltf);
-			MeshAllocation allocation = mesh_buffer.get_header(gltf);
-			commands.reserve(commands.size() + gltf.primitive_count);
-
-			for (const auto& mesh : gltf.meshes) {
-				for (const auto prim : mesh.primitives) {
-					DrawCommand cmd = {
-						.count = prim.index_count,
-						.instance_count = 1,
-						.first_index = prim.first_index + allocation.index_header.start,
-						.base_vertex = prim.base_vertex + allocation.vertex_header.start,
-						.base_instance = 0
-					};
-					commands.push_back(cmd);
-				}
+	// Only the nodes in view are drawn, so only their glTFs are kept
+	// resident this frame and the rest is left to the budget. Anything
+	// uploaded again after an eviction might have moved in the MeshBuffer.
+	// Shadows are cast from outside the view as well, so with shadows every
+	// node casting one is kept resident and the maps do not depend on where
+	// the camera looks.
+	visible_nodes.clear();
+	node_bvh.cull(frustum, visible_nodes);
+	auto acquire = [&](const std::shared_ptr<LoadedGLTF>& gltf) {
+		if (residency.acquire(gltf, mesh_buffer)) {
+			refresh_commands(gltf->path);
+		}
+	};
+	if (shadows) {
+		for (const auto& [id, gltf] : node_gltfs) {
+			if (!gltf->meshnodes.empty()) {
+				acquire(gltf);
 			}
 		}
-		command_buffer.record_commands(commands);
+	} else {
+		for (auto id : visible_nodes) {
+			acquire(node_gltfs.at(id));
+		}
+	}
+	for (const auto& path : residency.evict(mesh_buffer)) {
+		refresh_commands(path);
+	}
+	if (static_baking && bake_dirty) {
+		bake();
+	}
+
+	// Commands are kept up to date as nodes are added and removed, so
+	// only the ranges which changed need to be uploaded.
+	if (scene_dirty) {
+		render_list.compile(command_buffer);
+		if (culling != CullingMode::CPU) {
+			gpu_culling->update(render_list);
+		}
+		auto lights = scene_lights();
+		if (light_grid) {
+			light_grid->update(lights);
+		}
+		if (shadow_maps) {
+			shadow_maps->update(lights);
+			shadow_maps->write_casters(render_list);
+		}
+	}
+	if (shadow_maps && casters_dirty) {
+		shadow_maps->invalidate();
+		casters_dirty = false;
+	}
+	if (scene_dirty || command_buffer.is_dirty()) {
 		command_buffer.upload_commands();
 		scene_dirty = false;
 	}
+
+	if (culling == CullingMode::CPU) {
+		stats::record_culled(render_list.cull(frustum));
+	}
+	render_list.sort(view, far_plane, draw_order);
+	auto pixels_per_unit = static_cast<float>(height) / (2.0f * std::tan(glm::radians(fov) / 2.0f));
+	render_list.select_lods(pixels_per_unit, lod_threshold);
+	// The GPU culls whole instances, see set_culling
+	if (culling == CullingMode::CPU) {
+		auto camera_position = glm::vec3(glm::inverse(view)[3]);
+		stats::record_culled_meshlets(render_list.cull_clusters(frustum, camera_position));
+	}
 }
 
-void Renderer::render()
+// Rebuilds the commands of every node using the glTF at `path`, dropping
+// them if it is no longer resident.
+void Renderer::refresh_commands(const std::string& path)
 {
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	// The baked batches use the textures and materials of the glTF, which
+	// are gone or have moved.
+	for (const auto& node : scene.nodes) {
+		if (node.gltf->path == path && baked_nodes.count(node.id) > 0) {
+			unbake();
+			break;
+		}
+	}
+	scene_dirty = true;
+	casters_dirty = true;
+	for (auto& node : scene.nodes) {
+		if (node.gltf->path == path) {
+			command_buffer.remove_commands(node.id);
+			if (residency.is_resident(*node.gltf)) {
+				command_buffer.add_commands(node.id, generate_commands(node));
+			}
+		}
+	}
+}
+
+void Renderer::set_visibility_buffer(bool enabled)
+{
+	if (enabled && visibility_program == 0) {
+		std::cerr << "The visibility buffer is not available\n";
+		return;
+	}
+	visibility_buffer = enabled;
+	if (enabled) {
+		create_visibility_targets();
+	}
+}
 
+void Renderer::set_shadows(bool enabled)
+{
+	if (enabled && !shadow_maps) {
+		std::cerr << "Shadows are not available\n";
+		return;
+	}
+	shadows = enabled;
+	if (!enabled) {
+		glProgramUniform1i(program, 15, 0);
+		if (pulling_program != 0) {
+			glProgramUniform1i(pulling_program, 15, 0);
+		}
+		if (resolve_program != 0) {
+			glProgramUniform1i(resolve_program, 15, 0);
+		}
+	}
+}
+
+void Renderer::set_static_baking(bool enabled)
+{
+	if (!enabled) {
+		unbake();
+	}
+	static_baking = enabled;
+	bake_dirty = enabled;
+}
+
+// Bakes every resident node which was never moved. The vertices of glTFs
+// released from the CPU are brought back for the bake and released again.
+void Renderer::bake()
+{
+	unbake();
+	bake_dirty = false;
+
+	std::vector<BakeSource> sources;
+	std::vector<LoadedGLTF*> reloaded;
+	for (const auto& node : scene.nodes) {
+		auto& gltf = *node.gltf;
+		if (dynamic_nodes.count(node.id) > 0 || !residency.is_resident(gltf)) {
+			continue;
+		}
+		if (!has_cpu_data(gltf)) {
+			if (!reload_cpu_data(gltf)) {
+				continue;
+			}
+			reloaded.push_back(&gltf);
+		}
+		sources.push_back(BakeSource{ &node, mesh_buffer.get_header(gltf).material_header.start });
+	}
+	auto batches = bake_static(sources);
+	for (auto* gltf : reloaded) {
+		release_cpu_data(*gltf);
+	}
+	if (batches.empty()) {
+		return;
+	}
+
+	// Every batch goes into a single allocation, each keeps its indices
+	// relative to its own first vertex.
+	std::vector<Vertex> vertices;
+	std::vector<std::uint32_t> indices;
+	for (const auto& batch : batches) {
+		vertices.insert(vertices.end(), batch.vertices.begin(), batch.vertices.end());
+		indices.insert(indices.end(), batch.indices.begin(), batch.indices.end());
+	}
+	auto allocation = mesh_buffer.add_geometry(baked_geometry, vertices, indices);
+
+	std::vector<Draw> draws;
+	std::size_t first_vertex = allocation.base_vertex;
+	auto first_index = allocation.index_header.start;
+	for (const auto& batch : batches) {
+		auto count = static_cast<std::uint32_t>(batch.indices.size());
+		LodChain lods {};
+		lods.levels[0] = Lod { static_cast<std::uint32_t>(first_index), count, 0.0f };
+		lods.count = 1;
+		draws.push_back(Draw {
+			.command = DrawCommand {
+				.count = count,
+				.instance_count = 1,
+				.first_index = static_cast<std::uint32_t>(first_index),
+				.base_vertex = static_cast<std::uint32_t>(first_vertex),
+				.base_instance = 0,
+			},
+			.data = DrawData {
+				.model = glm::mat4(1.0f),
+				.material = batch.material,
+				.vertex_format = MeshBuffer::vertex_format,
+				.padding = {},
+				.normal_matrix = glm::mat3x4(1.0f),
+			},
+			.texture = batch.texture,
+			.bounds = batch.bounds,
+			.lods = lods,
+			.meshlets = MeshletRange { nullptr, 0, 0 },
+		});
+		first_vertex += batch.vertices.size();
+		first_index += batch.indices.size();
+	}
+
+	for (const auto& source : sources) {
+		command_buffer.remove_commands(source.node->id);
+		baked_nodes.insert(source.node->id);
+	}
+	command_buffer.add_commands(baked_owner, draws);
+	scene_dirty = true;
+}
+
+void Renderer::unbake()
+{
+	if (baked_nodes.empty()) {
+		return;
+	}
+	auto nodes = std::move(baked_nodes);
+	release_bake();
+	for (auto& node : scene.nodes) {
+		if (nodes.count(node.id) > 0 && residency.is_resident(*node.gltf)) {
+			command_buffer.add_commands(node.id, generate_commands(node));
+		}
+	}
+}
+
+void Renderer::release_bake()
+{
+	command_buffer.remove_commands(baked_owner);
+	mesh_buffer.remove_geometry(baked_geometry);
+	baked_nodes.clear();
+	bake_dirty = static_baking;
+	scene_dirty = true;
+}
+
+void Renderer::render()
+{
 	// bind global buffers
 	mesh_buffer.bind_buffer(vao);
+	mesh_buffer.bind_position_buffer(depth_vao);
+	mesh_buffer.bind_pulling_buffers(pulling_vao);
 	command_buffer.bind_buffer();
 
-	// bind material uniform buffer
-	glBindBufferBase(GL_UNIFORM_BUFFER, 0, material_ubo);
+	// Shadows are drawn first, into their own framebuffer, and only the
+	// maps which are out of date
+	auto view = camera.view_matrix();
+	if (shadows && render_list.caster_bounds) {
+		shadow_maps->fit(*render_list.caster_bounds, ShadowView {
+			.view = view,
+			.fov = glm::radians(fov),
+			.aspect = static_cast<float>(width) / height,
+			.z_near = near_plane,
+			.z_far = far_plane,
+		});
+		stats::record_shadow_layers(shadow_maps->render(shadow_vao(), vertex_pulling));
+		glViewport(0, 0, width, height);
+	}
+
+	// Drawn offscreen so the depth can be read for occlusion culling
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if (visibility_buffer) {
+		const GLuint nothing[4] = { 0, 0, 0, 0 };
+		glBindFramebuffer(GL_FRAMEBUFFER, visibility_framebuffer);
+		glClearNamedFramebufferuiv(visibility_framebuffer, GL_COLOR, 0, nothing);
+	}
 
 	// set camera uniforms
-	auto view = camera.view_matrix();
-	auto proj = glm::perspective(glm::radians(70.0f), (static_cast<float>(width) / height), 0.1f, 100.0f);
-	auto view_proj = proj * view;
-	glUniformMatrix4fv(view_proj_uniform, 1, GL_FALSE, &view_proj[0][0]);
+	auto view_proj = projection_matrix() * view;
+	glProgramUniformMatrix4fv(program, view_proj_uniform, 1, GL_FALSE, &view_proj[0][0]);
+	if (visibility_program != 0) {
+		glProgramUniformMatrix4fv(visibility_program, 1, 1, GL_FALSE, &view_proj[0][0]);
+	}
+	if (pulling_visibility_program != 0) {
+		glProgramUniformMatrix4fv(pulling_visibility_program, 1, 1, GL_FALSE, &view_proj[0][0]);
+	}
+	if (light_grid) {
+		auto camera_position = glm::vec3(glm::inverse(view)[3]);
+		light_grid->build(view, projection_matrix(), near_plane, far_plane);
+		light_grid->bind(program, camera_position, width, height, near_plane, far_plane);
+		if (pulling_program != 0) {
+			light_grid->bind(pulling_program, camera_position, width, height, near_plane, far_plane);
+		}
+		if (resolve_program != 0) {
+			light_grid->bind(resolve_program, camera_position, width, height, near_plane, far_plane);
+		}
+	}
+	if (shadows && render_list.caster_bounds) {
+		shadow_maps->bind(program);
+		if (pulling_program != 0) {
+			shadow_maps->bind(pulling_program);
+		}
+		if (resolve_program != 0) {
+			shadow_maps->bind(resolve_program);
+		}
+	}
+	if (pulling_program != 0) {
+		glProgramUniformMatrix4fv(pulling_program, pulling_view_proj_uniform, 1, GL_FALSE, &view_proj[0][0]);
+	}
+	if (depth_program != 0) {
+		glProgramUniformMatrix4fv(depth_program, depth_view_proj_uniform, 1, GL_FALSE, &view_proj[0][0]);
+	}
+	if (pulling_depth_program != 0) {
+		glProgramUniformMatrix4fv(pulling_depth_program, pulling_depth_view_proj_uniform, 1, GL_FALSE,
+					  &view_proj[0][0]);
+	}
 
-	size_t idx = 0;
-	for (auto& node : scene.nodes) {
-		auto gltf = *node.gltf;
-		for (auto& meshnode : gltf.meshnodes) {
-			auto transform = node.transform * meshnode.transform;
-			glUniformMatrix4fv(model_uniform, 1, GL_FALSE, &transform[0][0]);
-			auto& mesh = gltf.meshes[meshnode.mesh_idx];
+	// The region was last written `regions` frames ago, and mapping it
+	// waited for the GPU to be done with it.
+	if (overdraw_stats) {
+		auto* fragments = fragment_counter.map(1);
+		if (overdraw_frames >= decltype(fragment_counter)::regions) {
+			stats::record_overdraw(fragments[0], static_cast<std::size_t>(width) * height);
+		}
+		fragments[0] = 0;
+		++overdraw_frames;
+		glBindBufferRange(GL_ATOMIC_COUNTER_BUFFER, 0, fragment_counter.id(),
+				  static_cast<GLintptr>(fragment_counter.offset()), sizeof(std::uint32_t));
+	}
+
+	if (render_list.visible_commands > 0) {
+		draw_scene(view_proj);
+		if (visibility_buffer) {
+			resolve_visibility(view_proj);
+		}
+	}
+	command_buffer.fence();
+	if (overdraw_stats) {
+		glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+		fragment_counter.fence();
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBlitNamedFramebuffer(framebuffer, 0, 0, 0, width, height, 0, 0, width, height,
+			       GL_COLOR_BUFFER_BIT, GL_NEAREST);
+}
+
+void Renderer::draw_scene(const glm::mat4& view_proj)
+{
+	auto groups = render_list.size();
+	std::size_t binds = 0;
+	std::size_t draw_calls = 0;
 
-			for (auto& primitive : mesh.primitives) {
-				auto& material = gltf.materials[primitive.material_idx];
-				auto& texture = gltf.textures[primitive.texture_idx];
+	if (culling == CullingMode::CPU) {
+		render_list.write(indirect_buffer.map(render_list.visible_commands),
+				  draw_id_buffer.map(render_list.visible_instances));
+		bind_draw_buffers();
+		binds = draw_batches(0, draw_calls);
+	} else if (culling == CullingMode::GPU) {
+		render_list.write_unculled(indirect_buffer.map(groups), gpu_culling->begin_frame(groups));
+		draw_id_buffer.next(render_list.visible_instances);
+		gpu_culling->dispatch(CullPass::FRUSTUM, view_proj, indirect_buffer, draw_id_buffer);
+		bind_draw_buffers();
+		binds = draw_batches(0, draw_calls);
+	} else {
+		// Everything visible last frame is drawn first, the depth it
+		// leaves behind is what the rest is tested against.
+		render_list.write_unculled(indirect_buffer.map(groups * 2), gpu_culling->begin_frame(groups), 2);
+		draw_id_buffer.next(render_list.visible_instances * 2);
+		gpu_culling->dispatch(CullPass::LAST_VISIBLE, view_proj, indirect_buffer, draw_id_buffer);
+		bind_draw_buffers();
+		binds = draw_batches(0, draw_calls);
 
-				glBindTextureUnit(0, texture.id);
-				glNamedBufferSubData(material_ubo, 0, sizeof(Material), reinterpret_cast<const void*>(&material));
+		depth_pyramid->resize(width, height);
+		depth_pyramid->build(depth_texture);
+		gpu_culling->dispatch(CullPass::OCCLUSION, view_proj, indirect_buffer, draw_id_buffer,
+				      depth_pyramid->texture());
+		binds += draw_batches(groups, draw_calls);
+	}
+
+	indirect_buffer.fence();
+	draw_id_buffer.fence();
+	if (culling != CullingMode::CPU) {
+		gpu_culling->fence();
+	}
+	stats::record_draws(render_list.visible_commands, render_list.visible_instances, render_list.visible_triangles,
+			    draw_calls, binds);
+}
 
-				auto command_idx = sizeof(DrawCommand) * (primitive.command_idx + idx);
-				glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(command_idx));
+void Renderer::bind_draw_buffers()
+{
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer.id());
+	for (auto array : { vao, depth_vao, pulling_vao }) {
+		glVertexArrayVertexBuffer(array, 1, draw_id_buffer.id(), static_cast<GLintptr>(draw_id_buffer.offset()),
+					  sizeof(std::uint32_t));
+	}
+}
+
+// Transforms are in the draw SSBO and materials in the material table, so
+// only the texture changes between batches. Returns the number of binds.
+//
+// With the depth prepass, the commands are drawn twice. The prepass needs
+// no textures, so it draws every command with a single call, then the
+// shading pass only shades the fragments whose depth is equal to what the
+// prepass left behind, which are the visible ones.
+std::size_t Renderer::draw_batches(std::size_t first_command, std::size_t& draw_calls)
+{
+	if (render_list.batches.empty()) {
+		return 0;
+	}
+	// Only the triangles are drawn, textures are bound when resolving
+	if (visibility_buffer) {
+		const auto& last = render_list.batches.back();
+		glUseProgram(visibility_pass_program());
+		glBindVertexArray(depth_pass_vao());
+		auto offset = indirect_buffer.offset() + sizeof(DrawCommand) * first_command;
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset),
+					    static_cast<GLsizei>(last.first + last.count), 0);
+		glBindVertexArray(shading_vao());
+		++draw_calls;
+		return 0;
+	}
+	if (depth_prepass) {
+		const auto& last = render_list.batches.back();
+		glUseProgram(depth_pass_program());
+		glBindVertexArray(depth_pass_vao());
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		auto offset = indirect_buffer.offset() + sizeof(DrawCommand) * first_command;
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset),
+					    static_cast<GLsizei>(last.first + last.count), 0);
+		++draw_calls;
+
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_FALSE);
+		glDepthFunc(GL_EQUAL);
+	}
+	// The culling shaders, the light grid and the shadow maps leave their
+	// own program and vertex array bound, and so does the prepass
+	glUseProgram(shading_program());
+	glBindVertexArray(shading_vao());
+
+	std::size_t binds = 0;
+	GLuint bound = 0;
+	for (const auto& batch : render_list.batches) {
+		if (binds == 0 || batch.texture != bound) {
+			glBindTextureUnit(0, batch.texture);
+			bound = batch.texture;
+			++binds;
+		}
+		auto offset = indirect_buffer.offset() + sizeof(DrawCommand) * (first_command + batch.first);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset),
+					    static_cast<GLsizei>(batch.count), 0);
+	}
+	draw_calls += render_list.batches.size();
+
+	if (depth_prepass) {
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LESS);
+	}
+	return binds;
+}
+
+// Each texture gets a slot and each slot a material depth. Classifying
+// writes the material depth of every pixel, then each slot is resolved with
+// a fullscreen triangle at its depth tested for equality, so every pixel is
+// shaded once, by the pass of its own texture.
+void Renderer::resolve_visibility(const glm::mat4& view_proj)
+{
+	for (auto texture : slot_textures) {
+		slot_of[texture] = no_slot;
+	}
+	slot_textures.clear();
+	auto* slots = draw_slots.map(command_buffer.get_commands().size());
+	for (auto group : render_list.order) {
+		if (render_list.visible_count[group] == 0) {
+			continue;
+		}
+		auto texture = render_list.textures[group];
+		if (texture >= slot_of.size()) {
+			slot_of.resize(texture + 1, no_slot);
+		}
+		auto slot = slot_of[texture];
+		if (slot == no_slot) {
+			if (slot_textures.size() == max_material_slots) {
+				std::cerr << "More than " << max_material_slots
+					  << " textures in view, the rest are resolved with the last one\n";
+				slot = static_cast<std::uint32_t>(slot_textures.size() - 1);
+			} else {
+				slot = static_cast<std::uint32_t>(slot_textures.size());
+				slot_of[texture] = slot;
+				slot_textures.push_back(texture);
 			}
 		}
-		// Increment by the total commands of the previous mesh
-		idx += gltf.primitive_count;
+		auto first = render_list.first_instance[group];
+		for (auto i = first; i < first + render_list.instance_count[group]; ++i) {
+			slots[render_list.instances[i]] = slot;
+		}
 	}
+
+	glProgramUniformMatrix4fv(resolve_program, 1, 1, GL_FALSE, &view_proj[0][0]);
+	glProgramUniform2f(resolve_program, 12, static_cast<float>(width), static_cast<float>(height));
+	glProgramUniform1i(resolve_program, 4, overdraw_stats ? 1 : 0);
+
+	const float cleared = 0.0f;
+	glBindFramebuffer(GL_FRAMEBUFFER, resolve_framebuffer);
+	glClearNamedFramebufferfv(resolve_framebuffer, GL_DEPTH, 0, &cleared);
+	glBindTextureUnit(1, visibility_texture);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 10, draw_slots.id(), static_cast<GLintptr>(draw_slots.offset()),
+			  static_cast<GLsizeiptr>(draw_slots.region_size()));
+
+	glUseProgram(classify_program);
+	glDepthFunc(GL_ALWAYS);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+
+	glUseProgram(resolve_program);
+	glDepthFunc(GL_EQUAL);
+	glDepthMask(GL_FALSE);
+	for (std::uint32_t slot = 0; slot < slot_textures.size(); ++slot) {
+		glBindTextureUnit(0, slot_textures[slot]);
+		glProgramUniform1ui(resolve_program, 3, slot);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+
+	draw_slots.fence();
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+}
+
+glm::mat4 Renderer::projection_matrix() const
+{
+	return glm::perspective(glm::radians(fov), (static_cast<float>(width) / height), near_plane, far_plane);
 }
 
 void Renderer::loop()
 {
 	update();
 	render();
+	residency.end_frame();
+	stats::end_frame();
+}
+
+stats::Report Renderer::collect_stats() const
+{
+	auto report = stats::report();
+	mesh_buffer.collect_stats(report);
+	command_buffer.collect_stats(report);
+	report.buffers["indirect"] = indirect_buffer.stats();
+	report.buffers["draw_ids"] = draw_id_buffer.stats();
+	if (light_grid) {
+		report.buffers["lights"] = light_grid->stats();
+	}
+	if (shadow_maps) {
+		report.buffers["shadows"] = shadow_maps->stats();
+	}
+	if (gpu_culling) {
+		report.buffers["culling.instances"] = gpu_culling->stats();
+	}
+	residency.collect_stats(report);
+	return report;
 }
@@ -2,40 +2,198 @@
 
 #include "scene.h"
 #include "buffer.h"
+#include "bvh.h"
+#include "depth_pyramid.h"
 #include "gltf.h"
+#include "gpu_culling.h"
+#include "light_grid.h"
+#include "render_list.h"
+#include "residency.h"
+#include "shadow_maps.h"
+#include "stats.h"
 
 #include <fastgltf/types.hpp>
 #include <glad/gl.h>
 
+#include <memory>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 class Renderer {
 public:
 	Camera camera;
 
 	Renderer(GLuint program);
 	// TODO: move these into scene itself, and maybe use move semantics?
-	void update_scene(Scene scene);
+	void update_scene(Scene new_scene);
 	void add_node(Node node);
 	void remove_node(Node node);
+	void set_transform(Node node, const glm::mat4& transform);
+
+	// Scene queries in world space, against the bounds of whole nodes.
+	// Returns the ids of the nodes the ray goes through, closest first.
+	std::vector<BvhHit> pick(const glm::vec3& origin, const glm::vec3& direction) const;
+	std::vector<std::uint32_t> nodes_in(const Bounds& bounds) const;
+	// Bounds of the whole scene, to frame it with the camera. Empty when
+	// nothing in the scene has geometry.
+	std::optional<Bounds> scene_bounds() const;
 
 	void update_window(int new_width, int new_height);
+	// Maximum bytes of meshes and textures to keep on the GPU.
+	void set_memory_budget(std::size_t bytes);
+	void set_cpu_residency(CpuResidency policy);
+	// Falls back to the CPU if the cull shader failed to compile. Meshlets
+	// are only culled on the CPU, the GPU culls whole instances.
+	void set_culling(CullingMode mode);
+	// Lays down the depth of the scene before shading it, so each pixel
+	// is shaded once. Does nothing if the depth program failed to compile.
+	void set_depth_prepass(bool enabled);
+	void set_draw_order(DrawOrder order);
+	// Counts the fragments shaded each frame into the stats, which costs
+	// an atomic per fragment.
+	void set_overdraw_stats(bool enabled);
+	// Has the vertex shaders read the vertices from an SSBO instead of the
+	// vertex array, and stores the meshes without texture coordinates
+	// uploaded from then on in a smaller layout. Does nothing if the
+	// programs failed to compile, and cannot be turned off again once such
+	// meshes are resident.
+	void set_vertex_pulling(bool enabled);
+	// How the position stream for depth-only passes is stored, exact
+	// copies by default. Half floats halve its size but are only read by
+	// the shadow maps, since the prepass must match the depth of the
+	// shading pass. Without a stream, every pass reads the vertices. Can
+	// only be set before the first mesh is uploaded.
+	void set_position_format(PositionFormat format);
+	// Merges the primitives of nodes which never move into batches in
+	// world space, one command per material and texture. Moving a node
+	// with `set_transform` takes it out of the bake for good.
+	void set_static_baking(bool enabled);
+	// Rasterizes the triangle of each pixel into a visibility buffer, then
+	// shades every pixel once in fullscreen passes. Does nothing if its
+	// programs failed to compile.
+	void set_visibility_buffer(bool enabled);
+	// Shadows every light with cached shadow maps, which are only drawn
+	// again when a light or the geometry moves. Every node casting a
+	// shadow stays resident while shadows are on, out of view or not, so
+	// the memory budget cannot evict any of them. Does nothing if the depth
+	// program failed to compile.
+	void set_shadows(bool enabled);
 	void update();
 	void render();
 	void loop();
+
+	// Gathers memory and upload statistics of all GPU resources.
+	stats::Report collect_stats() const;
 private:
+	std::vector<Draw> generate_commands(Node& node);
+	// The lights of every node, in world space.
+	std::vector<Light> scene_lights() const;
+	void refresh_commands(const std::string& path);
+	void bake();
+	// Drops the baked batches and gives the baked nodes their own
+	// commands back.
+	void unbake();
+	// Drops the baked batches only, for when every command is rebuilt.
+	void release_bake();
+	glm::mat4 projection_matrix() const;
+	void create_framebuffer();
+	void create_visibility_targets();
+	// Shades the pixels of the visibility buffer into the color texture.
+	void resolve_visibility(const glm::mat4& view_proj);
+	void draw_scene(const glm::mat4& view_proj);
+	void bind_draw_buffers();
+	std::size_t draw_batches(std::size_t first_command, std::size_t& draw_calls);
+	// The programs of the shading, depth-only and visibility passes,
+	// depending on vertex pulling.
+	GLuint shading_program() const;
+	GLuint depth_pass_program() const;
+	GLuint visibility_pass_program() const;
+	// The vertex arrays they read, the same one for every pass when pulling.
+	GLuint shading_vao() const;
+	GLuint depth_pass_vao() const;
+	GLuint shadow_vao() const;
+
 	// window data
 	int width, height;
 
+	GLuint program;
+	GLuint depth_program {0};
+	GLuint pulling_program {0};
+	GLuint pulling_depth_program {0};
+	GLuint pulling_visibility_program {0};
+	GLuint framebuffer {0};
+	GLuint color_texture {0};
+	GLuint depth_texture {0};
+	// The visibility pass draws into the visibility texture with the depth
+	// texture, the resolve passes into the color texture with the material
+	// depth texture.
+	GLuint visibility_framebuffer {0};
+	GLuint resolve_framebuffer {0};
+	GLuint visibility_texture {0};
+	GLuint material_depth_texture {0};
+	GLuint visibility_program {0};
+	GLuint classify_program {0};
+	GLuint resolve_program {0};
+
 	// gl buffers
 	GLuint vao;
+	// Reads the position stream of the mesh buffer, for depth-only passes
+	GLuint depth_vao;
+	// Reads nothing but the draw id, for the pulling programs
+	GLuint pulling_vao;
 	MeshBuffer mesh_buffer;
 	CommandBuffer command_buffer;
+	// The commands of the render list in sorted order, rewritten each frame.
+	StreamBuffer<DrawCommand> indirect_buffer;
+	// The DrawData index of every instance, read by the draw id attribute.
+	StreamBuffer<std::uint32_t> draw_id_buffer;
+	CullingMode culling {CullingMode::CPU};
+	bool depth_prepass {false};
+	DrawOrder draw_order {DrawOrder::STATE};
+	bool overdraw_stats {false};
+	bool vertex_pulling {false};
+	bool visibility_buffer {false};
+	bool shadows {false};
+	// Texture slot of every draw, and texture of every slot, for resolving
+	StreamBuffer<std::uint32_t> draw_slots;
+	std::vector<GLuint> slot_textures;
+	// Slot of every texture name, `no_slot` for textures without one. Only
+	// the entries of `slot_textures` are reset each frame.
+	std::vector<std::uint32_t> slot_of;
+	static constexpr std::uint32_t no_slot = static_cast<std::uint32_t>(-1);
+	// Fragments shaded in each region, read back `regions` frames later.
+	StreamBuffer<std::uint32_t> fragment_counter;
+	std::size_t overdraw_frames {0};
+	std::optional<GpuCulling> gpu_culling;
+	std::optional<DepthPyramid> depth_pyramid;
+	std::optional<LightGrid> light_grid;
+	std::optional<ShadowMaps> shadow_maps;
+	Residency residency;
 
 	// scene data
 	bool scene_dirty = false;
+	// Whether anything casting shadows changed since they were drawn
+	bool casters_dirty = false;
 	Scene scene;
+	// World bounds of every node, kept up to date as nodes change.
+	Bvh node_bvh;
+	std::unordered_map<std::uint32_t, std::shared_ptr<LoadedGLTF>> node_gltfs;
+	// Nodes in view, cleared every frame.
+	std::vector<std::uint32_t> visible_nodes;
+	RenderList render_list;
+	bool static_baking {false};
+	bool bake_dirty {false};
+	std::unordered_set<std::uint32_t> baked_nodes;
+	// Nodes moved at least once, which are never baked.
+	std::unordered_set<std::uint32_t> dynamic_nodes;
 
-	// uniforms and ubo
-	GLuint model_uniform;
+	// uniforms
 	GLuint view_proj_uniform;
-	GLuint material_ubo;
+	GLint depth_view_proj_uniform {-1};
+	GLint count_fragments_uniform {-1};
+	GLint pulling_view_proj_uniform {-1};
+	GLint pulling_count_fragments_uniform {-1};
+	GLint pulling_depth_view_proj_uniform {-1};
 };
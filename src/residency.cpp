@@ -0,0 +1,103 @@
+#include "residency.h"
+
+#include <iostream>
+
+void Residency::set_budget(std::size_t bytes)
+{
+	budget = bytes;
+}
+
+void Residency::set_cpu_residency(CpuResidency policy)
+{
+	cpu_residency = policy;
+}
+
+bool Residency::acquire(std::shared_ptr<LoadedGLTF> gltf, MeshBuffer& mesh_buffer)
+{
+	auto search = entries.find(gltf->path);
+	if (search != entries.end()) {
+		auto entry = search->second;
+		// Nodes sharing the glTF acquire it once each, it is used once
+		if (entry->last_used == frame) {
+			return false;
+		}
+		entry->last_used = frame;
+		lru.splice(lru.begin(), lru, entry);
+		++hits;
+		return false;
+	}
+
+	if (failed.count(gltf->path) > 0) {
+		return false;
+	}
+	++misses;
+	if (!reload_cpu_data(*gltf)) {
+		std::cerr << "Unable to make " << gltf->path << " resident\n";
+		failed.insert(gltf->path);
+		return false;
+	}
+
+	mesh_buffer.add_mesh(*gltf);
+	auto bytes = mesh_bytes(*gltf);
+	for (auto& texture : gltf->textures) {
+		upload_texture(texture);
+		bytes += texture_bytes(texture);
+	}
+	if (cpu_residency == CpuResidency::RELEASE) {
+		release_cpu_data(*gltf);
+	}
+
+	lru.push_front(Entry{ gltf, bytes, frame });
+	entries[gltf->path] = lru.begin();
+	resident += bytes;
+	return true;
+}
+
+void Residency::retry(const std::string& path)
+{
+	failed.erase(path);
+}
+
+bool Residency::is_resident(const LoadedGLTF& gltf) const
+{
+	return entries.find(gltf.path) != entries.end();
+}
+
+std::vector<std::string> Residency::evict(MeshBuffer& mesh_buffer)
+{
+	std::vector<std::string> evicted;
+	while (resident > budget && !lru.empty() && lru.back().last_used < frame) {
+		auto& entry = lru.back();
+		evicted.push_back(entry.gltf->path);
+		release(entry, mesh_buffer);
+		entries.erase(entry.gltf->path);
+		lru.pop_back();
+		++evictions;
+	}
+	return evicted;
+}
+
+void Residency::end_frame()
+{
+	++frame;
+}
+
+void Residency::collect_stats(stats::Report& report) const
+{
+	report.residency = stats::ResidencyStats {
+		.budget = budget,
+		.resident = resident,
+		.hits = hits,
+		.misses = misses,
+		.evictions = evictions,
+	};
+}
+
+void Residency::release(Entry& entry, MeshBuffer& mesh_buffer)
+{
+	mesh_buffer.remove_mesh(*entry.gltf);
+	for (auto& texture : entry.gltf->textures) {
+		release_texture(texture);
+	}
+	resident -= entry.bytes;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "buffer.h"
+#include "gltf.h"
+#include "stats.h"
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+enum class CpuResidency { KEEP, RELEASE };
+
+/// Decides which glTFs have their meshes and textures on the GPU. Without
+/// this, everything ever added stays resident, which is a problem for long
+/// running processes which see thousands of distinct models.
+///
+/// A glTF is made resident with `acquire`, which uploads it if needed and
+/// marks it as used in the current frame. Acquiring it again in the same
+/// frame does nothing, so callers need not track what they acquired. Anything acquired is kept in a
+/// least recently used list and once the resident size goes over the budget,
+/// `evict` releases glTFs from the back of the list until it fits again.
+/// glTFs used in the current frame are never evicted, even if that means
+/// going over budget, since they are about to be drawn.
+///
+/// An evicted glTF is uploaded again from its CPU copy the next time it is
+/// acquired. Since the mesh might land at a different place in the MeshBuffer,
+/// `acquire` tells the caller when that happens so commands can be rebuilt.
+/// If its data cannot be brought back, for instance because the source file
+/// changed, the path is remembered and not tried again until `retry`, which
+/// is called when the glTF is added to the scene again.
+///
+/// With `CpuResidency::RELEASE`, the CPU copy of the geometry and pixels is
+/// dropped right after uploading, which halves the memory of large assets. It
+/// is brought back from the cache or the source file when needed again.
+class Residency {
+public:
+	static constexpr std::size_t default_budget = 512 * 1024 * 1024;
+
+	void set_budget(std::size_t bytes);
+	void set_cpu_residency(CpuResidency policy);
+	// Returns true if the glTF had to be uploaded. A glTF whose data could
+	// not be brought back is not resident, and acquiring it again returns
+	// false without trying until `retry` is called for its path.
+	bool acquire(std::shared_ptr<LoadedGLTF> gltf, MeshBuffer& mesh_buffer);
+	void retry(const std::string& path);
+	bool is_resident(const LoadedGLTF& gltf) const;
+	// Returns the paths of the evicted glTFs.
+	std::vector<std::string> evict(MeshBuffer& mesh_buffer);
+	void end_frame();
+	void collect_stats(stats::Report& report) const;
+private:
+	struct Entry {
+		std::shared_ptr<LoadedGLTF> gltf;
+		std::size_t bytes;
+		std::size_t last_used;
+	};
+
+	void release(Entry& entry, MeshBuffer& mesh_buffer);
+
+	// Most recently used at the front
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+	// Paths which failed to reload
+	std::unordered_set<std::string> failed;
+
+	CpuResidency cpu_residency {CpuResidency::KEEP};
+	std::size_t budget {default_budget};
+	std::size_t resident {0};
+	std::size_t frame {0};
+
+	std::size_t hits {0};
+	std::size_t misses {0};
+	std::size_t evictions {0};
+};
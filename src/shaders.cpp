@@ -12,15 +12,103 @@ constexpr std::string_view vert_shader = R"(
 
     layout(location = 0) in vec3 position;
     layout(location = 1) in vec2 texcoord_in;
+    // Instanced attribute which starts at the base_instance of the command,
+    // giving the index of the DrawData of each instance
+    layout(location = 2) in uint draw_id;
+    layout(location = 3) in vec3 normal_in;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
 
-    uniform mat4 model;
     uniform mat4 view_proj;
 
+    // The depth prepass computes the position the same way, and the depth
+    // it leaves behind must match exactly for the GL_EQUAL test of the
+    // shading pass
+    invariant gl_Position;
+
     out vec2 texcoord;
+    out vec3 world_position;
+    out vec3 world_normal;
+    flat out uint material;
 
     void main() {
-        gl_Position = view_proj * model * vec4(position, 1.0);
+        mat4 model = draws[draw_id].model;
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+        world_position = vec3(model * vec4(position, 1.0));
+        // The inverse transpose of the model matrix, computed once per draw
+        // when the commands are written
+        world_normal = draws[draw_id].normal_matrix * normal_in;
         texcoord = texcoord_in;
+        material = draws[draw_id].material;
+    }
+)";
+
+// Reads the vertices from the vertex buffer bound as an SSBO instead of
+// vertex attributes, in the layout given by the VertexFormat of the draw.
+// gl_VertexID already includes the base_vertex of the command. Only the draw
+// id still comes from an attribute, since GL 4.5 has no gl_DrawID.
+constexpr std::string_view pulling_vert_shader = R"(
+    #version 450 core
+
+    layout(location = 2) in uint draw_id;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        uint vertex_format;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
+
+    struct VertexFormat {
+        uint stride;
+        uint position;
+        uint normal;
+        uint texcoord;
+    };
+    layout(binding = 8, std430) readonly buffer Vertices {
+        float vertices[];
+    };
+    layout(binding = 9, std430) readonly buffer VertexFormats {
+        VertexFormat formats[];
+    };
+    // VertexFormat::none
+    const uint no_attribute = 0xffffffffu;
+
+    uniform mat4 view_proj;
+
+    invariant gl_Position;
+
+    out vec2 texcoord;
+    out vec3 world_position;
+    out vec3 world_normal;
+    flat out uint material;
+
+    void main() {
+        VertexFormat attributes = formats[draws[draw_id].vertex_format];
+        uint base = uint(gl_VertexID) * attributes.stride;
+        vec3 position = vec3(vertices[base + attributes.position],
+                             vertices[base + attributes.position + 1],
+                             vertices[base + attributes.position + 2]);
+        vec3 normal = vec3(vertices[base + attributes.normal],
+                           vertices[base + attributes.normal + 1],
+                           vertices[base + attributes.normal + 2]);
+        mat4 model = draws[draw_id].model;
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+        world_position = vec3(model * vec4(position, 1.0));
+        world_normal = draws[draw_id].normal_matrix * normal;
+        texcoord = attributes.texcoord == no_attribute ? vec2(0.0)
+            : vec2(vertices[base + attributes.texcoord], vertices[base + attributes.texcoord + 1]);
+        material = draws[draw_id].material;
     }
 )";
 
@@ -28,33 +116,841 @@ constexpr std::string_view frag_shader = R"(
 	#version 450 core
 
 	in vec2 texcoord;
+	in vec3 world_position;
+	in vec3 world_normal;
+	flat in uint material;
 	out vec4 fragcolor;
 
+	struct Material {
+		vec4 base_color;
+		float metallic;
+		float roughness;
+	};
+	layout(binding = 1, std430) readonly buffer Materials {
+		Material materials[];
+	};
+
 	layout(location = 0) uniform sampler2D albedo_texture;
-	layout(binding = 0, std140) uniform Material {
+
+	// Defined by `lighting_shader`
+	float view_depth(float window_depth);
+	vec3 shade_lights(vec3 albedo, vec3 position, vec3 normal, float depth, float metallic, float roughness);
+
+	// Counts the fragments shaded to measure overdraw. Depth is tested
+	// before shading, so fragments which fail it are not counted, which is
+	// what the driver does anyway for a shader without side effects.
+	layout(early_fragment_tests) in;
+	layout(binding = 0, offset = 0) uniform atomic_uint shaded_fragments;
+	uniform bool count_fragments;
+
+	void main() {
+		vec4 color = materials[material].base_color * texture(albedo_texture, texcoord);
+		color.rgb = shade_lights(color.rgb, world_position, world_normal, view_depth(gl_FragCoord.z),
+					 materials[material].metallic, materials[material].roughness);
+		fragcolor = color;
+		if (count_fragments) {
+			atomicCounterIncrement(shaded_fragments);
+		}
+	}
+)";
+
+// The clustered lights and their shadows, linked into every fragment shader
+// which shades so they all light the same way. `depth` is in view space.
+constexpr std::string_view lighting_shader = R"(
+	#version 450 core
+
+	// The lights assigned to each cluster by the cluster shader, the grid
+	// must match LightGrid.
+	const uvec3 grid = uvec3(16, 9, 24);
+	const uint max_cluster_lights = 128;
+	const float pi = 3.14159265;
+	const float ambient = 0.03;
+
+	struct Light {
+		vec4 position_radius;
+		vec4 direction_range;
+		vec4 color_intensity;
+		vec4 cone_type;
+	};
+	layout(binding = 11, std430) readonly buffer Lights {
+		Light lights[];
+	};
+	layout(binding = 12, std430) readonly buffer ClusterCounts {
+		uint cluster_counts[];
+	};
+	layout(binding = 13, std430) readonly buffer ClusterLights {
+		uint cluster_lights[];
+	};
+	layout(location = 10) uniform vec3 camera_position;
+	// Without lights, the albedo is shown unlit
+	layout(location = 11) uniform uint light_count;
+	layout(location = 12) uniform vec2 viewport;
+	layout(location = 13) uniform vec2 depth_range;
+
+	// The layers of the shadow maps of each light, the cascades must
+	// match ShadowMaps.
+	const uint cascades = 4;
+	struct ShadowLayers {
+		int first;
+		int count;
+	};
+	layout(binding = 14, std430) readonly buffer ShadowMatrices {
+		mat4 shadow_matrices[];
+	};
+	layout(binding = 15, std430) readonly buffer LightShadows {
+		ShadowLayers light_shadows[];
+	};
+	layout(binding = 2) uniform sampler2DArrayShadow shadow_maps;
+	// View depth where each cascade ends
+	layout(location = 14) uniform vec4 cascade_splits;
+	layout(location = 15) uniform bool shadows;
+
+	// The depth in view space of a depth in the depth buffer.
+	float view_depth(float window_depth) {
+		float z_near = depth_range.x;
+		float z_far = depth_range.y;
+		float z = window_depth * 2.0 - 1.0;
+		return 2.0 * z_near * z_far / (z_far + z_near - z * (z_far - z_near));
+	}
+
+	uint cluster_index(float depth) {
+		float z_near = depth_range.x;
+		float z_far = depth_range.y;
+		uint slice = uint(clamp(log(depth / z_near) / log(z_far / z_near) * float(grid.z), 0.0, float(grid.z - 1)));
+		uvec2 tile = min(uvec2(gl_FragCoord.xy / viewport * vec2(grid.xy)), grid.xy - 1);
+		return (slice * grid.y + tile.y) * grid.x + tile.x;
+	}
+
+	// Metallic-roughness BRDF of glTF, GGX distribution with the Smith
+	// geometry term and Schlick's Fresnel.
+	vec3 shade(Light light, vec3 position, vec3 n, vec3 v, vec3 albedo, float metallic, float roughness) {
+		uint type = uint(light.cone_type.z);
+		vec3 l;
+		float attenuation = 1.0;
+		if (type == 0) {
+			l = -light.direction_range.xyz;
+		} else {
+			vec3 to_light = light.position_radius.xyz - position;
+			float light_distance = length(to_light);
+			l = to_light / light_distance;
+			attenuation = 1.0 / max(light_distance * light_distance, 1e-4);
+			float range = light.direction_range.w;
+			if (range > 0.0) {
+				attenuation *= clamp(1.0 - pow(light_distance / range, 4.0), 0.0, 1.0);
+			}
+			if (type == 2) {
+				float cos_angle = dot(light.direction_range.xyz, -l);
+				float inner = light.cone_type.x;
+				float outer = light.cone_type.y;
+				float cone = clamp((cos_angle - outer) / max(inner - outer, 1e-4), 0.0, 1.0);
+				attenuation *= cone * cone;
+			}
+		}
+
+		float n_l = dot(n, l);
+		if (n_l <= 0.0 || attenuation <= 0.0) {
+			return vec3(0.0);
+		}
+		vec3 h = normalize(l + v);
+		float n_v = max(dot(n, v), 1e-4);
+		float n_h = max(dot(n, h), 0.0);
+		float alpha = roughness * roughness;
+		float alpha2 = alpha * alpha;
+		float d = n_h * n_h * (alpha2 - 1.0) + 1.0;
+		float distribution = alpha2 / (pi * d * d);
+		float k = alpha / 2.0;
+		float geometry = n_l / (n_l * (1.0 - k) + k) * n_v / (n_v * (1.0 - k) + k);
+		vec3 f0 = mix(vec3(0.04), albedo, metallic);
+		vec3 fresnel = f0 + (1.0 - f0) * pow(1.0 - max(dot(h, v), 0.0), 5.0);
+
+		vec3 specular = distribution * geometry * fresnel / (4.0 * n_l * n_v);
+		vec3 diffuse = (1.0 - fresnel) * (1.0 - metallic) * albedo / pi;
+		vec3 radiance = light.color_intensity.rgb * light.color_intensity.w * attenuation;
+		return (diffuse + specular) * radiance * n_l;
+	}
+
+	// How much of the light reaches `position`, from four samples of its
+	// shadow map each blending four texels.
+	float shadow(uint index, vec3 position, float depth) {
+		// The buffers are only bound while there are shadows
+		if (!shadows) {
+			return 1.0;
+		}
+		ShadowLayers layers = light_shadows[index];
+		if (layers.first < 0) {
+			return 1.0;
+		}
+		int layer = layers.first;
+		uint type = uint(lights[index].cone_type.z);
+		if (type == 0) {
+			// The first cascade reaching the fragment, the last one
+			// covers the whole scene when there are fewer
+			int cascade = int(dot(vec4(greaterThan(vec4(depth), cascade_splits)), vec4(1.0)));
+			layer += min(cascade, layers.count - 1);
+		} else if (type == 1) {
+			vec3 d = position - lights[index].position_radius.xyz;
+			vec3 a = abs(d);
+			int face = a.x >= a.y && a.x >= a.z ? (d.x > 0.0 ? 0 : 1)
+				: a.y >= a.z ? (d.y > 0.0 ? 2 : 3) : (d.z > 0.0 ? 4 : 5);
+			layer += face;
+		}
+
+		vec4 p = shadow_matrices[layer] * vec4(position, 1.0);
+		p.xyz = p.xyz / p.w * 0.5 + 0.5;
+		if (any(lessThan(p.xy, vec2(0.0))) || any(greaterThan(p.xyz, vec3(1.0)))) {
+			return 1.0;
+		}
+		vec2 texel = 0.5 / vec2(textureSize(shadow_maps, 0).xy);
+		float lit = 0.0;
+		for (int y = -1; y <= 1; y += 2) {
+			for (int x = -1; x <= 1; x += 2) {
+				lit += texture(shadow_maps, vec4(p.xy + vec2(x, y) * texel, float(layer), p.z));
+			}
+		}
+		return lit * 0.25;
+	}
+
+	// The albedo lit by the lights of the cluster of the fragment, or left
+	// as it is without lights.
+	vec3 shade_lights(vec3 albedo, vec3 position, vec3 normal, float depth, float metallic, float roughness) {
+		if (light_count == 0) {
+			return albedo;
+		}
+		vec3 n = normalize(normal);
+		vec3 v = normalize(camera_position - position);
+		roughness = clamp(roughness, 0.05, 1.0);
+
+		uint cluster = cluster_index(depth);
+		vec3 lit = ambient * albedo;
+		for (uint i = 0; i < cluster_counts[cluster]; ++i) {
+			uint index = cluster_lights[cluster * max_cluster_lights + i];
+			vec3 light = shade(lights[index], position, n, v, albedo, metallic, roughness);
+			if (light != vec3(0.0)) {
+				light *= shadow(index, position, depth);
+			}
+			lit += light;
+		}
+		return lit;
+	}
+)";
+
+// Reads the position-only stream of the MeshBuffer, so only the positions
+// are fetched. The position is computed exactly like in `vert_shader`.
+constexpr std::string_view depth_vert_shader = R"(
+    #version 450 core
+
+    layout(location = 0) in vec3 position;
+    layout(location = 2) in uint draw_id;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
+
+    uniform mat4 view_proj;
+
+    invariant gl_Position;
+
+    void main() {
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+    }
+)";
+
+// Only the depth is written by the prepass.
+constexpr std::string_view depth_frag_shader = R"(
+	#version 450 core
+
+	void main() {
+	}
+)";
+
+// Pulls the positions like `pulling_vert_shader`, for depth-only passes
+// drawing meshes in layouts the position stream does not have. The position
+// is computed exactly like in `pulling_vert_shader`.
+constexpr std::string_view pulling_depth_vert_shader = R"(
+    #version 450 core
+
+    layout(location = 2) in uint draw_id;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        uint vertex_format;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
+
+    struct VertexFormat {
+        uint stride;
+        uint position;
+        uint normal;
+        uint texcoord;
+    };
+    layout(binding = 8, std430) readonly buffer Vertices {
+        float vertices[];
+    };
+    layout(binding = 9, std430) readonly buffer VertexFormats {
+        VertexFormat formats[];
+    };
+
+    uniform mat4 view_proj;
+
+    invariant gl_Position;
+
+    void main() {
+        VertexFormat attributes = formats[draws[draw_id].vertex_format];
+        uint base = uint(gl_VertexID) * attributes.stride;
+        vec3 position = vec3(vertices[base + attributes.position],
+                             vertices[base + attributes.position + 1],
+                             vertices[base + attributes.position + 2]);
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+    }
+)";
+
+// The visibility buffer keeps, for each pixel, the draw and the three
+// vertices of the triangle covering it, as absolute indices into the vertex
+// buffer since gl_VertexID includes the base vertex. The draw is offset by
+// one so that 0 means nothing was drawn. Only the geometry shader sees the
+// three vertices of a triangle.
+constexpr std::string_view visibility_vert_shader = R"(
+    #version 450 core
+
+    layout(location = 0) in vec3 position;
+    layout(location = 2) in uint draw_id;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
+
+    layout(location = 1) uniform mat4 view_proj;
+
+    invariant gl_Position;
+
+    flat out uint vertex;
+    flat out uint draw;
+
+    void main() {
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+        vertex = uint(gl_VertexID);
+        draw = draw_id;
+    }
+)";
+
+// Same as `visibility_vert_shader`, with the position pulled like in
+// `pulling_vert_shader`.
+constexpr std::string_view pulling_visibility_vert_shader = R"(
+    #version 450 core
+
+    layout(location = 2) in uint draw_id;
+
+    struct Draw {
+        mat4 model;
+        uint material;
+        uint vertex_format;
+        mat3 normal_matrix;
+    };
+    layout(binding = 0, std430) readonly buffer Draws {
+        Draw draws[];
+    };
+
+    struct VertexFormat {
+        uint stride;
+        uint position;
+        uint normal;
+        uint texcoord;
+    };
+    layout(binding = 8, std430) readonly buffer Vertices {
+        float vertices[];
+    };
+    layout(binding = 9, std430) readonly buffer VertexFormats {
+        VertexFormat formats[];
+    };
+
+    layout(location = 1) uniform mat4 view_proj;
+
+    invariant gl_Position;
+
+    flat out uint vertex;
+    flat out uint draw;
+
+    void main() {
+        VertexFormat attributes = formats[draws[draw_id].vertex_format];
+        uint base = uint(gl_VertexID) * attributes.stride;
+        vec3 position = vec3(vertices[base + attributes.position],
+                             vertices[base + attributes.position + 1],
+                             vertices[base + attributes.position + 2]);
+        gl_Position = view_proj * draws[draw_id].model * vec4(position, 1.0);
+        vertex = uint(gl_VertexID);
+        draw = draw_id;
+    }
+)";
+
+constexpr std::string_view visibility_geom_shader = R"(
+    #version 450 core
+
+    layout(triangles) in;
+    layout(triangle_strip, max_vertices = 3) out;
+
+    flat in uint vertex[];
+    flat in uint draw[];
+    flat out uvec4 triangle;
+
+    void main() {
+        for (int i = 0; i < 3; ++i) {
+            gl_Position = gl_in[i].gl_Position;
+            triangle = uvec4(draw[0] + 1u, vertex[0], vertex[1], vertex[2]);
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+)";
+
+constexpr std::string_view visibility_frag_shader = R"(
+	#version 450 core
+
+	flat in uvec4 triangle;
+	out uvec4 visibility;
+
+	void main() {
+		visibility = triangle;
+	}
+)";
+
+// A triangle covering the screen, at the material depth of `slot`. Resolving
+// draws one per texture slot with GL_EQUAL against the material depth left
+// by the classification, so only the pixels of that slot are shaded. Depths
+// are multiples of 2^-24, which a 32-bit float holds exactly through the
+// viewport transform, so up to 2^24 slots get a depth of their own.
+constexpr std::string_view fullscreen_vert_shader = R"(
+	#version 450 core
+
+	layout(location = 3) uniform uint slot;
+
+	void main() {
+		vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+		float depth = float(slot + 1u) / 16777216.0;
+		gl_Position = vec4(corner * 2.0 - 1.0, depth * 2.0 - 1.0, 1.0);
+	}
+)";
+
+// Turns the draw of each pixel into the depth of its texture slot.
+constexpr std::string_view classify_frag_shader = R"(
+	#version 450 core
+
+	layout(binding = 1) uniform usampler2D visibility;
+	layout(binding = 10, std430) readonly buffer DrawSlots {
+		uint slots[];
+	};
+
+	void main() {
+		uvec4 triangle = texelFetch(visibility, ivec2(gl_FragCoord.xy), 0);
+		if (triangle.x == 0u) {
+			discard;
+		}
+		gl_FragDepth = float(slots[triangle.x - 1u] + 1u) / 16777216.0;
+	}
+)";
+
+// Shades each pixel once from its triangle. The vertices are pulled from the
+// vertex buffer and projected again, and the barycentrics of the pixel give
+// its texture coordinates, position and normal, which are lit like in
+// `frag_shader`. The barycentrics of the neighbouring pixels give the
+// gradients for the mip level, since those pixels may belong to other
+// triangles. The depth of the pixel is the material depth, so the view
+// depth is interpolated from the clip w of the vertices instead.
+constexpr std::string_view resolve_frag_shader = R"(
+	#version 450 core
+
+	struct Draw {
+		mat4 model;
+		uint material;
+		uint vertex_format;
+		mat3 normal_matrix;
+	};
+	layout(binding = 0, std430) readonly buffer Draws {
+		Draw draws[];
+	};
+
+	struct VertexFormat {
+		uint stride;
+		uint position;
+		uint normal;
+		uint texcoord;
+	};
+	layout(binding = 8, std430) readonly buffer Vertices {
+		float vertices[];
+	};
+	layout(binding = 9, std430) readonly buffer VertexFormats {
+		VertexFormat formats[];
+	};
+	// VertexFormat::none
+	const uint no_attribute = 0xffffffffu;
+
+	struct Material {
 		vec4 base_color;
 		float metallic;
 		float roughness;
-	} material;
+	};
+	layout(binding = 1, std430) readonly buffer Materials {
+		Material materials[];
+	};
+
+	layout(binding = 0) uniform sampler2D albedo_texture;
+	layout(binding = 1) uniform usampler2D visibility;
+	layout(location = 1) uniform mat4 view_proj;
+	// Shared with `lighting_shader`
+	layout(location = 12) uniform vec2 viewport;
+
+	// Defined by `lighting_shader`
+	vec3 shade_lights(vec3 albedo, vec3 position, vec3 normal, float depth, float metallic, float roughness);
+
+	layout(binding = 0, offset = 0) uniform atomic_uint shaded_fragments;
+	layout(location = 4) uniform bool count_fragments;
+
+	out vec4 fragcolor;
+
+	vec3 barycentrics(vec2 pixel, vec4 clip[3]) {
+		vec2 p0 = clip[0].xy / clip[0].w;
+		vec2 e1 = clip[1].xy / clip[1].w - p0;
+		vec2 e2 = clip[2].xy / clip[2].w - p0;
+		vec2 d = pixel - p0;
+		float area = e1.x * e2.y - e2.x * e1.y;
+		float b1 = (d.x * e2.y - e2.x * d.y) / area;
+		float b2 = (e1.x * d.y - d.x * e1.y) / area;
+		// Perspective correct
+		vec3 b = vec3(1.0 - b1 - b2, b1, b2) / vec3(clip[0].w, clip[1].w, clip[2].w);
+		return b / (b.x + b.y + b.z);
+	}
 
 	void main() {
-		// vec4 color = material.base_color;
-		vec4 color = texture(albedo_texture, texcoord);
+		uvec4 triangle = texelFetch(visibility, ivec2(gl_FragCoord.xy), 0);
+		Draw draw = draws[triangle.x - 1u];
+		VertexFormat attributes = formats[draw.vertex_format];
+
+		vec4 clip[3];
+		vec3 positions[3];
+		vec3 normals[3];
+		vec2 texcoords[3];
+		for (int i = 0; i < 3; ++i) {
+			uint base = triangle[i + 1] * attributes.stride;
+			vec3 position = vec3(vertices[base + attributes.position],
+					     vertices[base + attributes.position + 1],
+					     vertices[base + attributes.position + 2]);
+			positions[i] = vec3(draw.model * vec4(position, 1.0));
+			clip[i] = view_proj * vec4(positions[i], 1.0);
+			normals[i] = draw.normal_matrix * vec3(vertices[base + attributes.normal],
+							       vertices[base + attributes.normal + 1],
+							       vertices[base + attributes.normal + 2]);
+			texcoords[i] = attributes.texcoord == no_attribute ? vec2(0.0)
+				: vec2(vertices[base + attributes.texcoord], vertices[base + attributes.texcoord + 1]);
+		}
+
+		vec2 pixel = gl_FragCoord.xy / viewport * 2.0 - 1.0;
+		vec2 step = 2.0 / viewport;
+		vec3 weights = barycentrics(pixel, clip);
+		mat3x2 uvs = mat3x2(texcoords[0], texcoords[1], texcoords[2]);
+		vec2 texcoord = uvs * weights;
+		vec2 dx = uvs * barycentrics(pixel + vec2(step.x, 0.0), clip) - texcoord;
+		vec2 dy = uvs * barycentrics(pixel + vec2(0.0, step.y), clip) - texcoord;
+
+		vec3 world_position = mat3(positions[0], positions[1], positions[2]) * weights;
+		vec3 world_normal = mat3(normals[0], normals[1], normals[2]) * weights;
+		float depth = dot(vec3(clip[0].w, clip[1].w, clip[2].w), weights);
+		Material surface = materials[draw.material];
+
+		vec4 color = surface.base_color * textureGrad(albedo_texture, texcoord, dx, dy);
+		color.rgb = shade_lights(color.rgb, world_position, world_normal, depth, surface.metallic,
+					 surface.roughness);
 		fragcolor = color;
+		if (count_fragments) {
+			atomicCounterIncrement(shaded_fragments);
+		}
 	}
 )";
 
-std::optional<GLuint> compile_program()
+// One invocation per cluster of the LightGrid. The bounds of the cluster are
+// found in view space from the corners of its tile on the near plane, moved
+// along their rays to the depths of its slice. Lights are kept if their
+// sphere of influence touches the bounds.
+constexpr std::string_view cluster_shader = R"(
+	#version 450 core
+
+	layout(local_size_x = 64) in;
+
+	const uvec3 grid = uvec3(16, 9, 24);
+	const uint max_cluster_lights = 128;
+
+	struct Light {
+		vec4 position_radius;
+		vec4 direction_range;
+		vec4 color_intensity;
+		vec4 cone_type;
+	};
+	layout(binding = 11, std430) readonly buffer Lights {
+		Light lights[];
+	};
+	layout(binding = 12, std430) writeonly buffer ClusterCounts {
+		uint cluster_counts[];
+	};
+	layout(binding = 13, std430) writeonly buffer ClusterLights {
+		uint cluster_lights[];
+	};
+
+	uniform mat4 view;
+	uniform mat4 inverse_projection;
+	uniform vec2 depth_range;
+	uniform uint light_count;
+
+	vec3 near_point(vec2 ndc) {
+		vec4 point = inverse_projection * vec4(ndc, -1.0, 1.0);
+		return point.xyz / point.w;
+	}
+
+	void main() {
+		uint cluster = gl_GlobalInvocationID.x;
+		if (cluster >= grid.x * grid.y * grid.z) {
+			return;
+		}
+		uvec3 id = uvec3(cluster % grid.x, (cluster / grid.x) % grid.y, cluster / (grid.x * grid.y));
+
+		float z_near = depth_range.x;
+		float z_far = depth_range.y;
+		float slice_near = z_near * pow(z_far / z_near, float(id.z) / float(grid.z));
+		float slice_far = z_near * pow(z_far / z_near, float(id.z + 1) / float(grid.z));
+		vec2 tile_min = vec2(id.xy) / vec2(grid.xy) * 2.0 - 1.0;
+		vec2 tile_max = vec2(id.xy + 1) / vec2(grid.xy) * 2.0 - 1.0;
+
+		vec3 corners[4] = vec3[](
+			near_point(tile_min),
+			near_point(vec2(tile_max.x, tile_min.y)),
+			near_point(vec2(tile_min.x, tile_max.y)),
+			near_point(tile_max)
+		);
+		vec3 box_min = vec3(1e30);
+		vec3 box_max = vec3(-1e30);
+		for (int i = 0; i < 4; ++i) {
+			vec3 closer = corners[i] * (slice_near / -corners[i].z);
+			vec3 further = corners[i] * (slice_far / -corners[i].z);
+			box_min = min(box_min, min(closer, further));
+			box_max = max(box_max, max(closer, further));
+		}
+
+		uint count = 0;
+		for (uint i = 0; i < light_count && count < max_cluster_lights; ++i) {
+			// Directional lights reach every cluster
+			if (uint(lights[i].cone_type.z) != 0) {
+				vec3 center = vec3(view * vec4(lights[i].position_radius.xyz, 1.0));
+				vec3 offset = clamp(center, box_min, box_max) - center;
+				float radius = lights[i].position_radius.w;
+				if (dot(offset, offset) > radius * radius) {
+					continue;
+				}
+			}
+			cluster_lights[cluster * max_cluster_lights + count] = i;
+			++count;
+		}
+		cluster_counts[cluster] = count;
+	}
+)";
+
+// Work items are instances of the RenderList, a surviving instance claims
+// the next slot of its command by incrementing its instance count, and
+// writes the index of its DrawData there.
+//
+// With occlusion culling, this runs twice per frame. The first pass only
+// keeps instances which were visible last frame, and those are drawn to
+// build the depth pyramid. The second pass tests every instance against the
+// pyramid, draws those which became visible into the second copy of the
+// commands and remembers which are visible for the next frame.
+constexpr std::string_view cull_shader = R"(
+	#version 450 core
+
+	layout(local_size_x = 64) in;
+
+	struct Instance {
+		vec4 bounds_min;
+		vec4 bounds_max;
+		uint draw_id;
+		uint group;
+	};
+	layout(binding = 2, std430) readonly buffer Instances {
+		Instance instances[];
+	};
+	// Position of the command of each group in the indirect buffer
+	layout(binding = 3, std430) readonly buffer Positions {
+		uint positions[];
+	};
+
+	struct Command {
+		uint count;
+		uint instance_count;
+		uint first_index;
+		uint base_vertex;
+		uint base_instance;
+	};
+	layout(binding = 4, std430) buffer Commands {
+		Command commands[];
+	};
+	layout(binding = 5, std430) writeonly buffer DrawIds {
+		uint draw_ids[];
+	};
+	layout(binding = 6, std430) buffer Visibility {
+		uint visible[];
+	};
+	layout(binding = 7, std430) buffer Counters {
+		uint occluded;
+		uint occluded_triangles;
+	};
+
+	layout(binding = 1) uniform sampler2D depth_pyramid;
+
+	uniform vec4 planes[6];
+	uniform uint instance_count;
+	uniform uint group_count;
+	// 0 without occlusion culling, 1 and 2 for the two passes
+	uniform uint pass;
+	uniform mat4 view_proj;
+
+	bool in_frustum(Instance instance) {
+		for (int p = 0; p < 6; ++p) {
+			vec3 corner = mix(instance.bounds_min.xyz, instance.bounds_max.xyz, greaterThan(planes[p].xyz, vec3(0.0)));
+			if (dot(planes[p].xyz, corner) + planes[p].w < 0.0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Projects the bounds and compares their nearest depth with the
+	// furthest depth of the pyramid over the area they cover. The level is
+	// picked so the area is at most 2x2 texels.
+	bool is_occluded(Instance instance) {
+		vec3 uv_min = vec3(1.0);
+		vec3 uv_max = vec3(0.0);
+		for (int i = 0; i < 8; ++i) {
+			vec3 corner = mix(instance.bounds_min.xyz, instance.bounds_max.xyz, bvec3(i & 1, i & 2, i & 4));
+			vec4 clip = view_proj * vec4(corner, 1.0);
+			// Crosses the near plane, the projection is meaningless
+			if (clip.w <= 0.0) {
+				return false;
+			}
+			vec3 uv = clip.xyz / clip.w * 0.5 + 0.5;
+			uv_min = min(uv_min, uv);
+			uv_max = max(uv_max, uv);
+		}
+		uv_min = clamp(uv_min, 0.0, 1.0);
+		uv_max = clamp(uv_max, 0.0, 1.0);
+
+		vec2 size = vec2(textureSize(depth_pyramid, 0));
+		vec2 extent = (uv_max.xy - uv_min.xy) * size;
+		int levels = textureQueryLevels(depth_pyramid);
+		int level = clamp(int(ceil(log2(max(max(extent.x, extent.y), 1.0)))), 0, levels - 1);
+
+		ivec2 level_size = textureSize(depth_pyramid, level);
+		ivec2 lo = clamp(ivec2(uv_min.xy * level_size), ivec2(0), level_size - 1);
+		ivec2 hi = clamp(ivec2(uv_max.xy * level_size), ivec2(0), level_size - 1);
+		float depth = max(max(texelFetch(depth_pyramid, lo, level).r,
+				      texelFetch(depth_pyramid, ivec2(hi.x, lo.y), level).r),
+				  max(texelFetch(depth_pyramid, ivec2(lo.x, hi.y), level).r,
+				      texelFetch(depth_pyramid, hi, level).r));
+		return uv_min.z > depth;
+	}
+
+	void draw(Instance instance, uint copy) {
+		uint command = positions[instance.group] + copy * group_count;
+		uint slot = atomicAdd(commands[command].instance_count, 1);
+		draw_ids[commands[command].base_instance + slot] = instance.draw_id;
+	}
+
+	void main() {
+		uint i = gl_GlobalInvocationID.x;
+		if (i >= instance_count) {
+			return;
+		}
+
+		Instance instance = instances[i];
+		bool inside = in_frustum(instance);
+		if (pass == 0) {
+			if (inside) {
+				draw(instance, 0);
+			}
+		} else if (pass == 1) {
+			if (inside && visible[i] != 0) {
+				draw(instance, 0);
+			}
+		} else {
+			bool drawn = inside && visible[i] != 0;
+			bool hidden = inside && is_occluded(instance);
+			if (hidden && !drawn) {
+				atomicAdd(occluded, 1);
+				atomicAdd(occluded_triangles, commands[positions[instance.group]].count / 3);
+			}
+			if (inside && !hidden && !drawn) {
+				draw(instance, 1);
+			}
+			visible[i] = (inside && !hidden) ? 1 : 0;
+		}
+	}
+)";
+
+// Builds one level of the depth pyramid from the level above, or from the
+// depth buffer for the first level. Each texel keeps the furthest depth of
+// the texels it covers, which is 3 instead of 2 along odd edges so nothing
+// is skipped.
+constexpr std::string_view depth_reduce_shader = R"(
+	#version 450 core
+
+	layout(local_size_x = 8, local_size_y = 8) in;
+
+	layout(binding = 0) uniform sampler2D source;
+	layout(binding = 0, r32f) uniform writeonly image2D destination;
+
+	uniform int source_level;
+	// 1 to copy the depth buffer, 2 to reduce a level
+	uniform int scale;
+
+	void main() {
+		ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+		ivec2 size = imageSize(destination);
+		if (any(greaterThanEqual(pos, size))) {
+			return;
+		}
+
+		ivec2 source_size = textureSize(source, source_level);
+		ivec2 extent = ivec2(scale);
+		if (scale == 2) {
+			extent += ivec2(equal(pos, size - 1)) * (source_size & 1);
+		}
+
+		float depth = 0.0;
+		for (int y = 0; y < extent.y; ++y) {
+			for (int x = 0; x < extent.x; ++x) {
+				ivec2 texel = min(pos * scale + ivec2(x, y), source_size - 1);
+				depth = max(depth, texelFetch(source, texel, source_level).r);
+			}
+		}
+		imageStore(destination, pos, vec4(depth));
+	}
+)";
+
+static std::optional<GLuint> link_program(const std::vector<std::pair<std::string_view, GLenum>>& sources)
 {
 	GLint success;
 	auto program = glCreateProgram();
 
-	std::vector<std::pair<std::string_view, GLuint>> shaders = {
-		{vert_shader, glCreateShader(GL_VERTEX_SHADER)},
-		{frag_shader, glCreateShader(GL_FRAGMENT_SHADER)}
-	};
-
-	for (auto [src, shader] : shaders) {
+	for (auto [src, type] : sources) {
+		auto shader = glCreateShader(type);
 		const auto* data = src.data();
 		auto size = static_cast<GLint>(src.size());
 		glShaderSource(shader, 1, &data, &size);
@@ -88,3 +984,93 @@ std::optional<GLuint> compile_program()
 
 	return std::optional<GLuint>{program};
 }
+
+std::optional<GLuint> compile_program()
+{
+	return link_program({
+		{vert_shader, GL_VERTEX_SHADER},
+		{frag_shader, GL_FRAGMENT_SHADER},
+		{lighting_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_pulling_program()
+{
+	return link_program({
+		{pulling_vert_shader, GL_VERTEX_SHADER},
+		{frag_shader, GL_FRAGMENT_SHADER},
+		{lighting_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_depth_program()
+{
+	return link_program({
+		{depth_vert_shader, GL_VERTEX_SHADER},
+		{depth_frag_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_pulling_depth_program()
+{
+	return link_program({
+		{pulling_depth_vert_shader, GL_VERTEX_SHADER},
+		{depth_frag_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_visibility_program()
+{
+	return link_program({
+		{visibility_vert_shader, GL_VERTEX_SHADER},
+		{visibility_geom_shader, GL_GEOMETRY_SHADER},
+		{visibility_frag_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_pulling_visibility_program()
+{
+	return link_program({
+		{pulling_visibility_vert_shader, GL_VERTEX_SHADER},
+		{visibility_geom_shader, GL_GEOMETRY_SHADER},
+		{visibility_frag_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_classify_program()
+{
+	return link_program({
+		{fullscreen_vert_shader, GL_VERTEX_SHADER},
+		{classify_frag_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_resolve_program()
+{
+	return link_program({
+		{fullscreen_vert_shader, GL_VERTEX_SHADER},
+		{resolve_frag_shader, GL_FRAGMENT_SHADER},
+		{lighting_shader, GL_FRAGMENT_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_cluster_program()
+{
+	return link_program({
+		{cluster_shader, GL_COMPUTE_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_cull_program()
+{
+	return link_program({
+		{cull_shader, GL_COMPUTE_SHADER},
+	});
+}
+
+std::optional<GLuint> compile_depth_reduce_program()
+{
+	return link_program({
+		{depth_reduce_shader, GL_COMPUTE_SHADER},
+	});
+}
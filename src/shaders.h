@@ -5,3 +5,26 @@
 #include <optional>
 
 std::optional<GLuint> compile_program();
+// Depth-only program reading the position stream, for the depth prepass.
+std::optional<GLuint> compile_depth_program();
+// Same fragment shader as `compile_program`, with a vertex shader pulling
+// the vertices from the vertex SSBO in the format given by the draw.
+std::optional<GLuint> compile_pulling_program();
+// Same as `compile_depth_program`, pulling the positions from the vertex
+// SSBO, for meshes the position stream does not have.
+std::optional<GLuint> compile_pulling_depth_program();
+// Rasterizes the draw and the vertices of the triangle of each pixel into
+// the visibility buffer.
+std::optional<GLuint> compile_visibility_program();
+// Same, pulling the positions from the vertex SSBO.
+std::optional<GLuint> compile_pulling_visibility_program();
+// Fullscreen passes of the visibility buffer, the first writes the material
+// depth of each pixel and the second shades the pixels of one texture.
+std::optional<GLuint> compile_classify_program();
+std::optional<GLuint> compile_resolve_program();
+// Compute shader assigning the lights to the clusters of a LightGrid.
+std::optional<GLuint> compile_cluster_program();
+// Compute shader culling the RenderList on the GPU.
+std::optional<GLuint> compile_cull_program();
+// Compute shader building the depth pyramid for occlusion culling.
+std::optional<GLuint> compile_depth_reduce_program();
@@ -0,0 +1,315 @@
+#include "shadow_maps.h"
+#include "culling.h"
+#include "light_grid.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+// Near plane of spot and point lights
+static constexpr float light_near = 0.05f;
+// Widest spot light cone a perspective can cover
+static constexpr float max_cone = 2.9670597f;	// 170 degrees
+static constexpr float right_angle = 1.5707963f;
+
+// Any up vector which is not along the direction
+static glm::vec3 up_for(const glm::vec3& direction)
+{
+	return std::abs(direction.y) > 0.99f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+}
+
+ShadowMaps::ShadowMaps(GLuint depth_program, GLuint pulling_depth_program)
+	: program(depth_program), pulling_program(pulling_depth_program)
+{
+	view_proj_uniform = glGetUniformLocation(program, "view_proj");
+	if (pulling_program != 0) {
+		pulling_view_proj_uniform = glGetUniformLocation(pulling_program, "view_proj");
+	}
+
+	glCreateFramebuffers(1, &framebuffer);
+	glNamedFramebufferDrawBuffer(framebuffer, GL_NONE);
+	glNamedFramebufferReadBuffer(framebuffer, GL_NONE);
+	glCreateBuffers(1, &matrix_buffer);
+	glNamedBufferStorage(matrix_buffer, static_cast<GLsizeiptr>(max_layers * sizeof(glm::mat4)), nullptr,
+			     GL_DYNAMIC_STORAGE_BIT);
+	command_buffer = StreamBuffer<DrawCommand>("shadows.commands");
+	draw_id_buffer = StreamBuffer<std::uint32_t>("shadows.draw_ids");
+}
+
+void ShadowMaps::reserve(std::size_t count)
+{
+	if (count <= texture_layers) {
+		return;
+	}
+	auto layer_bytes = static_cast<std::size_t>(resolution) * resolution * sizeof(float);
+	if (texture != 0) {
+		glDeleteTextures(1, &texture);
+		stats::release_texture(GL_DEPTH_COMPONENT32F, texture_layers * layer_bytes);
+		++resizes;
+	}
+	texture_layers = count;
+	glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &texture);
+	glTextureStorage3D(texture, 1, GL_DEPTH_COMPONENT32F, resolution, resolution,
+			   static_cast<GLsizei>(texture_layers));
+	// Compared in hardware, with linear filtering blending four results
+	glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTextureParameteri(texture, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+	glTextureParameteri(texture, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	stats::record_texture(GL_DEPTH_COMPONENT32F, texture_layers * layer_bytes);
+	invalidate();
+}
+
+void ShadowMaps::update(const std::vector<Light>& new_lights)
+{
+	lights = new_lights;
+	light_layers.resize(lights.size());
+
+	if (lights.size() > light_capacity || light_buffer == 0) {
+		if (light_buffer != 0) {
+			glDeleteBuffers(1, &light_buffer);
+			++resizes;
+		}
+		light_capacity = std::max<std::size_t>(64, light_capacity);
+		while (light_capacity < lights.size()) {
+			light_capacity *= 2;
+		}
+		glCreateBuffers(1, &light_buffer);
+		glNamedBufferStorage(light_buffer, static_cast<GLsizeiptr>(light_capacity * sizeof(LightLayers)),
+				     nullptr, GL_DYNAMIC_STORAGE_BIT);
+		stats::record_event(stats::EventType::RESIZE, "shadows", light_capacity * sizeof(LightLayers));
+	}
+}
+
+void ShadowMaps::invalidate()
+{
+	std::fill(valid.begin(), valid.end(), 0);
+}
+
+// Each slice of the view is covered by its bounding sphere, which keeps the
+// same size while the camera turns as long as the depths of the slice do
+// not change, and the sphere is only moved by whole texels.
+void ShadowMaps::fit_cascades(const Light& light, const Bounds& scene_bounds, const ShadowView& view, float nearest)
+{
+	// Rotation only, so the scene stays put in light space whatever the
+	// camera does
+	auto light_view = glm::lookAt(glm::vec3(0.0f), light.direction, up_for(light.direction));
+	auto scene = transform_bounds(scene_bounds, light_view);
+	// The light looks down -Z, so the near plane is at the largest Z. Every
+	// caster is in range, whatever part of the scene the cascade covers.
+	auto margin = 0.01f * (scene.max.z - scene.min.z) + 1e-3f;
+	auto z_near = -scene.max.z - margin;
+	auto z_far = -scene.min.z + margin;
+
+	auto inverse_view = glm::inverse(view.view);
+	auto tan_y = std::tan(view.fov / 2.0f);
+	auto tan_x = tan_y * view.aspect;
+	auto begin = nearest;
+	for (std::uint32_t cascade = 0; cascade < cascades; ++cascade) {
+		auto end = splits[cascade];
+		glm::vec3 corners[8];
+		glm::vec3 center(0.0f);
+		for (int i = 0; i < 8; ++i) {
+			auto depth = i < 4 ? begin : end;
+			auto x = (i & 1 ? 1.0f : -1.0f) * depth * tan_x;
+			auto y = (i & 2 ? 1.0f : -1.0f) * depth * tan_y;
+			corners[i] = glm::vec3(inverse_view * glm::vec4(x, y, -depth, 1.0f));
+			center += corners[i] / 8.0f;
+		}
+		auto radius = 0.0f;
+		for (const auto& corner : corners) {
+			radius = std::max(radius, glm::length(corner - center));
+		}
+		auto light_center = glm::vec3(light_view * glm::vec4(center, 1.0f));
+		begin = end;
+
+		bool last = false;
+		glm::mat4 projection;
+		if (light_center.x - radius <= scene.min.x && light_center.x + radius >= scene.max.x
+		    && light_center.y - radius <= scene.min.y && light_center.y + radius >= scene.max.y) {
+			projection = glm::ortho(scene.min.x, scene.max.x, scene.min.y, scene.max.y, z_near, z_far);
+			last = true;
+		} else {
+			auto texel = 2.0f * radius / static_cast<float>(resolution);
+			auto x = std::floor(light_center.x / texel) * texel;
+			auto y = std::floor(light_center.y / texel) * texel;
+			projection = glm::ortho(x - radius, x + radius, y - radius, y + radius, z_near, z_far);
+		}
+		matrices.push_back(projection * light_view);
+		if (last) {
+			return;
+		}
+	}
+}
+
+void ShadowMaps::fit(const Bounds& scene_bounds, const ShadowView& view)
+{
+	// Cascades only split the depths the scene covers, anything closer or
+	// further has nothing to shadow
+	auto view_bounds = transform_bounds(scene_bounds, view.view);
+	auto nearest = std::max(view.z_near, -view_bounds.max.z);
+	auto furthest = std::min(view.z_far, -view_bounds.min.z);
+	if (furthest <= nearest) {
+		nearest = view.z_near;
+		furthest = view.z_far;
+	}
+	for (std::uint32_t cascade = 0; cascade < cascades; ++cascade) {
+		auto t = static_cast<float>(cascade + 1) / cascades;
+		auto uniform = nearest + (furthest - nearest) * t;
+		auto logarithmic = nearest * std::pow(furthest / nearest, t);
+		splits[cascade] = uniform + (logarithmic - uniform) * split_lambda;
+	}
+
+	matrices.clear();
+	for (std::size_t i = 0; i < lights.size(); ++i) {
+		const auto& light = lights[i];
+		auto first = matrices.size();
+		if (light.type == LightType::DIRECTIONAL) {
+			fit_cascades(light, scene_bounds, view, nearest);
+		} else if (light.type == LightType::SPOT) {
+			auto cone = std::min(2.0f * std::acos(light.outer_cone), max_cone);
+			auto projection = glm::perspective(cone, 1.0f, light_near, LightGrid::radius(light));
+			matrices.push_back(projection
+					   * glm::lookAt(light.position, light.position + light.direction,
+							 up_for(light.direction)));
+		} else {
+			// Faces in the order of cube maps, +X, -X, +Y, -Y, +Z, -Z
+			static const glm::vec3 faces[6][2] = {
+				{ { 1.0f, 0.0f, 0.0f }, { 0.0f, -1.0f, 0.0f } },
+				{ { -1.0f, 0.0f, 0.0f }, { 0.0f, -1.0f, 0.0f } },
+				{ { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } },
+				{ { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, -1.0f } },
+				{ { 0.0f, 0.0f, 1.0f }, { 0.0f, -1.0f, 0.0f } },
+				{ { 0.0f, 0.0f, -1.0f }, { 0.0f, -1.0f, 0.0f } },
+			};
+			auto projection = glm::perspective(right_angle, 1.0f, light_near, LightGrid::radius(light));
+			for (const auto& [direction, up] : faces) {
+				matrices.push_back(projection
+						   * glm::lookAt(light.position, light.position + direction, up));
+			}
+		}
+
+		// Lights past the last layer cast no shadows
+		if (matrices.size() > max_layers) {
+			matrices.resize(first);
+			light_layers[i] = LightLayers { .first = -1, .count = 0 };
+		} else {
+			light_layers[i] = LightLayers {
+				.first = static_cast<std::int32_t>(first),
+				.count = static_cast<std::int32_t>(matrices.size() - first),
+			};
+		}
+	}
+
+	reserve(matrices.size());
+	rendered.resize(matrices.size());
+	valid.resize(matrices.size(), 0);
+	if (!matrices.empty()) {
+		glNamedBufferSubData(matrix_buffer, 0, static_cast<GLsizeiptr>(matrices.size() * sizeof(glm::mat4)),
+				     matrices.data());
+		stats::record_upload(matrices.size() * sizeof(glm::mat4));
+	}
+	if (!light_layers.empty()) {
+		glNamedBufferSubData(light_buffer, 0, static_cast<GLsizeiptr>(light_layers.size() * sizeof(LightLayers)),
+				     light_layers.data());
+		stats::record_upload(light_layers.size() * sizeof(LightLayers));
+	}
+}
+
+void ShadowMaps::write_casters(const RenderList& render_list)
+{
+	caster_commands = render_list.size();
+	auto* commands = command_buffer.map(caster_commands);
+	auto* draw_ids = draw_id_buffer.map(render_list.instances.size());
+	render_list.write_casters(commands, draw_ids);
+}
+
+std::size_t ShadowMaps::render(GLuint vao, bool pulling)
+{
+	stale.clear();
+	for (std::size_t layer = 0; layer < matrices.size(); ++layer) {
+		if (!valid[layer] || rendered[layer] != matrices[layer]) {
+			stale.push_back(layer);
+		}
+	}
+	if (stale.empty()) {
+		return 0;
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, resolution, resolution);
+	auto depth_program = pulling ? pulling_program : program;
+	auto uniform = pulling ? pulling_view_proj_uniform : view_proj_uniform;
+	glUseProgram(depth_program);
+	glBindVertexArray(vao);
+	glVertexArrayVertexBuffer(vao, 1, draw_id_buffer.id(), static_cast<GLintptr>(draw_id_buffer.offset()),
+				  sizeof(std::uint32_t));
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_buffer.id());
+	// Pushes the depth back by its slope, so surfaces do not shadow
+	// themselves where the texels of the map cross them
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0f, 4.0f);
+	for (auto layer : stale) {
+		glNamedFramebufferTextureLayer(framebuffer, GL_DEPTH_ATTACHMENT, texture, 0, static_cast<GLint>(layer));
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glProgramUniformMatrix4fv(depth_program, uniform, 1, GL_FALSE, &matrices[layer][0][0]);
+		if (caster_commands > 0) {
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+						    reinterpret_cast<const void*>(command_buffer.offset()),
+						    static_cast<GLsizei>(caster_commands), 0);
+		}
+		rendered[layer] = matrices[layer];
+		valid[layer] = 1;
+	}
+	glDisable(GL_POLYGON_OFFSET_FILL);
+	command_buffer.fence();
+	draw_id_buffer.fence();
+	return stale.size();
+}
+
+void ShadowMaps::bind(GLuint shading_program) const
+{
+	// No layers leaves every light unshadowed
+	glProgramUniform1i(shading_program, 15, matrices.empty() ? 0 : 1);
+	if (matrices.empty()) {
+		return;
+	}
+	glProgramUniform4fv(shading_program, 14, 1, splits);
+	glBindTextureUnit(2, texture);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, matrix_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, light_buffer);
+}
+
+void ShadowMaps::delete_buffer()
+{
+	glDeleteTextures(1, &texture);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteBuffers(1, &matrix_buffer);
+	glDeleteBuffers(1, &light_buffer);
+	command_buffer.delete_buffer();
+	draw_id_buffer.delete_buffer();
+}
+
+stats::BufferStats ShadowMaps::stats() const
+{
+	auto commands = command_buffer.stats();
+	auto draw_ids = draw_id_buffer.stats();
+	auto bytes = max_layers * sizeof(glm::mat4) + light_capacity * sizeof(LightLayers) + commands.capacity
+		+ draw_ids.capacity;
+	auto used = matrices.size() * sizeof(glm::mat4) + lights.size() * sizeof(LightLayers) + commands.used
+		+ draw_ids.used;
+	return stats::BufferStats {
+		.capacity = bytes,
+		.used = used,
+		.free = bytes - used,
+		.largest_free = bytes - used,
+		.allocations = 0,
+		.deallocations = 0,
+		.resizes = resizes + commands.resizes + draw_ids.resizes,
+	};
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "buffer.h"
+#include "gltf.h"
+#include "render_list.h"
+#include "stats.h"
+
+#include <glad/gl.h>
+#include <glm/mat4x4.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The camera the directional cascades are fitted to.
+struct ShadowView {
+	glm::mat4 view;
+	float fov;		// vertical, in radians
+	float aspect;
+	float z_near;
+	float z_far;
+};
+
+/// Depth maps of the scene seen from its lights, kept from frame to frame
+/// and only rendered again when they are out of date.
+///
+/// Every map is a layer of a single depth texture array. Spot lights get one
+/// layer, point lights six, one per face of a cube in the usual order, and
+/// directional lights up to `cascades`. Lights are given layers in order
+/// until `max_layers` are used, any more cast no shadows.
+///
+/// Cascades split the depths of the view which hold the scene into slices,
+/// closer slices getting more of the texture. Each cascade covers the
+/// bounding sphere of its slice, moved by whole texels so it does not
+/// shimmer as the camera moves. A cascade whose sphere holds the whole scene
+/// covers the scene instead, and is the last one. Such a cascade only
+/// depends on the scene and the light, and is what a view of a whole model
+/// gets, so views of it from any angle share it.
+///
+/// Each layer keeps the matrix it was rendered with. `fit` computes the
+/// matrices for the current lights and view, and `render` draws the layers
+/// whose matrix changed since, or every layer after `invalidate`, which the
+/// owner calls when the geometry changes. Spot and point lights of a static
+/// scene are rendered once however many views it is drawn from, and so are
+/// directional lights unless the camera is close enough to need cascades
+/// smaller than the scene. Layers are drawn with the depth program and the
+/// position stream, quantized or not, or the pulling depth program when the
+/// meshes are pulled, every instance at its finest level, so they do not
+/// depend on the culling or levels of detail of the view.
+class ShadowMaps {
+public:
+	// These must match the fragment shader
+	static constexpr std::uint32_t cascades = 4;
+	static constexpr std::uint32_t max_layers = 16;
+	static constexpr GLsizei resolution = 1024;
+	// Blend between uniform and logarithmic cascade splits
+	static constexpr float split_lambda = 0.75f;
+
+	ShadowMaps() {}
+	// Both programs transform positions by their `view_proj` uniform.
+	// `pulling_depth_program` may be 0 when vertex pulling is unavailable.
+	ShadowMaps(GLuint depth_program, GLuint pulling_depth_program);
+
+	// Assigns layers to the lights, in world space and in the order the
+	// light grid has them.
+	void update(const std::vector<Light>& lights);
+	// Computes the matrix of every layer for the view. `scene_bounds` must
+	// hold every caster `render` draws, such as the caster bounds of the
+	// render list.
+	void fit(const Bounds& scene_bounds, const ShadowView& view);
+	// Marks every layer out of date.
+	void invalidate();
+	// Writes the commands of every caster of `render_list`, to be called
+	// whenever it is compiled.
+	void write_casters(const RenderList& render_list);
+	// Draws the layers which are out of date with `vao`, whose attribute 0
+	// must be the position unless `pulling`, in any format. Leaves the depth program in
+	// use, and its own framebuffer and viewport bound. Returns the number
+	// of layers drawn.
+	std::size_t render(GLuint vao, bool pulling);
+	// Binds the maps and sets the uniforms the fragment shader reads them
+	// with on `shading_program`.
+	void bind(GLuint shading_program) const;
+	void delete_buffer();
+	stats::BufferStats stats() const;
+private:
+	// Allocates at least `count` layers, dropping every map.
+	void reserve(std::size_t count);
+	// Appends the cascades of a directional light, the first one starting
+	// at the `nearest` depth, the last one covering the scene when it can.
+	void fit_cascades(const Light& light, const Bounds& scene_bounds, const ShadowView& view, float nearest);
+
+	// Laid out for std430
+	struct LightLayers {
+		std::int32_t first;	// -1 for none
+		std::int32_t count;
+	};
+
+	GLuint program {0};
+	GLint view_proj_uniform {-1};
+	GLuint pulling_program {0};
+	GLint pulling_view_proj_uniform {-1};
+
+	GLuint texture {0};
+	GLuint framebuffer {0};
+	std::size_t texture_layers {0};
+	std::size_t resizes {0};
+
+	// The matrix each layer was rendered with, and the one it needs
+	std::vector<glm::mat4> rendered;
+	std::vector<glm::mat4> matrices;
+	std::vector<std::uint8_t> valid;
+	std::vector<Light> lights;
+	std::vector<LightLayers> light_layers;
+	// View depth where each cascade ends, infinite past the last one
+	float splits[cascades] {};
+
+	GLuint matrix_buffer {0};
+	GLuint light_buffer {0};
+	std::size_t light_capacity {0};
+
+	// The commands and draw ids of every caster, only written when the
+	// render list changes and read by every layer drawn until then
+	StreamBuffer<DrawCommand> command_buffer;
+	StreamBuffer<std::uint32_t> draw_id_buffer;
+	std::size_t caster_commands {0};
+
+	// Kept from call to call so drawing does not allocate
+	std::vector<std::size_t> stale;
+};
@@ -0,0 +1,216 @@
+#include "simplify.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+// Symmetric 4x4 matrix, only the upper triangle is stored.
+struct Quadric {
+	double a00, a01, a02, a03;
+	double a11, a12, a13;
+	double a22, a23;
+	double a33;
+
+	Quadric& operator+=(const Quadric& other) {
+		a00 += other.a00; a01 += other.a01; a02 += other.a02; a03 += other.a03;
+		a11 += other.a11; a12 += other.a12; a13 += other.a13;
+		a22 += other.a22; a23 += other.a23;
+		a33 += other.a33;
+		return *this;
+	}
+
+	// Sum of the squared distances of `p` to every plane of the quadric.
+	double error(const glm::vec3& p) const {
+		double x = p.x, y = p.y, z = p.z;
+		return x * x * a00 + 2 * x * y * a01 + 2 * x * z * a02 + 2 * x * a03
+			+ y * y * a11 + 2 * y * z * a12 + 2 * y * a13
+			+ z * z * a22 + 2 * z * a23
+			+ a33;
+	}
+};
+
+static Quadric plane_quadric(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2)
+{
+	auto normal = glm::cross(p1 - p0, p2 - p0);
+	auto length = glm::length(normal);
+	if (length == 0.0f) {
+		return Quadric{};
+	}
+	normal /= length;
+	double a = normal.x, b = normal.y, c = normal.z;
+	double d = -glm::dot(normal, p0);
+	return Quadric {
+		a * a, a * b, a * c, a * d,
+		b * b, b * c, b * d,
+		c * c, c * d,
+		d * d,
+	};
+}
+
+struct Collapse {
+	std::uint32_t from;
+	std::uint32_t to;
+	double cost;
+};
+
+// Vertex to triangle adjacency, stored as one array of triangles with the
+// range of each vertex given by its offset.
+struct Adjacency {
+	std::vector<std::uint32_t> offsets;
+	std::vector<std::uint32_t> triangles;
+
+	void build(const std::vector<std::uint32_t>& indices, std::size_t vertex_count) {
+		offsets.assign(vertex_count + 1, 0);
+		for (auto index : indices) {
+			++offsets[index + 1];
+		}
+		std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+		triangles.resize(indices.size());
+		std::vector<std::uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (std::size_t i = 0; i < indices.size(); ++i) {
+			triangles[fill[indices[i]]++] = static_cast<std::uint32_t>(i / 3);
+		}
+	}
+};
+
+// Checks none of the triangles around `from` turn over when it is moved
+// onto `to`. Triangles containing both become degenerate and are skipped.
+static bool flips(const Vertex* vertices, const std::vector<std::uint32_t>& indices,
+		  const Adjacency& adjacency, std::uint32_t from, std::uint32_t to)
+{
+	for (auto i = adjacency.offsets[from]; i < adjacency.offsets[from + 1]; ++i) {
+		const auto* triangle = &indices[adjacency.triangles[i] * 3];
+		if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+			continue;
+		}
+
+		glm::vec3 before[3], after[3];
+		for (int k = 0; k < 3; ++k) {
+			before[k] = vertices[triangle[k]].pos;
+			after[k] = triangle[k] == from ? vertices[to].pos : before[k];
+		}
+		auto normal_before = glm::cross(before[1] - before[0], before[2] - before[0]);
+		auto normal_after = glm::cross(after[1] - after[0], after[2] - after[0]);
+		if (glm::dot(normal_before, normal_after) <= 0.0f) {
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<std::uint32_t> simplify(const Vertex* vertices, std::size_t vertex_count,
+				    const std::uint32_t* indices, std::size_t index_count,
+				    std::size_t target_count, float& error)
+{
+	std::vector<std::uint32_t> result(indices, indices + index_count);
+
+	std::vector<Quadric> quadrics(vertex_count, Quadric{});
+	for (std::size_t i = 0; i + 2 < result.size(); i += 3) {
+		auto quadric = plane_quadric(vertices[result[i]].pos, vertices[result[i + 1]].pos, vertices[result[i + 2]].pos);
+		for (int k = 0; k < 3; ++k) {
+			quadrics[result[i + k]] += quadric;
+		}
+	}
+
+	double max_cost = 0.0;
+	std::vector<std::pair<std::uint32_t, std::uint32_t>> edges;
+	std::vector<std::uint8_t> locked(vertex_count);
+	std::vector<std::uint8_t> touched(vertex_count);
+	std::vector<std::uint32_t> remap(vertex_count);
+	std::vector<Collapse> collapses;
+	Adjacency adjacency;
+
+	while (result.size() > target_count) {
+		// An edge used by a single triangle is on a border.
+		edges.clear();
+		for (std::size_t i = 0; i < result.size(); i += 3) {
+			for (int k = 0; k < 3; ++k) {
+				auto a = result[i + k];
+				auto b = result[i + (k + 1) % 3];
+				edges.emplace_back(std::min(a, b), std::max(a, b));
+			}
+		}
+		std::sort(edges.begin(), edges.end());
+		std::fill(locked.begin(), locked.end(), 0);
+		for (std::size_t i = 0; i < edges.size(); ++i) {
+			bool shared = (i > 0 && edges[i - 1] == edges[i]) || (i + 1 < edges.size() && edges[i + 1] == edges[i]);
+			if (!shared) {
+				locked[edges[i].first] = 1;
+				locked[edges[i].second] = 1;
+			}
+		}
+		edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+		collapses.clear();
+		for (auto [a, b] : edges) {
+			auto quadric = quadrics[a];
+			quadric += quadrics[b];
+			// Rounding can make the error slightly negative
+			auto to_b = locked[a] ? -1.0 : std::max(0.0, quadric.error(vertices[b].pos));
+			auto to_a = locked[b] ? -1.0 : std::max(0.0, quadric.error(vertices[a].pos));
+			if (to_b >= 0.0 && (to_a < 0.0 || to_b <= to_a)) {
+				collapses.push_back(Collapse{ a, b, to_b });
+			} else if (to_a >= 0.0) {
+				collapses.push_back(Collapse{ b, a, to_a });
+			}
+		}
+		std::sort(collapses.begin(), collapses.end(), [](auto& x, auto& y) { return x.cost < y.cost; });
+
+		adjacency.build(result, vertex_count);
+		std::fill(touched.begin(), touched.end(), 0);
+		std::iota(remap.begin(), remap.end(), 0);
+
+		auto triangles = result.size() / 3;
+		auto target_triangles = target_count / 3;
+		std::size_t collapsed = 0;
+		for (const auto& collapse : collapses) {
+			if (triangles <= target_triangles) {
+				break;
+			}
+			if (touched[collapse.from] || touched[collapse.to]
+			    || flips(vertices, result, adjacency, collapse.from, collapse.to)) {
+				continue;
+			}
+
+			// Everything around the collapse is left alone for the rest of
+			// the pass, since its flip checks and counts would be stale.
+			for (auto vertex : { collapse.from, collapse.to }) {
+				for (auto i = adjacency.offsets[vertex]; i < adjacency.offsets[vertex + 1]; ++i) {
+					const auto* triangle = &result[adjacency.triangles[i] * 3];
+					touched[triangle[0]] = touched[triangle[1]] = touched[triangle[2]] = 1;
+					if (vertex == collapse.from
+					    && (triangle[0] == collapse.to || triangle[1] == collapse.to || triangle[2] == collapse.to)) {
+						--triangles;
+					}
+				}
+			}
+
+			remap[collapse.from] = collapse.to;
+			quadrics[collapse.to] += quadrics[collapse.from];
+			max_cost = std::max(max_cost, collapse.cost);
+			++collapsed;
+		}
+		if (collapsed == 0) {
+			break;
+		}
+
+		std::size_t write = 0;
+		for (std::size_t i = 0; i < result.size(); i += 3) {
+			auto a = remap[result[i]];
+			auto b = remap[result[i + 1]];
+			auto c = remap[result[i + 2]];
+			if (a != b && b != c && a != c) {
+				result[write++] = a;
+				result[write++] = b;
+				result[write++] = c;
+			}
+		}
+		result.resize(write);
+	}
+
+	error = static_cast<float>(std::sqrt(max_cost));
+	return result;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "gltf.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// Simplifies an indexed triangle list by collapsing edges, picking the
+/// cheapest collapses first by their quadric error, the sum of the squared
+/// distances to the planes of the triangles merged into a vertex.
+///
+/// Vertices are never moved or created, an edge is collapsed by moving one of
+/// its vertices onto the other, so the result references the same vertices as
+/// the input and only needs its own indices. Vertices on a border, which
+/// includes seams where vertices are split for their texture coordinates, are
+/// never moved so the mesh does not crack open. Collapses which would flip a
+/// triangle are skipped.
+///
+/// Collapses are done in passes. Each pass sorts the candidate edges by cost
+/// and collapses as many as it can without two of them touching the same
+/// triangles, then the next pass starts again from the resulting mesh.
+///
+/// Returns the simplified indices, with about `target_count` of them unless
+/// the mesh cannot be simplified that far, and sets `error` to the largest
+/// error of the collapses as a distance in the space of the mesh.
+std::vector<std::uint32_t> simplify(const Vertex* vertices, std::size_t vertex_count,
+				    const std::uint32_t* indices, std::size_t index_count,
+				    std::size_t target_count, float& error);
@@ -0,0 +1,264 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace stats {
+
+// Events are only kept for the most recent allocations, otherwise a long
+// running process would slowly leak memory through its own bookkeeping.
+static constexpr std::size_t max_events = 1024;
+
+static FrameStats current_frame;
+static FrameStats last_frame;
+static FrameStats peak_frame;
+static FrameStats total;
+static std::size_t frames = 0;
+
+static std::map<GLenum, TextureStats> textures;
+static std::vector<Event> events;
+
+void record_upload(std::size_t bytes)
+{
+	current_frame.upload_bytes += bytes;
+	current_frame.upload_calls += 1;
+}
+
+void record_draws(std::size_t draws, std::size_t instances, std::size_t triangles, std::size_t draw_calls,
+		  std::size_t binds)
+{
+	current_frame.draws += draws;
+	current_frame.instances += instances;
+	current_frame.triangles += triangles;
+	current_frame.draw_calls += draw_calls;
+	current_frame.binds += binds;
+	current_frame.binds_saved += draws - std::min(draws, binds);
+}
+
+void record_culled(std::size_t instances)
+{
+	current_frame.culled += instances;
+}
+
+void record_culled_meshlets(std::size_t meshlets)
+{
+	current_frame.culled_meshlets += meshlets;
+}
+
+void record_occluded(std::size_t instances, std::size_t triangles)
+{
+	current_frame.occluded += instances;
+	current_frame.occluded_triangles += triangles;
+}
+
+void record_overdraw(std::size_t fragments, std::size_t pixels)
+{
+	current_frame.shaded_fragments += fragments;
+	current_frame.pixels += pixels;
+}
+
+void record_shadow_layers(std::size_t layers)
+{
+	current_frame.shadow_layers += layers;
+}
+
+void record_texture(GLenum format, std::size_t bytes)
+{
+	auto& texture = textures[format];
+	texture.count += 1;
+	texture.bytes += bytes;
+}
+
+void release_texture(GLenum format, std::size_t bytes)
+{
+	auto& texture = textures[format];
+	texture.count -= std::min<std::size_t>(texture.count, 1);
+	texture.bytes -= std::min(texture.bytes, bytes);
+}
+
+void record_event(EventType type, const std::string& buffer, std::size_t bytes)
+{
+	if (events.size() == max_events) {
+		events.erase(events.begin());
+	}
+	events.push_back(Event{ type, buffer, bytes, frames });
+}
+
+void end_frame()
+{
+	total.upload_bytes += current_frame.upload_bytes;
+	total.upload_calls += current_frame.upload_calls;
+	total.draws += current_frame.draws;
+	total.instances += current_frame.instances;
+	total.triangles += current_frame.triangles;
+	total.draw_calls += current_frame.draw_calls;
+	total.binds += current_frame.binds;
+	total.binds_saved += current_frame.binds_saved;
+	total.culled += current_frame.culled;
+	total.culled_meshlets += current_frame.culled_meshlets;
+	total.occluded += current_frame.occluded;
+	total.occluded_triangles += current_frame.occluded_triangles;
+	total.shaded_fragments += current_frame.shaded_fragments;
+	total.pixels += current_frame.pixels;
+	total.shadow_layers += current_frame.shadow_layers;
+	peak_frame.upload_bytes = std::max(peak_frame.upload_bytes, current_frame.upload_bytes);
+	peak_frame.upload_calls = std::max(peak_frame.upload_calls, current_frame.upload_calls);
+	peak_frame.draws = std::max(peak_frame.draws, current_frame.draws);
+	peak_frame.instances = std::max(peak_frame.instances, current_frame.instances);
+	peak_frame.triangles = std::max(peak_frame.triangles, current_frame.triangles);
+	peak_frame.draw_calls = std::max(peak_frame.draw_calls, current_frame.draw_calls);
+	peak_frame.binds = std::max(peak_frame.binds, current_frame.binds);
+	peak_frame.binds_saved = std::max(peak_frame.binds_saved, current_frame.binds_saved);
+	peak_frame.culled = std::max(peak_frame.culled, current_frame.culled);
+	peak_frame.culled_meshlets = std::max(peak_frame.culled_meshlets, current_frame.culled_meshlets);
+	peak_frame.occluded = std::max(peak_frame.occluded, current_frame.occluded);
+	peak_frame.occluded_triangles = std::max(peak_frame.occluded_triangles, current_frame.occluded_triangles);
+	peak_frame.shaded_fragments = std::max(peak_frame.shaded_fragments, current_frame.shaded_fragments);
+	peak_frame.pixels = std::max(peak_frame.pixels, current_frame.pixels);
+	peak_frame.shadow_layers = std::max(peak_frame.shadow_layers, current_frame.shadow_layers);
+
+	last_frame = current_frame;
+	current_frame = FrameStats{};
+	++frames;
+}
+
+Report report()
+{
+	return Report {
+		.buffers = {},
+		.textures = textures,
+		.residency = {},
+		.last_frame = last_frame,
+		.peak_frame = peak_frame,
+		.total = total,
+		.frames = frames,
+		.events = events,
+	};
+}
+
+static const char* format_name(GLenum format)
+{
+	switch (format) {
+	case GL_RGBA8: return "RGBA8";
+	case GL_SRGB8_ALPHA8: return "SRGB8_ALPHA8";
+	case GL_RGB8: return "RGB8";
+	case GL_R8: return "R8";
+	case GL_RG8: return "RG8";
+	case GL_DEPTH_COMPONENT32F: return "DEPTH_COMPONENT32F";
+	case GL_R32F: return "R32F";
+	default: return nullptr;
+	}
+}
+
+static const char* event_name(EventType type)
+{
+	switch (type) {
+	case EventType::ALLOCATE:   return "allocate";
+	case EventType::DEALLOCATE: return "deallocate";
+	case EventType::RESIZE:     return "resize";
+	}
+	return "unknown";
+}
+
+static void write_frame(std::ostream& out, const FrameStats& frame)
+{
+	out << "{ \"upload_bytes\": " << frame.upload_bytes
+	    << ", \"upload_calls\": " << frame.upload_calls
+	    << ", \"draws\": " << frame.draws
+	    << ", \"instances\": " << frame.instances
+	    << ", \"triangles\": " << frame.triangles
+	    << ", \"draw_calls\": " << frame.draw_calls
+	    << ", \"binds\": " << frame.binds
+	    << ", \"binds_saved\": " << frame.binds_saved
+	    << ", \"culled\": " << frame.culled
+	    << ", \"culled_meshlets\": " << frame.culled_meshlets
+	    << ", \"occluded\": " << frame.occluded
+	    << ", \"occluded_triangles\": " << frame.occluded_triangles
+	    << ", \"shaded_fragments\": " << frame.shaded_fragments
+	    << ", \"pixels\": " << frame.pixels
+	    << ", \"shadow_layers\": " << frame.shadow_layers
+	    // Average number of times each pixel was shaded
+	    << ", \"overdraw\": " << (frame.pixels > 0 ? static_cast<double>(frame.shaded_fragments) / frame.pixels : 0.0)
+	    << " }";
+}
+
+std::string to_json(const Report& report)
+{
+	std::ostringstream out;
+	out << "{\n";
+
+	out << "  \"buffers\": {";
+	bool first = true;
+	for (const auto& [name, buffer] : report.buffers) {
+		out << (first ? "\n" : ",\n");
+		out << "    \"" << name << "\": { "
+		    << "\"capacity\": " << buffer.capacity
+		    << ", \"used\": " << buffer.used
+		    << ", \"free\": " << buffer.free
+		    << ", \"largest_free\": " << buffer.largest_free
+		    << ", \"allocations\": " << buffer.allocations
+		    << ", \"deallocations\": " << buffer.deallocations
+		    << ", \"resizes\": " << buffer.resizes << " }";
+		first = false;
+	}
+	out << "\n  },\n";
+
+	out << "  \"textures\": {";
+	first = true;
+	for (const auto& [format, texture] : report.textures) {
+		out << (first ? "\n" : ",\n");
+		out << "    \"";
+		if (auto name = format_name(format)) {
+			out << name;
+		} else {
+			out << "0x" << std::hex << format << std::dec;
+		}
+		out << "\": { \"count\": " << texture.count << ", \"bytes\": " << texture.bytes << " }";
+		first = false;
+	}
+	out << "\n  },\n";
+
+	out << "  \"residency\": { "
+	    << "\"budget\": " << report.residency.budget
+	    << ", \"resident\": " << report.residency.resident
+	    << ", \"hits\": " << report.residency.hits
+	    << ", \"misses\": " << report.residency.misses
+	    << ", \"evictions\": " << report.residency.evictions << " },\n";
+
+	out << "  \"frames\": " << report.frames << ",\n";
+	out << "  \"last_frame\": ";
+	write_frame(out, report.last_frame);
+	out << ",\n  \"peak_frame\": ";
+	write_frame(out, report.peak_frame);
+	out << ",\n  \"total\": ";
+	write_frame(out, report.total);
+	out << ",\n";
+
+	out << "  \"events\": [";
+	first = true;
+	for (const auto& event : report.events) {
+		out << (first ? "\n" : ",\n");
+		out << "    { \"type\": \"" << event_name(event.type) << "\""
+		    << ", \"buffer\": \"" << event.buffer << "\""
+		    << ", \"bytes\": " << event.bytes
+		    << ", \"frame\": " << event.frame << " }";
+		first = false;
+	}
+	out << "\n  ]\n";
+
+	out << "}\n";
+	return out.str();
+}
+
+bool write_json(const std::filesystem::path& path, const Report& report)
+{
+	std::ofstream file(path);
+	if (!file) {
+		return false;
+	}
+	file << to_json(report);
+	return static_cast<bool>(file);
+}
+
+} // end namespace stats
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <glad/gl.h>
+
+#include <cstddef>
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+/// Stats
+///
+/// Keeps track of how much GPU memory is in use and how much data is sent to
+/// the GPU each frame. This is mostly useful for capacity planning, so values
+/// are reported in bytes rather than elements.
+///
+/// There are two sources of data. Buffers know their own occupancy, so they
+/// report a `BufferStats` when asked and the owner (usually the `Renderer`)
+/// gathers them into a `Report`. Uploads, textures and allocation events are
+/// recorded globally as they happen since they occur in places which do not
+/// share any state, textures for example are created in `load_gltf` before a
+/// renderer might even exist.
+///
+/// Each frame, `end_frame` must be called to roll the per-frame counters over.
+/// A `Report` can be queried at any time and written out as JSON.
+
+namespace stats {
+
+struct BufferStats {
+	std::size_t capacity;		// bytes reserved on the GPU
+	std::size_t used;		// bytes inside live allocations
+	std::size_t free;		// bytes not inside live allocations
+	std::size_t largest_free;	// largest contiguous free block in bytes
+	std::size_t allocations;	// number of allocations made
+	std::size_t deallocations;	// number of deallocations made
+	std::size_t resizes;		// number of times the GPU buffer was recreated
+};
+
+struct TextureStats {
+	std::size_t count;
+	std::size_t bytes;		// includes the mip chain
+};
+
+struct FrameStats {
+	std::size_t upload_bytes;
+	std::size_t upload_calls;
+	std::size_t draws;		// commands submitted
+	std::size_t instances;		// instances drawn by those commands
+	std::size_t triangles;		// triangles of those instances at their level of detail
+	std::size_t draw_calls;		// MultiDraw calls issued
+	std::size_t binds;		// texture binds issued
+	std::size_t binds_saved;	// binds avoided compared to one per draw
+	std::size_t culled;		// instances outside the view frustum
+	std::size_t culled_meshlets;	// meshlets outside the frustum or facing away
+	std::size_t occluded;		// instances hidden behind the depth pyramid
+	std::size_t occluded_triangles;	// triangles of those instances
+	std::size_t shaded_fragments;	// only counted when measuring overdraw
+	std::size_t pixels;		// of the frames the fragments were counted in
+	std::size_t shadow_layers;	// shadow maps rendered again
+};
+
+struct ResidencyStats {
+	std::size_t budget;		// bytes allowed to be resident
+	std::size_t resident;		// bytes currently resident
+	std::size_t hits;		// acquires which were already resident
+	std::size_t misses;		// acquires which had to upload
+	std::size_t evictions;
+};
+
+enum class EventType { ALLOCATE, DEALLOCATE, RESIZE };
+
+struct Event {
+	EventType type;
+	std::string buffer;		// name of the buffer
+	std::size_t bytes;		// size of the allocation or the new capacity
+	std::size_t frame;		// frame the event happened in
+};
+
+struct Report {
+	std::map<std::string, BufferStats> buffers;
+	std::map<GLenum, TextureStats> textures;	// keyed by internal format
+	ResidencyStats residency;
+	FrameStats last_frame;
+	FrameStats peak_frame;
+	FrameStats total;
+	std::size_t frames;
+	std::vector<Event> events;			// oldest first
+};
+
+void record_upload(std::size_t bytes);
+void record_draws(std::size_t draws, std::size_t instances, std::size_t triangles, std::size_t draw_calls,
+		  std::size_t binds);
+void record_culled(std::size_t instances);
+void record_culled_meshlets(std::size_t meshlets);
+void record_occluded(std::size_t instances, std::size_t triangles);
+void record_overdraw(std::size_t fragments, std::size_t pixels);
+void record_shadow_layers(std::size_t layers);
+void record_texture(GLenum format, std::size_t bytes);
+void release_texture(GLenum format, std::size_t bytes);
+void record_event(EventType type, const std::string& buffer, std::size_t bytes);
+void end_frame();
+
+// Returns a report with only the global data filled in, buffers must be added
+// by their owners.
+Report report();
+std::string to_json(const Report& report);
+bool write_json(const std::filesystem::path& path, const Report& report);
+
+} // end namespace stats
@@ -0,0 +1,188 @@
+#include "bvh.h"
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+static constexpr std::uint32_t row_size = 32;
+
+// Unit boxes in a row along +X, item `i` from 3 * i to 3 * i + 1.
+static Bounds row_box(std::uint32_t item)
+{
+	auto x = 3.0f * static_cast<float>(item);
+	return Bounds { glm::vec3(x, 0.0f, 0.0f), glm::vec3(x + 1.0f, 1.0f, 1.0f) };
+}
+
+// The row built all at once, or one item at a time.
+static Bvh make_row(bool incremental)
+{
+	Bvh bvh;
+	std::vector<std::pair<std::uint32_t, Bounds>> items;
+	for (std::uint32_t i = 0; i < row_size; ++i) {
+		items.emplace_back(i, row_box(i));
+		if (incremental) {
+			bvh.insert(i, row_box(i));
+		}
+	}
+	if (!incremental) {
+		bvh.build(items);
+	}
+	return bvh;
+}
+
+static std::vector<std::uint32_t> query(const Bvh& bvh, const Bounds& bounds)
+{
+	std::vector<std::uint32_t> items;
+	bvh.query_box(bounds, items);
+	std::sort(items.begin(), items.end());
+	return items;
+}
+
+static std::vector<std::uint32_t> hit_items(const std::vector<BvhHit>& hits)
+{
+	std::vector<std::uint32_t> items;
+	for (const auto& hit : hits) {
+		items.push_back(hit.item);
+	}
+	return items;
+}
+
+TEST_CASE("Box queries find the same items as testing every box", "[bvh]")
+{
+	// Boxes scattered in a cube, some overlapping each other
+	std::mt19937 random(3);
+	std::uniform_real_distribution<float> position(0.0f, 100.0f);
+	std::uniform_real_distribution<float> size(0.0f, 8.0f);
+	auto random_box = [&] {
+		auto min = glm::vec3(position(random), position(random), position(random));
+		return Bounds { min, min + glm::vec3(size(random), size(random), size(random)) };
+	};
+	std::vector<std::pair<std::uint32_t, Bounds>> items;
+	for (std::uint32_t i = 0; i < 500; ++i) {
+		items.emplace_back(i * 7, random_box());
+	}
+
+	Bvh built;
+	built.build(items);
+	Bvh inserted;
+	for (const auto& [item, bounds] : items) {
+		inserted.insert(item, bounds);
+	}
+	CHECK(built.size() == items.size());
+	CHECK(inserted.size() == items.size());
+
+	for (int i = 0; i < 100; ++i) {
+		auto box = random_box();
+		std::vector<std::uint32_t> expected;
+		for (const auto& [item, bounds] : items) {
+			if (bounds.min.x <= box.max.x && bounds.max.x >= box.min.x
+			    && bounds.min.y <= box.max.y && bounds.max.y >= box.min.y
+			    && bounds.min.z <= box.max.z && bounds.max.z >= box.min.z) {
+				expected.push_back(item);
+			}
+		}
+		CHECK(query(built, box) == expected);
+		CHECK(query(inserted, box) == expected);
+	}
+}
+
+TEST_CASE("Rays return the items they go through, closest first", "[bvh]")
+{
+	for (bool incremental : { false, true }) {
+		INFO("incremental " << incremental);
+		auto bvh = make_row(incremental);
+
+		auto hits = bvh.query_ray(glm::vec3(-10.0f, 0.5f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f), 1000.0f);
+		REQUIRE(hits.size() == row_size);
+		for (std::uint32_t i = 0; i < row_size; ++i) {
+			CHECK(hits[i].item == i);
+			CHECK(hits[i].distance == Approx(10.0f + 3.0f * static_cast<float>(i)));
+		}
+
+		// Items entered past the maximum distance are left out, and
+		// distances are in multiples of the direction
+		hits = bvh.query_ray(glm::vec3(-10.0f, 0.5f, 0.5f), glm::vec3(2.0f, 0.0f, 0.0f), 10.0f);
+		CHECK(hit_items(hits) == std::vector<std::uint32_t> { 0, 1, 2, 3 });
+		CHECK(hits.back().distance == Approx(9.5f));
+
+		// A ray starting inside a box enters it right away
+		hits = bvh.query_ray(glm::vec3(3.5f, 0.5f, 0.5f), glm::vec3(0.0f, 1.0f, 0.0f), 1000.0f);
+		REQUIRE(hits.size() == 1);
+		CHECK(hits[0].item == 1);
+		CHECK(hits[0].distance == 0.0f);
+
+		// Between the boxes and above the row
+		CHECK(bvh.query_ray(glm::vec3(2.0f, -5.0f, 0.5f), glm::vec3(0.0f, 1.0f, 0.0f), 1000.0f).empty());
+		CHECK(bvh.query_ray(glm::vec3(-10.0f, 5.0f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f), 1000.0f).empty());
+	}
+}
+
+TEST_CASE("Removed items are no longer found", "[bvh]")
+{
+	for (bool incremental : { false, true }) {
+		INFO("incremental " << incremental);
+		auto bvh = make_row(incremental);
+		for (std::uint32_t i = 0; i < row_size; i += 2) {
+			bvh.remove(i);
+		}
+		// Removing an item which is not in the tree does nothing
+		bvh.remove(0);
+		bvh.remove(row_size);
+		CHECK(bvh.size() == row_size / 2);
+
+		auto hits = bvh.query_ray(glm::vec3(-10.0f, 0.5f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f), 1000.0f);
+		REQUIRE(hits.size() == row_size / 2);
+		for (std::size_t i = 0; i < hits.size(); ++i) {
+			CHECK(hits[i].item == 2 * i + 1);
+		}
+		CHECK(query(bvh, row_box(4)).empty());
+
+		// The bounds shrink to the items left
+		CHECK(bvh.bounds().min.x == 3.0f);
+		CHECK(bvh.bounds().max.x == 3.0f * (row_size - 1) + 1.0f);
+
+		for (std::uint32_t i = 1; i < row_size; i += 2) {
+			bvh.remove(i);
+		}
+		CHECK(bvh.empty());
+		CHECK(bvh.size() == 0);
+		CHECK(bvh.query_ray(glm::vec3(-10.0f, 0.5f, 0.5f), glm::vec3(1.0f, 0.0f, 0.0f), 1000.0f).empty());
+
+		// Freed nodes are reused
+		bvh.insert(7, row_box(7));
+		CHECK(query(bvh, row_box(7)) == std::vector<std::uint32_t> { 7 });
+	}
+}
+
+TEST_CASE("Updated items are found where they moved", "[bvh]")
+{
+	for (bool incremental : { false, true }) {
+		INFO("incremental " << incremental);
+		auto bvh = make_row(incremental);
+
+		auto moved = Bounds { glm::vec3(15.0f, 50.0f, 0.0f), glm::vec3(16.0f, 51.0f, 1.0f) };
+		bvh.update(5, moved);
+		CHECK(bvh.size() == row_size);
+		CHECK(query(bvh, row_box(5)).empty());
+		CHECK(query(bvh, moved) == std::vector<std::uint32_t> { 5 });
+		// Every ancestor was refit to hold it
+		CHECK(bvh.bounds().max.y == 51.0f);
+		auto hits = bvh.query_ray(glm::vec3(15.5f, 100.0f, 0.5f), glm::vec3(0.0f, -1.0f, 0.0f), 1000.0f);
+		REQUIRE(hits.size() == 1);
+		CHECK(hits[0].item == 5);
+		CHECK(hits[0].distance == Approx(49.0f));
+
+		// And shrunk again when it moves back
+		bvh.update(5, row_box(5));
+		CHECK(bvh.bounds().max.y == 1.0f);
+		CHECK(query(bvh, row_box(5)) == std::vector<std::uint32_t> { 5 });
+
+		// Items which are not in the tree yet are inserted
+		bvh.update(100, moved);
+		CHECK(bvh.size() == row_size + 1);
+		CHECK(query(bvh, moved) == std::vector<std::uint32_t> { 100 });
+	}
+}
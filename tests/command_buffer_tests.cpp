@@ -0,0 +1,155 @@
+#include "buffer.h"
+#include "fixtures.h"
+
+#include <glad/gl.h>
+
+#include <catch2/catch.hpp>
+
+#include <vector>
+
+// `count` draws of a triangle each, told apart by their first index and
+// material which start at `tag`.
+static std::vector<Draw> make_draws(std::uint32_t tag, std::size_t count)
+{
+	std::vector<Draw> draws;
+	for (std::uint32_t i = 0; i < count; ++i) {
+		draws.push_back(Draw {
+			.command = DrawCommand { 3, 1, tag + i, 0, 0 },
+			.data = DrawData {
+				.model = glm::mat4(1.0f),
+				.material = tag + i,
+				.vertex_format = 0,
+				.padding = {},
+				.normal_matrix = glm::mat3x4(1.0f),
+			},
+			.texture = tag,
+			.bounds = Bounds { glm::vec3(-1.0f), glm::vec3(1.0f) },
+			.lods = {},
+			.meshlets = {},
+		});
+	}
+	return draws;
+}
+
+// The commands in the region the next draw reads.
+static std::vector<DrawCommand> read_commands(CommandBuffer& command_buffer)
+{
+	command_buffer.bind_buffer();
+	GLint buffer = 0;
+	glGetIntegerv(GL_DRAW_INDIRECT_BUFFER_BINDING, &buffer);
+	std::vector<DrawCommand> commands(command_buffer.get_commands().size());
+	glGetNamedBufferSubData(static_cast<GLuint>(buffer), static_cast<GLintptr>(command_buffer.offset()),
+				static_cast<GLsizeiptr>(commands.size() * sizeof(DrawCommand)), commands.data());
+	return commands;
+}
+
+static bool same_commands(const std::vector<DrawCommand>& a, const std::vector<DrawCommand>& b)
+{
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (std::size_t i = 0; i < a.size(); ++i) {
+		if (a[i].count != b[i].count || a[i].instance_count != b[i].instance_count
+		    || a[i].first_index != b[i].first_index || a[i].base_vertex != b[i].base_vertex
+		    || a[i].base_instance != b[i].base_instance) {
+			return false;
+		}
+	}
+	return true;
+}
+
+TEST_CASE("Removed ranges are tombstoned until most commands are", "[command_buffer]")
+{
+	CommandBuffer command_buffer;
+	command_buffer.add_commands(1, make_draws(10, 2));
+	command_buffer.add_commands(2, make_draws(20, 2));
+	command_buffer.add_commands(3, make_draws(30, 2));
+	command_buffer.add_commands(4, make_draws(40, 2));
+	const auto& commands = command_buffer.get_commands();
+
+	// The other ranges stay where they are
+	command_buffer.remove_commands(2);
+	REQUIRE(commands.size() == 8);
+	CHECK(commands[2].count == 0);
+	CHECK(commands[3].count == 0);
+	CHECK(command_buffer.get_textures()[2] == 0);
+	CHECK(command_buffer.get_range(3).start == 4);
+	CHECK(command_buffer.get_range(4).start == 6);
+
+	// Half of the commands are tombstones, which is not more than half
+	command_buffer.remove_commands(3);
+	REQUIRE(commands.size() == 8);
+	CHECK(commands[4].count == 0);
+	CHECK(command_buffer.get_range(4).start == 6);
+
+	// Removing an owner twice does nothing
+	command_buffer.remove_commands(3);
+	CHECK(commands.size() == 8);
+
+	command_buffer.remove_commands(1);
+	REQUIRE(commands.size() == 2);
+	auto range = command_buffer.get_range(4);
+	CHECK(range.start == 0);
+	CHECK(range.size == 2);
+	for (std::uint32_t i = 0; i < 2; ++i) {
+		CHECK(commands[i].first_index == 40 + i);
+		CHECK(commands[i].base_instance == i);
+		CHECK(command_buffer.get_draws()[i].material == 40 + i);
+		CHECK(command_buffer.get_textures()[i] == 40);
+	}
+}
+
+TEST_CASE("The last range is dropped instead of tombstoned", "[command_buffer]")
+{
+	CommandBuffer command_buffer;
+	command_buffer.add_commands(1, make_draws(10, 2));
+	command_buffer.add_commands(2, make_draws(20, 3));
+	command_buffer.remove_commands(2);
+
+	const auto& commands = command_buffer.get_commands();
+	REQUIRE(commands.size() == 2);
+	CHECK(commands[0].count == 3);
+	CHECK(commands[1].count == 3);
+
+	// New commands take the place of the dropped ones
+	command_buffer.add_commands(3, make_draws(30, 1));
+	CHECK(command_buffer.get_range(3).start == 2);
+	CHECK(commands[2].base_instance == 2);
+}
+
+TEST_CASE("Every region uploads the commands changed since its last upload", "[command_buffer]")
+{
+	GlContext context;
+	if (!context.valid()) {
+		WARN("No OpenGL 4.5 context, skipping");
+		return;
+	}
+
+	CommandBuffer command_buffer("commands");
+	auto upload_regions = [&] {
+		for (std::size_t region = 0; region < CommandBuffer::regions; ++region) {
+			REQUIRE(command_buffer.is_dirty());
+			command_buffer.upload_commands();
+			CHECK(same_commands(read_commands(command_buffer), command_buffer.get_commands()));
+			command_buffer.fence();
+		}
+		CHECK_FALSE(command_buffer.is_dirty());
+	};
+
+	command_buffer.add_commands(1, make_draws(10, 4));
+	command_buffer.add_commands(2, make_draws(20, 4));
+	command_buffer.add_commands(3, make_draws(30, 4));
+	upload_regions();
+
+	// Only the tombstones are dirty, the other commands must still be in
+	// every region from the first uploads
+	command_buffer.remove_commands(2);
+	upload_regions();
+
+	// More commands than a region holds grow the buffer, and every region
+	// of the new one starts out empty
+	command_buffer.add_commands(4, make_draws(40, 300));
+	upload_regions();
+
+	command_buffer.delete_buffer();
+}
@@ -0,0 +1,100 @@
+#include "culling.h"
+
+#include <catch2/catch.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+// The scalar test in double precision: a box is inside when its corner
+// furthest along each plane normal is in front of the plane. Corners within
+// `margin` of a plane are left undecided, since the test in single precision
+// may round them either way.
+enum class Expected { INSIDE, OUTSIDE, UNDECIDED };
+
+static Expected expected(const Frustum& frustum, const Bounds& bounds, double margin)
+{
+	auto result = Expected::INSIDE;
+	for (const auto& plane : frustum.planes) {
+		auto x = plane.x > 0.0f ? bounds.max.x : bounds.min.x;
+		auto y = plane.y > 0.0f ? bounds.max.y : bounds.min.y;
+		auto z = plane.z > 0.0f ? bounds.max.z : bounds.min.z;
+		auto distance = double{plane.x} * x + double{plane.y} * y + double{plane.z} * z + plane.w;
+		if (distance < -margin) {
+			return Expected::OUTSIDE;
+		}
+		if (distance < margin) {
+			result = Expected::UNDECIDED;
+		}
+	}
+	return result;
+}
+
+static Frustum camera_frustum()
+{
+	auto projection = glm::perspective(glm::radians(60.0f), 1.5f, 0.1f, 100.0f);
+	auto view = glm::lookAt(glm::vec3(1.0f, 2.0f, 3.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	return make_frustum(projection * view);
+}
+
+static std::vector<Bounds> random_boxes(std::size_t count)
+{
+	std::mt19937 random(static_cast<std::uint32_t>(count));
+	std::uniform_real_distribution<float> position(-120.0f, 120.0f);
+	std::uniform_real_distribution<float> size(0.0f, 10.0f);
+	std::vector<Bounds> boxes;
+	for (std::size_t i = 0; i < count; ++i) {
+		auto min = glm::vec3(position(random), position(random), position(random));
+		boxes.push_back(Bounds { min, min + glm::vec3(size(random), size(random), size(random)) });
+	}
+	return boxes;
+}
+
+TEST_CASE("Culling four boxes at a time matches testing one at a time", "[culling]")
+{
+	auto frustum = camera_frustum();
+
+	// Counts which are not a multiple of 4 leave a tail tested one box at a
+	// time, and the smallest ones have no group of 4 at all.
+	for (std::size_t count : { 0, 1, 3, 4, 5, 7, 64, 1003 }) {
+		auto boxes = random_boxes(count);
+		BoundsArray bounds;
+		bounds.resize(count);
+		for (std::size_t i = 0; i < count; ++i) {
+			bounds.set(i, boxes[i]);
+		}
+		std::vector<std::uint8_t> visible(count, 2);
+		auto visible_count = cull_frustum(frustum, bounds, visible.data());
+
+		std::size_t total = 0;
+		for (std::size_t i = 0; i < count; ++i) {
+			INFO("box " << i << " of " << count);
+			REQUIRE(visible[i] <= 1);
+			total += visible[i];
+			auto expect = expected(frustum, boxes[i], 1e-4);
+			if (expect != Expected::UNDECIDED) {
+				CHECK(visible[i] == (expect == Expected::INSIDE ? 1 : 0));
+			}
+		}
+		CHECK(visible_count == total);
+	}
+}
+
+TEST_CASE("Boxes in the tail are culled like the others", "[culling]")
+{
+	auto frustum = camera_frustum();
+	auto inside = Bounds { glm::vec3(-0.5f), glm::vec3(0.5f) };
+	auto behind = Bounds { glm::vec3(9.5f, 19.5f, 29.5f), glm::vec3(10.5f, 20.5f, 30.5f) };
+
+	// The last 3 boxes are past the last group of 4
+	std::vector<Bounds> boxes { inside, behind, inside, behind, behind, inside, behind };
+	BoundsArray bounds;
+	bounds.resize(boxes.size());
+	for (std::size_t i = 0; i < boxes.size(); ++i) {
+		bounds.set(i, boxes[i]);
+	}
+	std::vector<std::uint8_t> visible(boxes.size());
+	CHECK(cull_frustum(frustum, bounds, visible.data()) == 3);
+	CHECK(visible == std::vector<std::uint8_t> { 1, 0, 1, 0, 0, 1, 0 });
+}
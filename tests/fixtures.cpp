@@ -0,0 +1,77 @@
+#include "fixtures.h"
+
+#include <glad/gl.h>
+#define GLFW_INCLUDE_NONE
+#include <GLFW/glfw3.h>
+
+GlContext::GlContext()
+{
+	if (!glfwInit()) {
+		return;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	window = glfwCreateWindow(64, 64, "tests", NULL, NULL);
+	if (!window) {
+		return;
+	}
+	glfwMakeContextCurrent(window);
+	if (!gladLoadGL(glfwGetProcAddress)) {
+		glfwDestroyWindow(window);
+		window = nullptr;
+	}
+}
+
+GlContext::~GlContext()
+{
+	if (window) {
+		glfwDestroyWindow(window);
+	}
+	glfwTerminate();
+}
+
+bool GlContext::valid() const
+{
+	return window != nullptr;
+}
+
+std::shared_ptr<LoadedGLTF> make_triangle(const std::string& path, const glm::vec3& center, float size,
+					  bool textured)
+{
+	auto gltf = std::make_shared<LoadedGLTF>();
+	gltf->path = path;
+	gltf->vertices = {
+		Vertex { center + glm::vec3(-size, -size, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(0.0f) },
+		Vertex { center + glm::vec3(size, -size, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(0.0f) },
+		Vertex { center + glm::vec3(0.0f, size, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec2(0.0f) },
+	};
+	if (textured) {
+		gltf->vertices[1].uv = glm::vec2(1.0f, 0.0f);
+		gltf->vertices[2].uv = glm::vec2(0.5f, 1.0f);
+		gltf->textures.push_back(Texture { 0, 1, 1, { 255, 255, 255, 255 } });
+	}
+	gltf->indices = { 0, 1, 2 };
+	gltf->vertex_count = gltf->vertices.size();
+	gltf->index_count = gltf->indices.size();
+	gltf->materials.push_back(Material {
+		.base_color = glm::vec4(1.0f),
+		.metallic = 0.0f,
+		.roughness = 1.0f,
+		.padding = {},
+	});
+
+	Primitive primitive {};
+	primitive.material_idx = 0;
+	primitive.texture_idx = textured ? 0 : no_texture;
+	primitive.index_count = 3;
+	primitive.vertex_count = 3;
+	primitive.bounds = Bounds { center - glm::vec3(size, size, 0.0f), center + glm::vec3(size, size, 0.0f) };
+	primitive.lods.levels[0] = Lod { 0, 3, 0.0f };
+	primitive.lods.count = 1;
+	gltf->meshes.push_back(Mesh { { primitive } });
+	gltf->primitive_count = 1;
+	gltf->meshnodes.push_back(MeshNode { glm::mat4(1.0f), 0, {} });
+	return gltf;
+}
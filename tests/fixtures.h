@@ -0,0 +1,32 @@
+#pragma once
+
+#include "gltf.h"
+
+#include <glm/vec3.hpp>
+
+#include <memory>
+#include <string>
+
+struct GLFWwindow;
+
+/// A hidden window with an OpenGL 4.5 core context made current, for tests
+/// which need the GPU. Machines without a display or a driver get none, and
+/// the tests check `valid` to skip themselves.
+class GlContext {
+public:
+	GlContext();
+	~GlContext();
+	GlContext(const GlContext&) = delete;
+	GlContext& operator=(const GlContext&) = delete;
+
+	bool valid() const;
+private:
+	GLFWwindow* window {nullptr};
+};
+
+// A glTF drawing a single triangle facing +Z, with its corners at `center`
+// plus or minus `size` on X and Y. Only held in memory, `path` just has to
+// be unique. A `textured` triangle has texture coordinates and a white
+// texture, otherwise it has neither.
+std::shared_ptr<LoadedGLTF> make_triangle(const std::string& path, const glm::vec3& center, float size = 1.0f,
+					  bool textured = false);
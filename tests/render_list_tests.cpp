@@ -0,0 +1,208 @@
+#include "buffer.h"
+#include "render_list.h"
+
+#include <catch2/catch.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+// A single command with three levels of detail, the coarser ones with an
+// error of 0.05 and 1 units.
+static Draw make_draw(const Bounds& bounds, const glm::mat4& model)
+{
+	LodChain lods {};
+	lods.levels[0] = Lod { 0, 3000, 0.0f };
+	lods.levels[1] = Lod { 3000, 1500, 0.05f };
+	lods.levels[2] = Lod { 4500, 750, 1.0f };
+	lods.count = 3;
+	return Draw {
+		.command = DrawCommand { 3000, 1, 0, 0, 0 },
+		.data = DrawData { .model = model, .material = 0, .vertex_format = 0, .padding = {}, .normal_matrix = glm::mat3x4(1.0f) },
+		.texture = 0,
+		.bounds = bounds,
+		.lods = lods,
+		.meshlets = {},
+	};
+}
+
+// A unit box `depth` units in front of the camera, with its own texture and
+// material so it gets a group of its own.
+static Draw make_state_draw(GLuint texture, std::uint32_t material, float depth)
+{
+	auto draw = make_draw(Bounds { glm::vec3(-1.0f), glm::vec3(1.0f) },
+			      glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -depth)));
+	draw.texture = texture;
+	draw.data.material = material;
+	return draw;
+}
+
+static RenderList sort_draws(const std::vector<Draw>& draws, DrawOrder draw_order)
+{
+	CommandBuffer command_buffer;
+	command_buffer.add_commands(0, draws);
+	RenderList render_list;
+	render_list.compile(command_buffer);
+	render_list.sort(glm::mat4(1.0f), 1000.0f, draw_order);
+	return render_list;
+}
+
+// Textures of the groups in sorted order.
+static std::vector<GLuint> sorted_textures(const std::vector<Draw>& draws, DrawOrder draw_order)
+{
+	auto render_list = sort_draws(draws, draw_order);
+	std::vector<GLuint> textures;
+	for (auto group : render_list.order) {
+		textures.push_back(render_list.textures[group]);
+	}
+	return textures;
+}
+
+static std::uint8_t select_lod(const Bounds& bounds, const glm::mat4& model)
+{
+	CommandBuffer command_buffer;
+	command_buffer.add_commands(0, { make_draw(bounds, model) });
+	RenderList render_list;
+	render_list.compile(command_buffer);
+	render_list.sort(glm::mat4(1.0f), 1000.0f);
+	render_list.select_lods(1000.0f, 1.0f);
+	return render_list.selected_lod[0];
+}
+
+TEST_CASE("Levels of detail follow the closest point of the bounds", "[render_list]")
+{
+	// Both origins are 101 units in front of the camera, at the origin
+	// looking down -Z, where the second level is under a pixel of error.
+	auto model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -101.0f));
+
+	SECTION("A small mesh around its origin is coarse") {
+		auto small = Bounds { glm::vec3(-1.0f), glm::vec3(1.0f) };
+		CHECK(select_lod(small, model) == 1);
+	}
+
+	SECTION("A large mesh reaching the camera keeps every detail") {
+		auto large = Bounds { glm::vec3(-1.0f, -1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 100.0f) };
+		CHECK(select_lod(large, model) == 0);
+	}
+}
+
+TEST_CASE("Shadow casters are bounded by every instance", "[render_list]")
+{
+	RenderList render_list;
+	CommandBuffer command_buffer;
+	render_list.compile(command_buffer);
+	CHECK_FALSE(render_list.caster_bounds);
+
+	// Instances behind the camera still cast shadows into the view
+	auto unit = Bounds { glm::vec3(-1.0f), glm::vec3(1.0f) };
+	command_buffer.add_commands(0, {
+		make_draw(unit, glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -10.0f))),
+		make_draw(unit, glm::translate(glm::mat4(1.0f), glm::vec3(5.0f, 0.0f, 10.0f))),
+	});
+	render_list.compile(command_buffer);
+	REQUIRE(render_list.caster_bounds);
+	CHECK(render_list.caster_bounds->min == glm::vec3(-1.0f, -1.0f, -11.0f));
+	CHECK(render_list.caster_bounds->max == glm::vec3(6.0f, 1.0f, 11.0f));
+}
+
+TEST_CASE("Groups are radix sorted by key", "[render_list]")
+{
+	// Enough groups for every digit of the keys to vary, along with
+	// instances sharing a group
+	std::mt19937 random(7);
+	std::uniform_int_distribution<GLuint> texture(0, (1 << 20) - 1);
+	std::uniform_int_distribution<std::size_t> pick(0, 31);
+	std::uniform_int_distribution<std::uint32_t> material(0, 3);
+	// Some are past the far plane, where the depth is clamped
+	std::uniform_real_distribution<float> depth(0.0f, 1200.0f);
+	std::vector<GLuint> textures(32);
+	for (auto& value : textures) {
+		value = texture(random);
+	}
+	std::vector<Draw> draws;
+	for (int i = 0; i < 2000; ++i) {
+		draws.push_back(make_state_draw(textures[pick(random)], material(random), depth(random)));
+	}
+	CommandBuffer command_buffer;
+	command_buffer.add_commands(0, draws);
+	RenderList render_list;
+	render_list.compile(command_buffer);
+
+	for (auto draw_order : { DrawOrder::STATE, DrawOrder::FRONT_TO_BACK }) {
+		render_list.sort(glm::mat4(1.0f), 1000.0f, draw_order);
+		const auto& order = render_list.order;
+		REQUIRE(order.size() == render_list.size());
+		std::vector<int> seen(order.size(), 0);
+		for (auto group : order) {
+			REQUIRE(group < seen.size());
+			++seen[group];
+		}
+		CHECK(std::all_of(seen.begin(), seen.end(), [](int count) { return count == 1; }));
+		for (std::size_t i = 1; i < order.size(); ++i) {
+			REQUIRE(render_list.keys[order[i - 1]] <= render_list.keys[order[i]]);
+		}
+	}
+
+	// Sorting the same keys again keeps the same order, even though every
+	// pass starts from the previous order
+	render_list.sort(glm::mat4(1.0f), 1000.0f);
+	auto first = render_list.order;
+	render_list.sort(glm::mat4(1.0f), 1000.0f);
+	CHECK(render_list.order == first);
+}
+
+TEST_CASE("Draws are sorted by state or front to back", "[render_list]")
+{
+	SECTION("Within a state, closer groups come first") {
+		// The same state, but different indices
+		auto far = make_state_draw(1, 0, 50.0f);
+		far.command.first_index = 100;
+		auto near = make_state_draw(1, 0, 10.0f);
+		near.command.first_index = 200;
+		auto render_list = sort_draws({ far, near }, DrawOrder::STATE);
+		REQUIRE(render_list.order.size() == 2);
+		CHECK(render_list.indirect[render_list.order[0]].first_index == 200);
+		CHECK(render_list.indirect[render_list.order[1]].first_index == 100);
+	}
+
+	SECTION("The texture comes before the material, which comes before the depth") {
+		auto render_list = sort_draws({
+			make_state_draw(2, 0, 10.0f),
+			make_state_draw(1, 1, 20.0f),
+			make_state_draw(1, 0, 30.0f),
+		}, DrawOrder::STATE);
+		REQUIRE(render_list.order.size() == 3);
+		const auto& order = render_list.order;
+		CHECK(render_list.textures[order[0]] == 1);
+		CHECK(render_list.materials[order[0]] == 0);
+		CHECK(render_list.textures[order[1]] == 1);
+		CHECK(render_list.materials[order[1]] == 1);
+		CHECK(render_list.textures[order[2]] == 2);
+	}
+
+	SECTION("The state comes before the depth") {
+		auto textures = sorted_textures({
+			make_state_draw(2, 0, 10.0f),
+			make_state_draw(1, 0, 900.0f),
+		}, DrawOrder::STATE);
+		CHECK(textures == std::vector<GLuint> { 1, 2 });
+	}
+
+	SECTION("Front to back puts the closest slice first") {
+		auto textures = sorted_textures({
+			make_state_draw(2, 0, 10.0f),
+			make_state_draw(1, 0, 900.0f),
+		}, DrawOrder::FRONT_TO_BACK);
+		CHECK(textures == std::vector<GLuint> { 2, 1 });
+	}
+
+	SECTION("Front to back still sorts by state within a slice") {
+		// Both are within the first 1/256th of the far plane
+		auto textures = sorted_textures({
+			make_state_draw(2, 0, 1.0f),
+			make_state_draw(1, 0, 3.0f),
+		}, DrawOrder::FRONT_TO_BACK);
+		CHECK(textures == std::vector<GLuint> { 1, 2 });
+	}
+}
@@ -0,0 +1,69 @@
+#include "fixtures.h"
+#include "renderer.h"
+#include "shaders.h"
+
+#include <catch2/catch.hpp>
+
+TEST_CASE("GlTFs out of view are evicted once over budget", "[residency]")
+{
+	GlContext context;
+	if (!context.valid()) {
+		WARN("No OpenGL 4.5 context, skipping");
+		return;
+	}
+	auto program = compile_program();
+	REQUIRE(program);
+
+	// The camera looks down -Z, so only the first triangle is in view.
+	Renderer renderer(*program);
+	renderer.update_window(64, 64);
+	renderer.camera.set_position(glm::vec3(0.0f));
+	Scene scene;
+	scene.nodes.push_back(Node(make_triangle("in_view", glm::vec3(0.0f, 0.0f, -5.0f)), glm::mat4(1.0f)));
+	scene.nodes.push_back(Node(make_triangle("behind", glm::vec3(0.0f, 0.0f, 5.0f)), glm::mat4(1.0f)));
+	renderer.update_scene(scene);
+	auto both = renderer.collect_stats().residency.resident;
+	REQUIRE(both > 0);
+
+	// Nothing acquired this frame is evicted, so the first frame keeps both
+	renderer.set_memory_budget(1);
+	renderer.loop();
+	CHECK(renderer.collect_stats().residency.evictions == 0);
+
+	renderer.loop();
+	auto residency = renderer.collect_stats().residency;
+	CHECK(residency.evictions == 1);
+	CHECK(residency.resident > 0);
+	CHECK(residency.resident < both);
+	// One hit per glTF in view per frame, the first frame already
+	// acquired it when the scene was set
+	CHECK(residency.hits == 1);
+}
+
+TEST_CASE("Shadow casters out of view stay resident", "[residency]")
+{
+	GlContext context;
+	if (!context.valid()) {
+		WARN("No OpenGL 4.5 context, skipping");
+		return;
+	}
+	auto program = compile_program();
+	REQUIRE(program);
+
+	Renderer renderer(*program);
+	renderer.update_window(64, 64);
+	renderer.camera.set_position(glm::vec3(0.0f));
+	renderer.set_shadows(true);
+	Scene scene;
+	scene.nodes.push_back(Node(make_triangle("in_view", glm::vec3(0.0f, 0.0f, -5.0f)), glm::mat4(1.0f)));
+	scene.nodes.push_back(Node(make_triangle("behind", glm::vec3(0.0f, 0.0f, 5.0f)), glm::mat4(1.0f)));
+	renderer.update_scene(scene);
+	auto both = renderer.collect_stats().residency.resident;
+
+	renderer.set_memory_budget(1);
+	renderer.loop();
+	renderer.loop();
+	auto residency = renderer.collect_stats().residency;
+	CHECK(residency.evictions == 0);
+	CHECK(residency.resident == both);
+}
@@ -0,0 +1,57 @@
+#include "fixtures.h"
+#include "renderer.h"
+#include "shaders.h"
+
+#include <glad/gl.h>
+
+#include <catch2/catch.hpp>
+
+#include <array>
+
+static std::array<unsigned char, 4> read_pixel(GLint x, GLint y)
+{
+	std::array<unsigned char, 4> pixel {};
+	glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel.data());
+	return pixel;
+}
+
+TEST_CASE("Meshes in different vertex layouts are pulled in the same draw", "[vertex_pulling]")
+{
+	GlContext context;
+	if (!context.valid()) {
+		WARN("No OpenGL 4.5 context, skipping");
+		return;
+	}
+	auto program = compile_program();
+	REQUIRE(program);
+
+	Renderer renderer(*program);
+	renderer.update_window(64, 64);
+	renderer.camera.set_position(glm::vec3(0.0f));
+	renderer.set_vertex_pulling(true);
+
+	// A white textured triangle with a smaller one in front of it, which
+	// has no texture coordinates so it is stored in the compact layout.
+	// Untextured meshes are drawn black.
+	Scene scene;
+	scene.nodes.push_back(
+		Node(make_triangle("textured", glm::vec3(0.0f, 0.0f, -6.0f), 2.0f, true), glm::mat4(1.0f)));
+	scene.nodes.push_back(Node(make_triangle("compact", glm::vec3(0.0f, 0.0f, -5.0f)), glm::mat4(1.0f)));
+	renderer.update_scene(scene);
+	renderer.loop();
+
+	// The middle of the view only sees the compact triangle, and below it
+	// only the textured one shows
+	auto front = read_pixel(32, 32);
+	auto back = read_pixel(32, 20);
+	CHECK(front[0] == 0);
+	CHECK(back[0] == 255);
+	CHECK(back[1] == 255);
+	CHECK(back[2] == 255);
+
+	// Meshes in the compact layout can only be pulled
+	renderer.set_vertex_pulling(false);
+	renderer.loop();
+	CHECK(read_pixel(32, 32)[0] == 0);
+	CHECK(read_pixel(32, 20)[0] == 255);
+}